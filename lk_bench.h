@@ -0,0 +1,497 @@
+//  lk_bench.h - public domain microbenchmark harness on top of lk_debug.h
+//  no warranty is offered or implied
+
+/*********************************************************************************************
+
+Include this file in all places you need to refer to it. In one of your compilation units, write:
+    #define LK_BENCH_IMPLEMENTATION
+before including lk_bench.h, in order to paste in the source code. lk_bench.h includes lk_debug.h, and
+times everything with lkdbg_get_time(), so LKDBG_IMPLEMENTATION has to be defined somewhere too.
+
+QUICK NOTES
+    A benchmark is a function that runs the code being measured 'iterations' times:
+
+        void bench_region_alloc(void* userdata, unsigned long long iterations)
+        {
+            LK_Region* region = (LK_Region*) userdata;
+            for (unsigned long long i = 0; i < iterations; i++)
+            {
+                void* memory = lk_region_alloc(region, 64, 8);
+                LK_BENCH_KEEP(memory);
+            }
+            lk_region_free(region);
+        }
+
+    Run it with lk_bench_run(), and print what you got:
+
+        lkdbg_start(LKDBG_CAPTURE_PERF_COUNTERS | LKDBG_STATISTICS_ONLY);
+        lkdbg_register_thread("main");
+
+        LK_Bench_Result results[2];
+        lk_bench_run(&results[0], "region alloc 64", bench_region_alloc, &region, 0);
+        lk_bench_run(&results[1], "malloc 64", bench_malloc, 0, 0);
+        lk_bench_print(results, 2);
+        lk_bench_write_json("bench.json", results, 2);
+
+        lkdbg_end(0);
+
+    In C++, lk_bench_run() also takes a lambda, as in lk_bench_run(&result, "name", [&](unsigned long long n) { ... }).
+
+    Starting lk_debug first isn't required, but it's what gets you the TSC instead of the system clock, and
+    LKDBG_CAPTURE_PERF_COUNTERS on a registered thread adds cycles, instructions, cache and branch misses
+    per iteration to the results, where the machine has them. lk_debug blocks in the code being measured
+    cost what they always cost, so turn them off with lkdbg_set_enabled(0) if that's not what you want.
+
+    Every benchmark is run the same way:
+     1. Warmup. It runs with more and more iterations until it has run for LK_Bench_Options::warmup_ms,
+        and one run takes at least min_time_ms. That's also how the iteration count is chosen, so a
+        repetition is long enough for the clock and the loop around your code not to matter.
+     2. Repetitions. It runs 'repetitions' times with that iteration count, each timed on its own.
+     3. Outliers. Repetitions slower than the third quartile plus outlier_k times the interquartile range
+        (Tukey's fences) were almost certainly interrupted, and are left out of the mean, the standard
+        deviation and the counters. Only slow ones are dropped; code doesn't get faster by accident.
+    The percentiles are of all repetitions, with the nearest rank method, so they still show how bad the
+    slow ones were. Times and counters are per iteration.
+
+    Pin the benchmark to a CPU with LK_Bench_Options::cpu, so the scheduler doesn't move it around (and the
+    caches with it) in the middle. It's put back where it was allowed to run before, afterwards.
+
+LICENSE
+    This software is in the public domain. Anyone can use it, modify it,
+    roll'n'smoke hardcopies of the source code, sell it to the terrorists, etc.
+    No warranty is offered or implied; use this code at your own risk!
+
+    See end of file for license information.
+
+ *********************************************************************************************/
+
+#ifndef LK_BENCH_HEADER
+#define LK_BENCH_HEADER
+
+#include "lk_debug.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Header
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    int warmup_ms;     // at least this long before the repetitions (default 100)
+    int min_time_ms;   // shortest repetition (default 10)
+    int repetitions;   // (default 30)
+    double outlier_k;  // Tukey's k, repetitions above Q3 + k * IQR are outliers (default 3, <= 0 keeps all)
+    int cpu;           // to pin the thread to while it runs, or -1 to leave it alone (default)
+} LK_Bench_Options;
+
+typedef struct
+{
+    const char* name;
+    unsigned long long iterations; // per repetition
+    int repetitions;
+    int outliers;
+
+    // nanoseconds per iteration
+    double mean;
+    double stddev;
+    double min;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+
+    // per iteration, averaged over the repetitions that aren't outliers, see lkdbg_read_perf_counters()
+    unsigned int counter_mask;
+    double counters[LKDBG_PERF_COUNTER_COUNT];
+} LK_Bench_Result;
+
+typedef void LK_Bench_Function(void* userdata, unsigned long long iterations);
+
+void lk_bench_default_options(LK_Bench_Options* options);
+
+// 'options' can be 0 for the defaults. 'name' isn't copied.
+void lk_bench_run(LK_Bench_Result* result, const char* name, LK_Bench_Function* function, void* userdata, const LK_Bench_Options* options);
+
+void lk_bench_print(const LK_Bench_Result* results, int count);
+int  lk_bench_write_json(const char* path, const LK_Bench_Result* results, int count); // returns 0 on failure
+
+// Makes the compiler believe the value 'pointer' points to is used, so it doesn't optimize the work away.
+#if defined(_MSC_VER)
+extern void* volatile lk_bench_sink;
+#define LK_BENCH_KEEP(pointer) do { lk_bench_sink = (void*)(pointer); _ReadWriteBarrier(); } while (0)
+#else
+#define LK_BENCH_KEEP(pointer) __asm__ __volatile__("" : : "r"(pointer) : "memory")
+#endif
+
+#ifdef __cplusplus
+}
+
+template <typename F>
+static void lk_bench_run(LK_Bench_Result* result, const char* name, F function, const LK_Bench_Options* options = 0)
+{
+    struct Call
+    {
+        static void call(void* userdata, unsigned long long iterations) { (*(F*) userdata)(iterations); }
+    };
+    lk_bench_run(result, name, Call::call, &function, options);
+}
+#endif
+
+#endif // LK_BENCH_HEADER
+
+////////////////////////////////////////////////////////////////////////////////
+// Implementation
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef LK_BENCH_IMPLEMENTATION
+#ifndef LK_BENCH_IMPLEMENTED
+#define LK_BENCH_IMPLEMENTED
+
+#ifndef LK_BENCH_MALLOC
+ #include <stdlib.h>
+ #define LK_BENCH_MALLOC(size) malloc(size)
+#endif
+
+#ifndef LK_BENCH_FREE
+ #define LK_BENCH_FREE(size) free(size)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#else
+#error Unrecognized operating system
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if defined(_MSC_VER)
+void* volatile lk_bench_sink;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Platform
+
+#if defined(_WIN32)
+
+typedef DWORD_PTR LK_Bench_Affinity;
+
+static int lk_bench_pin(int cpu, LK_Bench_Affinity* previous)
+{
+    *previous = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu);
+    return *previous != 0;
+}
+
+static void lk_bench_unpin(LK_Bench_Affinity* previous)
+{
+    SetThreadAffinityMask(GetCurrentThread(), *previous);
+}
+
+#elif defined(__linux__)
+
+typedef cpu_set_t LK_Bench_Affinity;
+
+static int lk_bench_pin(int cpu, LK_Bench_Affinity* previous)
+{
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), previous) != 0) return 0;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+}
+
+static void lk_bench_unpin(LK_Bench_Affinity* previous)
+{
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), previous);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Running
+
+static const char* lk_bench_counter_names[LKDBG_PERF_COUNTER_COUNT] =
+{
+    "cycles", "instructions", "cache_misses", "branch_misses", "page_faults", "context_switches", "task_clock_ns",
+};
+
+// Short enough for a table column.
+static const char* lk_bench_counter_headers[LKDBG_PERF_COUNTER_COUNT] =
+{
+    "cycles", "instr", "cache miss", "br miss", "faults", "switches", "task ns",
+};
+
+void lk_bench_default_options(LK_Bench_Options* options)
+{
+    options->warmup_ms = 100;
+    options->min_time_ms = 10;
+    options->repetitions = 30;
+    options->outlier_k = 3;
+    options->cpu = -1;
+}
+
+static unsigned long long lk_bench_time(LK_Bench_Function* function, void* userdata, unsigned long long iterations)
+{
+    unsigned long long start = lkdbg_get_time();
+    function(userdata, iterations);
+    return lkdbg_get_time() - start;
+}
+
+static int lk_bench_compare_doubles(const void* a, const void* b)
+{
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return (da > db) - (da < db);
+}
+
+// Nearest rank, of sorted values.
+static double lk_bench_percentile(const double* sorted, int count, double percentile)
+{
+    int rank = (int) ceil(percentile * (double) count);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+void lk_bench_run(LK_Bench_Result* result, const char* name, LK_Bench_Function* function, void* userdata, const LK_Bench_Options* options)
+{
+    LK_Bench_Options defaults;
+    lk_bench_default_options(&defaults);
+    if (!options) options = &defaults;
+
+    int repetitions = options->repetitions > 0 ? options->repetitions : 1;
+    memset(result, 0, sizeof(LK_Bench_Result));
+    result->name = name;
+    result->repetitions = repetitions;
+
+    LK_Bench_Affinity previous_affinity;
+    int pinned = 0;
+    if (options->cpu >= 0)
+    {
+        pinned = lk_bench_pin(options->cpu, &previous_affinity);
+        if (!pinned) printf("Failed to pin benchmark %s to CPU %d\n", name, options->cpu);
+    }
+
+    unsigned long long frequency = lkdbg_get_time_frequency();
+    unsigned long long min_time = (unsigned long long)((double) options->min_time_ms * (double) frequency / 1000.0);
+    unsigned long long warmup_end = lkdbg_get_time() + (unsigned long long)((double) options->warmup_ms * (double) frequency / 1000.0);
+    if (min_time < 1) min_time = 1;
+
+    // grow by at most 10x at a time, aiming a bit over, so it doesn't take many steps to get there
+    unsigned long long iterations = 1;
+    for (;;)
+    {
+        unsigned long long elapsed = lk_bench_time(function, userdata, iterations);
+        if (elapsed >= min_time)
+        {
+            if (lkdbg_get_time() >= warmup_end) break;
+            continue;
+        }
+
+        double scale = elapsed ? 1.4 * (double) min_time / (double) elapsed : 10.0;
+        if (scale > 10.0) scale = 10.0;
+        unsigned long long next = (unsigned long long)((double) iterations * scale);
+        iterations = next > iterations ? next : iterations + 1;
+    }
+    result->iterations = iterations;
+
+    double* times = (double*) LK_BENCH_MALLOC(sizeof(double) * repetitions * 2);
+    double* sorted = times + repetitions;
+    double* counters = (double*) LK_BENCH_MALLOC(sizeof(double) * repetitions * LKDBG_PERF_COUNTER_COUNT);
+
+    double nanoseconds_per_tick = 1000000000.0 / (double) frequency;
+    for (int i = 0; i < repetitions; i++)
+    {
+        unsigned long long before[LKDBG_PERF_COUNTER_COUNT];
+        unsigned long long after[LKDBG_PERF_COUNTER_COUNT];
+        unsigned int mask = lkdbg_read_perf_counters(before);
+
+        unsigned long long elapsed = lk_bench_time(function, userdata, iterations);
+
+        if (mask) mask &= lkdbg_read_perf_counters(after);
+        result->counter_mask = i ? (result->counter_mask & mask) : mask;
+
+        times[i] = (double) elapsed * nanoseconds_per_tick / (double) iterations;
+        for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+            counters[i * LKDBG_PERF_COUNTER_COUNT + j] = (mask & (1u << j)) ? (double)(after[j] - before[j]) / (double) iterations : 0;
+    }
+
+    if (pinned)
+        lk_bench_unpin(&previous_affinity);
+
+    memcpy(sorted, times, sizeof(double) * repetitions);
+    qsort(sorted, repetitions, sizeof(double), lk_bench_compare_doubles);
+    result->min = sorted[0];
+    result->p50 = lk_bench_percentile(sorted, repetitions, 0.50);
+    result->p90 = lk_bench_percentile(sorted, repetitions, 0.90);
+    result->p99 = lk_bench_percentile(sorted, repetitions, 0.99);
+    result->max = sorted[repetitions - 1];
+
+    double fence = sorted[repetitions - 1];
+    if (options->outlier_k > 0)
+    {
+        double q1 = lk_bench_percentile(sorted, repetitions, 0.25);
+        double q3 = lk_bench_percentile(sorted, repetitions, 0.75);
+        fence = q3 + options->outlier_k * (q3 - q1);
+    }
+
+    int kept = 0;
+    double sum = 0;
+    for (int i = 0; i < repetitions; i++)
+    {
+        if (times[i] > fence) continue;
+        kept++;
+        sum += times[i];
+        for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+            result->counters[j] += counters[i * LKDBG_PERF_COUNTER_COUNT + j];
+    }
+
+    result->outliers = repetitions - kept;
+    result->mean = sum / (double) kept;
+    for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+        result->counters[j] = (result->counter_mask & (1u << j)) ? result->counters[j] / (double) kept : 0;
+
+    double squares = 0;
+    for (int i = 0; i < repetitions; i++)
+        if (times[i] <= fence)
+            squares += (times[i] - result->mean) * (times[i] - result->mean);
+    result->stddev = kept > 1 ? sqrt(squares / (double)(kept - 1)) : 0;
+
+    LK_BENCH_FREE(times);
+    LK_BENCH_FREE(counters);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+
+void lk_bench_print(const LK_Bench_Result* results, int count)
+{
+    // a counter gets a column if any of the results has it
+    unsigned int mask = 0;
+    for (int i = 0; i < count; i++)
+        mask |= results[i].counter_mask;
+
+    printf("%-32s %12s %5s %4s %12s %8s %12s %12s %12s", "benchmark", "iterations", "reps", "out", "mean ns", "stddev", "p50 ns", "p90 ns", "p99 ns");
+    for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+        if (mask & (1u << j))
+            printf(" %10s", lk_bench_counter_headers[j]);
+    printf("\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        const LK_Bench_Result* result = &results[i];
+        printf("%-32s %12llu %5d %4d %12.2f %7.1f%% %12.2f %12.2f %12.2f", result->name, result->iterations,
+               result->repetitions, result->outliers, result->mean, result->mean > 0 ? 100.0 * result->stddev / result->mean : 0,
+               result->p50, result->p90, result->p99);
+        for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+        {
+            if (!(mask & (1u << j))) continue;
+            if (result->counter_mask & (1u << j))
+                printf(" %10.2f", result->counters[j]);
+            else
+                printf(" %10s", "-");
+        }
+        printf("\n");
+    }
+}
+
+static void lk_bench_write_json_string(FILE* out, const char* string)
+{
+    fputc('"', out);
+    for (const char* c = string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if ((unsigned char) *c < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char) *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+int lk_bench_write_json(const char* path, const LK_Bench_Result* results, int count)
+{
+    FILE* out = fopen(path, "wb");
+    if (!out)
+    {
+        printf("Failed to open %s for writing\n", path);
+        return 0;
+    }
+
+    fprintf(out, "{\n  \"benchmarks\": [");
+    for (int i = 0; i < count; i++)
+    {
+        const LK_Bench_Result* result = &results[i];
+        fprintf(out, "%s\n    {\n      \"name\": ", i ? "," : "");
+        lk_bench_write_json_string(out, result->name);
+        fprintf(out, ",\n      \"iterations\": %llu,\n      \"repetitions\": %d,\n      \"outliers\": %d,\n",
+                result->iterations, result->repetitions, result->outliers);
+        fprintf(out, "      \"mean_ns\": %.3f,\n      \"stddev_ns\": %.3f,\n      \"min_ns\": %.3f,\n", result->mean, result->stddev, result->min);
+        fprintf(out, "      \"p50_ns\": %.3f,\n      \"p90_ns\": %.3f,\n      \"p99_ns\": %.3f,\n      \"max_ns\": %.3f,\n",
+                result->p50, result->p90, result->p99, result->max);
+
+        fprintf(out, "      \"counters\": {");
+        int first = 1;
+        for (int j = 0; j < LKDBG_PERF_COUNTER_COUNT; j++)
+        {
+            if (!(result->counter_mask & (1u << j))) continue;
+            fprintf(out, "%s \"%s\": %.3f", first ? "" : ",", lk_bench_counter_names[j], result->counters[j]);
+            first = 0;
+        }
+        fprintf(out, "%s}\n    }", first ? "" : " ");
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    fclose(out);
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LK_BENCH_IMPLEMENTED
+#endif // LK_BENCH_IMPLEMENTATION
+
+
+/*********************************************************************************************
+
+THE UNLICENCE (http://unlicense.org)
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+    software, either in source code form or as a compiled binary, for any purpose,
+    commercial or non-commercial, and by any means.
+
+    In jurisdictions that recognize copyright laws, the author or authors of this
+    software dedicate any and all copyright interest in the software to the public
+    domain. We make this dedication for the benefit of the public at large and to
+    the detriment of our heirs and successors. We intend this dedication to be an
+    overt act of relinquishment in perpetuity of all present and future rights to
+    this software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+    ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ *********************************************************************************************/
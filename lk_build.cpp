@@ -3,13 +3,31 @@
 #include <string.h>
 #include <ctype.h>
 
+#ifdef _WIN32
 #include <windows.h>
-#include <Shlwapi.h>
-
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
+#include <string>
 #include <vector>
 #include <set>
 #include <map>
 
+#ifdef _WIN32
+#define PATH_SEPARATOR "\\"
+#else
+#define PATH_SEPARATOR "/"
+extern char** environ;
+#endif
+
 char* copy_string(char* string)
 {
     int length = strlen(string);
@@ -28,7 +46,7 @@ char* copy_string(char* from, char* to)
     return new_string;
 }
 
-char* concatenate(char* left, char* right)
+char* concatenate(const char* left, const char* right)
 {
     int length_left = strlen(left);
     int length_right = strlen(right);
@@ -40,7 +58,7 @@ char* concatenate(char* left, char* right)
     return new_string;
 }
 
-char* concatenate(char* left, char* middle, char* right)
+char* concatenate(const char* left, const char* middle, const char* right)
 {
     int length_left = strlen(left);
     int length_middle = strlen(middle);
@@ -126,11 +144,11 @@ bool is_source_file(char* string)
            ends_with(string, ".cxx");
 }
 
-bool is_header_file(char* string)
+struct Content_Hash
 {
-    return ends_with(string, ".h") ||
-           ends_with(string, ".hpp");
-}
+    unsigned long long low;
+    unsigned long long high;
+};
 
 struct Tracked_File
 {
@@ -139,26 +157,68 @@ struct Tracked_File
 
     bool dirty = false;
 
-    bool found_dependencies = false;
     std::set<Tracked_File*> depends;
     std::set<Tracked_File*> depend_on_me;
 
-    FILETIME write_time;
-    FILETIME db_time = {};
+    // FILETIME on Windows, nanoseconds since the epoch elsewhere
+    unsigned long long write_time = 0;
+    unsigned long long db_time = 0;
+
+    // only with content_hash, for the contents at write_time and at db_time
+    bool hashed = false;
+    bool has_db_hash = false;
+    Content_Hash hash = {};
+    Content_Hash db_hash = {};
+
+    // only with early_cutoff, for the preprocessed source the object file was compiled from
+    bool has_preprocessed_hash = false;
+    Content_Hash preprocessed_hash = {};
+};
+
+struct Database_Entry
+{
+    unsigned long long time = 0;
+    std::vector<char*> paths; // the dependencies of a file, or the contents of a folder
+
+    bool has_hash = false;
+    Content_Hash hash = {};
+
+    bool has_preprocessed_hash = false;
+    Content_Hash preprocessed_hash = {};
 };
 
 struct Configuration
 {
+    char* root; // the current directory, with a trailing slash
     char* obj_output;
-    char* cl_options = "";
+#ifdef _WIN32
+    char* compiler = "cl";
+    char* linker = "link";
+#else
+    char* compiler = "cc";
+    char* linker = "c++";
+#endif
+    char* compiler_options = "";
     char* link_options = "";
     char* libraries = "";
 
+    int jobs = 0; // 0 means one per logical processor
+    bool stop_on_error = false;
+    bool content_hash = false;
+    // Skips compiles whose preprocessed source didn't change. Without debug info, line markers are left
+    // out and whitespace is normalized, so edits that only move code to other lines, like adding a comment
+    // line to a header, don't cause compiles. With debug info, the line tables would go stale, so the
+    // preprocessed source is hashed with its line markers and whitespace as it is.
+    bool early_cutoff = false;
+
     std::vector<char*> includes;
     std::vector<char*> excludes;
     std::vector<char*> source_files;
 
     std::map<std::string, Tracked_File*> tracked_files;
+
+    std::map<std::string, Database_Entry> database; // as it was read
+    std::map<std::string, Database_Entry> folders;  // as they were found, to be written
 };
 
 char* sanitize_path(char* path)
@@ -198,7 +258,7 @@ char* sanitize_path(char* path)
             }
             else
             {
-                printf("Encountered a path that escapes the root folder.\nPath is %s\nNote that lk_build.exe must be in the source tree root.\n", path);
+                printf("Encountered a path that escapes the root folder.\nPath is %s\nNote that lk_build must be run from the source tree root.\n", path);
                 exit(0);
             }
         }
@@ -223,7 +283,7 @@ char* sanitize_path(char* path)
         int length = strlen(name);
         memcpy(write, name, length);
         write += length;
-        write[0] = '\\';
+        write[0] = PATH_SEPARATOR[0];
         write++;
     }
     write[0] = 0;
@@ -243,6 +303,8 @@ char* file_to_folder(char* path)
     return sanitize_path(concatenate(path, "/.."));
 }
 
+#ifdef _WIN32
+
 void list_folder(std::vector<char*>& files, char* folder, bool directories)
 {
     char* wildcard = concatenate(folder, "*");
@@ -272,24 +334,144 @@ void list_folder(std::vector<char*>& files, char* folder, bool directories)
         files.push_back(path);
     }
     while (FindNextFileA(handle, &file_data) != 0);
+
+    FindClose(handle);
 }
 
+// Works for folders too, without opening them.
+bool get_file_time(char* path, unsigned long long* time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return false;
+
+    FILETIME write_time = data.ftLastWriteTime;
+    *time = ((unsigned long long) write_time.dwHighDateTime << 32) | write_time.dwLowDateTime;
+    return true;
+}
+
+void find_root(Configuration* config)
+{
+    char directory[MAX_PATH];
+    if (!GetCurrentDirectoryA(sizeof(directory), directory))
+    {
+        printf("GetCurrentDirectoryA() failed!\n");
+        exit(0);
+    }
+
+    config->root = ends_with(directory, "\\") ? copy_string(directory) : concatenate(directory, "\\");
+}
+
+bool starts_with_root(Configuration* config, char* path)
+{
+    return !_strnicmp(path, config->root, strlen(config->root));
+}
+
+#else
+
+void list_folder(std::vector<char*>& files, char* folder, bool directories)
+{
+    DIR* handle = opendir(*folder ? folder : ".");
+    if (!handle)
+    {
+        printf("opendir() failed while searching for files in folder %s!\n", folder);
+        exit(0);
+    }
+
+    while (struct dirent* entry = readdir(handle))
+    {
+        char* name = entry->d_name;
+        if (match(name, ".")) continue;
+        if (match(name, "..")) continue;
+
+        char* path = concatenate(folder, name);
+
+        // some file systems don't fill in d_type, and symbolic links are followed like on Windows
+        bool directory = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        {
+            struct stat info;
+            directory = !stat(path, &info) && S_ISDIR(info.st_mode);
+        }
+        if (directory != directories) continue;
+
+        if (directory)
+            path = concatenate(path, "/");
+        files.push_back(path);
+    }
+
+    closedir(handle);
+}
+
+bool get_file_time(char* path, unsigned long long* time)
+{
+    struct statx info;
+    if (statx(AT_FDCWD, path, 0, STATX_MTIME, &info) != 0)
+        return false;
+
+    *time = (unsigned long long) info.stx_mtime.tv_sec * 1000000000ull + info.stx_mtime.tv_nsec;
+    return true;
+}
+
+void find_root(Configuration* config)
+{
+    char* directory = getcwd(NULL, 0);
+    if (!directory)
+    {
+        printf("getcwd() failed: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    config->root = ends_with(directory, "/") ? directory : concatenate(directory, "/");
+}
+
+bool starts_with_root(Configuration* config, char* path)
+{
+    return starts_with(path, config->root);
+}
+
+#endif
+
 void recursive_file_search(Configuration* config, char* folder)
 {
     for (char* excluded : config->excludes)
         if (match(folder, excluded))
             return;
 
-    std::vector<char*> files;
-    list_folder(files, folder, false);
-    for (char* file : files)
-        if (is_source_file(file))
-            config->source_files.push_back(file);
+    // Adding, removing or renaming something in a folder changes the folder's time, so if that didn't
+    // change, the folder still has what the database says it had on the last run.
+    char* key = folder;
+    if (!*key) key = "." PATH_SEPARATOR;
+    Database_Entry* entry = &config->folders[key];
+    if (!get_file_time(key, &entry->time))
+    {
+        printf("Failed to get the modification time of folder %s\n", key);
+        exit(0);
+    }
 
-    std::vector<char*> folders;
-    list_folder(folders, folder, true);
-    for (char* folder : folders)
-        recursive_file_search(config, folder);
+    auto cached = config->database.find(key);
+    if (cached != config->database.end() && cached->second.time == entry->time)
+    {
+        entry->paths = cached->second.paths;
+    }
+    else
+    {
+        std::vector<char*> files;
+        list_folder(files, folder, false);
+        for (char* file : files)
+            if (is_source_file(file))
+                entry->paths.push_back(file);
+
+        list_folder(entry->paths, folder, true);
+    }
+
+    for (char* path : entry->paths)
+    {
+        if (ends_with(path, PATH_SEPARATOR))
+            recursive_file_search(config, path);
+        else
+            config->source_files.push_back(path);
+    }
 }
 
 void find_all_source_files(Configuration* config)
@@ -300,108 +482,204 @@ void find_all_source_files(Configuration* config)
 
 static char line_buffer[16 * 1024 * 1024];
 
-void scan_file_for_dependencies(std::vector<char*>& dependencies, char* path)
+// A fast non-cryptographic hash in the style of XXH64: four independent lanes over 32 byte stripes, so
+// it runs at memory speed, and two differently mixed 64-bit results from the lanes.
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+
+unsigned long long rotate_left(unsigned long long value, int bits)
 {
-    FILE* in = fopen(path, "rt");
-    if (!in)
+    return (value << bits) | (value >> (64 - bits));
+}
+
+unsigned long long hash_round(unsigned long long lane, unsigned long long input)
+{
+    lane += input * HASH_PRIME2;
+    lane = rotate_left(lane, 31);
+    return lane * HASH_PRIME1;
+}
+
+unsigned long long hash_avalanche(unsigned long long hash)
+{
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+struct Hash_State
+{
+    unsigned long long lanes[4];
+    unsigned long long length;
+    char stripe[32]; // a partial stripe, until there's more data
+    size_t carried;
+};
+
+void hash_begin(Hash_State* state)
+{
+    state->lanes[0] = HASH_PRIME1 + HASH_PRIME2;
+    state->lanes[1] = HASH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = 0 - HASH_PRIME1;
+    state->length = 0;
+    state->carried = 0;
+}
+
+void hash_stripe(Hash_State* state, char* data)
+{
+    unsigned long long input[4];
+    memcpy(input, data, 32);
+    for (int lane = 0; lane < 4; lane++)
+        state->lanes[lane] = hash_round(state->lanes[lane], input[lane]);
+}
+
+void hash_update(Hash_State* state, char* data, size_t size)
+{
+    state->length += size;
+
+    if (state->carried)
     {
-        printf("Failed to open file \"%s\" for reading!\n", path);
-        exit(0);
+        size_t missing = 32 - state->carried;
+        size_t take = (size < missing) ? size : missing;
+        memcpy(state->stripe + state->carried, data, take);
+        state->carried += take;
+        data += take;
+        size -= take;
+
+        if (state->carried < 32)
+            return;
+        hash_stripe(state, state->stripe);
+        state->carried = 0;
     }
 
-    int line_number = 0;
-    while (fgets(line_buffer, sizeof(line_buffer), in))
+    while (size >= 32)
     {
-        line_number++;
-        char* cursor = line_buffer;
-        char* token = eat_token(&cursor);
-        if (!token) continue;
+        hash_stripe(state, data);
+        data += 32;
+        size -= 32;
+    }
 
-        if (match(token, "#"))
-        {
-            token = eat_token(&cursor);
-            if (!token) continue;
-            if (!match(token, "include"))
-                continue;
-        }
-        else
-        {
-            if (!match(token, "#include"))
-                continue;
-        }
+    memcpy(state->stripe, data, size);
+    state->carried = size;
+}
 
-        char* relative = trim(&cursor);
-        int length = strlen(relative);
-        if (length < 3) continue;
-        if (relative[0] != '"' || relative[length - 1] != '"') continue;
+Content_Hash hash_end(Hash_State* state)
+{
+    if (state->carried)
+    {
+        memset(state->stripe + state->carried, 0, 32 - state->carried);
+        hash_stripe(state, state->stripe);
+    }
 
-        relative[length - 1] = 0; // remove trailing "
-        relative++; // skip first "
+    unsigned long long* lanes = state->lanes;
+    unsigned long long low  = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+    unsigned long long high = rotate_left(lanes[0], 18) + rotate_left(lanes[1], 12) + rotate_left(lanes[2], 7) + rotate_left(lanes[3], 1);
 
-        char* dependency = sanitize_file(concatenate(file_to_folder(path), relative));
-        dependencies.push_back(dependency);
-    }
+    Content_Hash hash;
+    hash.low = hash_avalanche(low + state->length);
+    hash.high = hash_avalanche(high ^ (state->length * HASH_PRIME3));
+    return hash;
+}
+
+bool hash_file(char* path, Content_Hash* hash)
+{
+    FILE* in = fopen(path, "rb");
+    if (!in)
+        return false;
+
+    Hash_State state;
+    hash_begin(&state);
 
+    size_t count;
+    while ((count = fread(line_buffer, 1, sizeof(line_buffer), in)) > 0)
+        hash_update(&state, line_buffer, count);
+
+    bool failed = ferror(in);
     fclose(in);
+    if (failed)
+        return false;
+
+    *hash = hash_end(&state);
+    return true;
 }
 
-void find_dependencies(Configuration* config)
+// Hashes preprocessed source without the whitespace that doesn't matter: runs of blank space become a
+// single space, and runs with a line break become a single line break, so indentation and blank lines
+// from removed comments and conditionals don't count. String and character literals are kept as they
+// are. Raw string literals with quotes in them aren't understood, which can only cost a compile.
+bool hash_preprocessed_file(char* path, Content_Hash* hash)
 {
-    for (char* source : config->source_files)
-    {
-        Tracked_File* file = new Tracked_File;
-        file->path = source;
-        file->is_source = true;
-        config->tracked_files[source] = file;
-    }
+    FILE* in = fopen(path, "rb");
+    if (!in)
+        return false;
 
-    bool found_new = true;
-    while (found_new)
-    {
-        found_new = false;
+    Hash_State state;
+    hash_begin(&state);
 
-        std::vector<Tracked_File*> pass;
-        for (auto& it : config->tracked_files)
-            pass.push_back(it.second);
+    char normalized[4096];
+    size_t length = 0;
 
-        for (Tracked_File* file : pass)
+    char space = 0;
+    char quote = 0;
+    bool escaped = false;
+
+    size_t count;
+    while ((count = fread(line_buffer, 1, sizeof(line_buffer), in)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
         {
-            if (file->found_dependencies)
+            char c = line_buffer[i];
+            if (quote)
+            {
+                if (escaped)
+                    escaped = false;
+                else if (c == '\\')
+                    escaped = true;
+                else if (c == quote || c == '\n')
+                    quote = 0;
+            }
+            else if (isspace((unsigned char) c))
+            {
+                if (c == '\n' || c == '\r')
+                    space = '\n';
+                else if (!space)
+                    space = ' ';
                 continue;
+            }
+            else if (c == '"' || c == '\'')
+            {
+                quote = c;
+            }
 
-            if (is_source_file(file->path) || is_header_file(file->path))
+            if (length + 2 > sizeof(normalized))
             {
-                std::vector<char*> dependencies;
-                scan_file_for_dependencies(dependencies, file->path);
-                for (char* dependency : dependencies)
-                {
-                    for (char* excluded : config->excludes)
-                        if (starts_with(dependency, excluded))
-                            goto skip_dependency;
-
-                    Tracked_File* existing = config->tracked_files[dependency];
-                    if (existing)
-                    {
-                        existing->depend_on_me.insert(file);
-                        continue;
-                    }
-
-                    Tracked_File* new_file = new Tracked_File;
-                    new_file->path = dependency;
-                    new_file->is_source = false;
-                    config->tracked_files[dependency] = new_file;
-                    found_new = true;
-
-                    file->depends.insert(new_file);
-                    new_file->depend_on_me.insert(file);
-
-                    skip_dependency:;
-                }
+                hash_update(&state, normalized, length);
+                length = 0;
             }
 
-            file->found_dependencies = true;
+            if (space && state.length + length)
+                normalized[length++] = space;
+            space = 0;
+            normalized[length++] = c;
         }
     }
+    hash_update(&state, normalized, length);
+
+    bool failed = ferror(in);
+    fclose(in);
+    if (failed)
+        return false;
+
+    *hash = hash_end(&state);
+    return true;
+}
+
+bool same_hash(Content_Hash a, Content_Hash b)
+{
+    return a.low == b.low && a.high == b.high;
 }
 
 void find_file_times(Configuration* config)
@@ -410,19 +688,32 @@ void find_file_times(Configuration* config)
     {
         Tracked_File* file = it.second;
 
-        HANDLE handle = CreateFileA(file->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (handle == INVALID_HANDLE_VALUE)
+        // a dependency that was deleted has to be dirty, and its dependents will find out if it's still needed
+        if (!get_file_time(file->path, &file->write_time))
         {
-            printf("CreateFileA() failed for file %s\n", file->path);
-            exit(0);
+            if (file->is_source)
+            {
+                printf("Failed to get the modification time of file %s\n", file->path);
+                exit(0);
+            }
+            file->write_time = 0;
+            continue;
         }
 
-        FILETIME create_time, access_time, write_time;
-        GetFileTime(handle, &create_time, &access_time, &write_time);
-
-        CloseHandle(handle);
-
-        file->write_time = write_time;
+        // Only files whose time changed are read. The rest keep the hash from the database, unless they
+        // don't have one yet, because content_hash was just turned on.
+        if (config->content_hash)
+        {
+            if (file->has_db_hash && file->db_time == file->write_time)
+            {
+                file->hash = file->db_hash;
+                file->hashed = true;
+            }
+            else
+            {
+                file->hashed = hash_file(file->path, &file->hash);
+            }
+        }
     }
 }
 
@@ -479,11 +770,25 @@ void read_config_file(Configuration* config, char* configuration_path)
             path = sanitize_path(path);
             config->obj_output = path;
         }
-        else if (match(command, "cl_options"))
+        else if (match(command, "compiler") || match(command, "linker"))
+        {
+            char* string = trim(&cursor);
+            if (!string)
+            {
+                printf("Expected a program name after \"%s\" on line %d in lk_build.txt\n", command, line_number);
+                exit(0);
+            }
+
+            if (match(command, "compiler"))
+                config->compiler = string;
+            else
+                config->linker = string;
+        }
+        else if (match(command, "compiler_options") || match(command, "cl_options"))
         {
             char* string = trim(&cursor);
             if (!string) string = "";
-            config->cl_options = string;
+            config->compiler_options = string;
         }
         else if (match(command, "link_options"))
         {
@@ -497,6 +802,29 @@ void read_config_file(Configuration* config, char* configuration_path)
             if (!string) string = "";
             config->libraries = string;
         }
+        else if (match(command, "jobs"))
+        {
+            char* string = trim(&cursor);
+            if (!string || atoi(string) < 0)
+            {
+                printf("Expected a number of parallel compiler processes after \"jobs\" on line %d in lk_build.txt\n", line_number);
+                exit(0);
+            }
+
+            config->jobs = atoi(string);
+        }
+        else if (match(command, "stop_on_error"))
+        {
+            config->stop_on_error = true;
+        }
+        else if (match(command, "content_hash"))
+        {
+            config->content_hash = true;
+        }
+        else if (match(command, "early_cutoff"))
+        {
+            config->early_cutoff = true;
+        }
         else
         {
             printf("Unrecognized configuration command \"%s\" on line %d in lk_build.txt\n", command, line_number);
@@ -507,8 +835,35 @@ void read_config_file(Configuration* config, char* configuration_path)
     fclose(in);
 }
 
+#define DATABASE_VERSION "3"
+
+// Parses 16 hex digits.
+bool parse_hex(char* string, unsigned long long* value)
+{
+    *value = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        *value *= 16;
+        if (string[i] >= '0' && string[i] <= '9')
+            *value += string[i] - '0';
+        else if (string[i] >= 'A' && string[i] <= 'F')
+            *value += 10 + string[i] - 'A';
+        else if (string[i] >= 'a' && string[i] <= 'f')
+            *value += 10 + string[i] - 'a';
+        else return false;
+    }
+    return true;
+}
+
+// The database lists every tracked file with its time at the last successful build. Sources are
+// followed by their dependencies, as reported by the compiler, one per line starting with "->". Folders
+// end with a slash, and are followed by the source files and folders that were in them. With
+// content_hash, files also have a "#HASH" line with the hash of their contents at that time. With
+// early_cutoff, sources have a "#PREPROCESSED" line with the hash their object file was compiled from.
 void read_database(Configuration* config)
 {
+    std::map<std::string, Database_Entry>& database = config->database;
+
     char* db_file = concatenate(config->obj_output, "db.lk_build");
 
     FILE* in = fopen(db_file, "rt");
@@ -519,6 +874,7 @@ void read_database(Configuration* config)
     }
 
     bool success = false;
+    Database_Entry* entry = NULL;
     int line_number = 0;
     while (fgets(line_buffer, sizeof(line_buffer), in))
     {
@@ -527,12 +883,51 @@ void read_database(Configuration* config)
         char* token1 = eat_token(&cursor);
         if (!token1) continue;
 
+        if (line_number == 1)
+        {
+            char* version = trim(&cursor);
+            if (!match(token1, "#LK_BUILD_DATABASE") || !version || !match(version, DATABASE_VERSION))
+            {
+                printf("WARNING! The database was written by a different version of lk_build. Treating all files as modified...\nDB path: %s\n", db_file);
+                database.clear();
+                fclose(in);
+                return;
+            }
+            continue;
+        }
+
         if (match(token1, "#COMPLETE"))
         {
             success = true;
             break;
         }
 
+        if (match(token1, "#HASH"))
+        {
+            char* hash = trim(&cursor);
+            if (!hash || strlen(hash) != 32 || !entry) break;
+            if (!parse_hex(hash, &entry->hash.high) || !parse_hex(hash + 16, &entry->hash.low)) break;
+            entry->has_hash = true;
+            continue;
+        }
+
+        if (match(token1, "#PREPROCESSED"))
+        {
+            char* hash = trim(&cursor);
+            if (!hash || strlen(hash) != 32 || !entry) break;
+            if (!parse_hex(hash, &entry->preprocessed_hash.high) || !parse_hex(hash + 16, &entry->preprocessed_hash.low)) break;
+            entry->has_preprocessed_hash = true;
+            continue;
+        }
+
+        if (match(token1, "->"))
+        {
+            char* path = trim(&cursor);
+            if (!path || !entry) break;
+            entry->paths.push_back(path);
+            continue;
+        }
+
         if (strlen(token1) != 8) break;
 
         char* token2 = eat_token(&cursor);
@@ -545,37 +940,18 @@ void read_database(Configuration* config)
         memcpy(filetime_string, token1, 8);
         memcpy(filetime_string + 8, token2, 8);
 
-        unsigned long long filetime = 0;
-        for (int i = 0; i < 16; i++)
-        {
-            filetime *= 16;
-            if (filetime_string[i] >= '0' && filetime_string[i] <= '9')
-                filetime += filetime_string[i] - '0';
-            else if (filetime_string[i] >= 'A' && filetime_string[i] <= 'F')
-                filetime += 10 + filetime_string[i] - 'A';
-            else if (filetime_string[i] >= 'a' && filetime_string[i] <= 'f')
-                filetime += 10 + filetime_string[i] - 'a';
-            else goto corrupt;
-        }
-
-        FILETIME db_time;
-        db_time.dwHighDateTime = filetime >> 32;
-        db_time.dwLowDateTime = filetime & 0xFFFFFFFFull;
-
-        if (config->tracked_files.find(path) == config->tracked_files.end())
-        {
-            printf("WARNING! Database lists a file that wasn't found by the source tree scan.\nFile: \"%s\"\n", path);
-            continue;
-        }
+        unsigned long long filetime;
+        if (!parse_hex(filetime_string, &filetime))
+            break;
 
-        Tracked_File* file = config->tracked_files[path];
-        file->db_time = db_time;
+        entry = &database[path];
+        entry->time = filetime;
     }
 
-    corrupt:;
     if (!success)
     {
         printf("WARNING! CORRUPT DATABASE! Treating all files as modified...\nDB path: %s\n", db_file);
+        database.clear();
     }
 
     fclose(in);
@@ -592,17 +968,151 @@ void write_database(Configuration* config)
         exit(0);
     }
 
+    fprintf(out, "#LK_BUILD_DATABASE %s\n", DATABASE_VERSION);
+    for (auto& it : config->folders)
+    {
+        unsigned long long time = it.second.time;
+        fprintf(out, "%08X %08X %s\n", (unsigned) (time >> 32), (unsigned) (time & 0xFFFFFFFFull), it.first.c_str());
+
+        for (char* path : it.second.paths)
+            fprintf(out, "-> %s\n", path);
+    }
+
     for (auto& it : config->tracked_files)
     {
         Tracked_File* file = it.second;
-        FILETIME time = file->db_time;
-        fprintf(out, "%08X %08X %s\n", time.dwHighDateTime, time.dwLowDateTime, file->path);
+
+        // dependencies that nothing includes anymore are forgotten
+        if (!file->is_source && file->depend_on_me.empty())
+            continue;
+
+        unsigned long long time = file->db_time;
+        fprintf(out, "%08X %08X %s\n", (unsigned) (time >> 32), (unsigned) (time & 0xFFFFFFFFull), file->path);
+
+        if (file->hashed && time && time == file->write_time)
+            fprintf(out, "#HASH %016llX%016llX\n", file->hash.high, file->hash.low);
+
+        if (file->has_preprocessed_hash && time)
+            fprintf(out, "#PREPROCESSED %016llX%016llX\n", file->preprocessed_hash.high, file->preprocessed_hash.low);
+
+        for (Tracked_File* dependency : file->depends)
+            fprintf(out, "-> %s\n", dependency->path);
     }
 
     fprintf(out, "#COMPLETE\n");
     fclose(out);
 }
 
+Tracked_File* get_tracked_file(Configuration* config, char* path)
+{
+    Tracked_File* file = config->tracked_files[path];
+    if (!file)
+    {
+        file = new Tracked_File;
+        file->path = path;
+        file->is_source = false;
+        config->tracked_files[path] = file;
+    }
+    return file;
+}
+
+void set_dependencies(Configuration* config, Tracked_File* file, std::vector<char*>& dependencies)
+{
+    for (Tracked_File* dependency : file->depends)
+        dependency->depend_on_me.erase(file);
+    file->depends.clear();
+
+    for (char* path : dependencies)
+    {
+        if (match(path, file->path)) continue;
+
+        Tracked_File* dependency = get_tracked_file(config, path);
+        file->depends.insert(dependency);
+        dependency->depend_on_me.insert(file);
+    }
+}
+
+// Compilers report dependencies the way they opened them, which can be an absolute path, or a path
+// through an include folder. Files outside the source tree and in excluded folders aren't tracked.
+void add_dependency(Configuration* config, std::vector<char*>& dependencies, char* path)
+{
+    if (path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':'))
+    {
+        if (!starts_with_root(config, path)) return;
+        path += strlen(config->root);
+    }
+
+    // sanitize_path() gives up on paths that escape the root, so those are checked first
+    int depth = 0;
+    char* name = path;
+    for (char* cursor = path; ; cursor++)
+    {
+        if (*cursor && *cursor != '/' && *cursor != '\\') continue;
+
+        int length = cursor - name;
+        if (length == 0 && *cursor) return;
+        if (length == 2 && name[0] == '.' && name[1] == '.')
+            depth--;
+        else if (!(length == 1 && name[0] == '.'))
+            depth++;
+        if (depth < 0) return;
+
+        if (!*cursor) break;
+        name = cursor + 1;
+    }
+
+    char* dependency = sanitize_file(path);
+    for (char* excluded : config->excludes)
+        if (starts_with(dependency, excluded))
+            return;
+
+    dependencies.push_back(dependency);
+}
+
+// The dependency graph comes from the database, so nothing is read from the source files. Sources
+// that aren't in the database are new, and their dependencies are found when they're compiled.
+void find_dependencies(Configuration* config)
+{
+    std::map<std::string, Database_Entry>& database = config->database;
+
+    for (char* source : config->source_files)
+    {
+        Tracked_File* file = new Tracked_File;
+        file->path = source;
+        file->is_source = true;
+        config->tracked_files[source] = file;
+    }
+
+    for (char* source : config->source_files)
+    {
+        auto entry = database.find(source);
+        if (entry == database.end())
+            continue;
+
+        Tracked_File* file = config->tracked_files[source];
+        file->db_time = entry->second.time;
+        file->has_db_hash = entry->second.has_hash;
+        file->db_hash = entry->second.hash;
+        file->has_preprocessed_hash = entry->second.has_preprocessed_hash;
+        file->preprocessed_hash = entry->second.preprocessed_hash;
+        set_dependencies(config, file, entry->second.paths);
+    }
+
+    for (auto& it : config->tracked_files)
+    {
+        Tracked_File* file = it.second;
+        if (file->is_source) continue;
+
+        auto entry = database.find(file->path);
+        if (entry != database.end())
+        {
+            file->db_time = entry->second.time;
+            file->has_db_hash = entry->second.has_hash;
+            file->db_hash = entry->second.hash;
+        }
+    }
+}
+
 void propagate_dirty_flag(Configuration* config, Tracked_File* file)
 {
     if (file->dirty) return;
@@ -619,110 +1129,598 @@ void mark_dirty_files(Configuration* config)
     for (auto& it : config->tracked_files)
     {
         Tracked_File* file = it.second;
-        if (CompareFileTime(&file->db_time, &file->write_time) != 0)
+        if (file->db_time == file->write_time)
+            continue;
+
+        // only the time changed, so the database just takes the new time
+        if (file->hashed && file->has_db_hash && file->db_time && same_hash(file->hash, file->db_hash))
         {
-            propagate_dirty_flag(config, file);
+            file->db_time = file->write_time;
+            continue;
         }
+
+        propagate_dirty_flag(config, file);
     }
 }
 
-void write_to_temporary_batch(char* bat_file, char* string)
+#define EnglishPlural(number) (((number) == 1) ? "" : "s")
+
+// Whether compiler_options ask for debug info, whose line and column numbers early_cutoff has to keep.
+bool has_debug_info(Configuration* config)
 {
-    FILE* out = fopen(bat_file, "wt");
-    if (!out)
+    char* cursor = config->compiler_options;
+    while (char* option = eat_token(&cursor))
     {
-        printf("Can't write to temporary batch file!\nBatch path: %s\n", bat_file);
+#ifdef _WIN32
+        if (match(option, "-Zi") || match(option, "-Z7") || match(option, "-ZI") ||
+            match(option, "/Zi") || match(option, "/Z7") || match(option, "/ZI"))
+            return true;
+#else
+        if (starts_with(option, "-g") && !match(option, "-g0"))
+            return true;
+#endif
+    }
+    return false;
+}
+
+// With early_cutoff, a dirty source is preprocessed first, and only compiled if the preprocessed
+// source changed since its object file was compiled.
+struct Compile_Job
+{
+    Tracked_File* file;
+    bool preprocess;
+
+    bool has_preprocessed_hash;
+    Content_Hash preprocessed_hash;
+
+#ifdef _WIN32
+    HANDLE process;
+    HANDLE output;
+#else
+    pid_t process;
+    int output;
+    int status;
+#endif
+};
+
+char* get_object_path(Configuration* config, Tracked_File* file)
+{
+    char* file_name = file->path + strlen(file->path);
+    while (file_name >= file->path && *file_name != PATH_SEPARATOR[0])
+        file_name--;
+    file_name++;
+
+    file_name = copy_string(file_name);
+         if (ends_with(file_name, ".c"  )) file_name[strlen(file_name) - 2] = 0;
+    else if (ends_with(file_name, ".cc" )) file_name[strlen(file_name) - 3] = 0;
+    else if (ends_with(file_name, ".cpp")) file_name[strlen(file_name) - 4] = 0;
+    else if (ends_with(file_name, ".cxx")) file_name[strlen(file_name) - 4] = 0;
+
+#ifdef _WIN32
+    return concatenate(config->obj_output, file_name, ".obj");
+#else
+    return concatenate(config->obj_output, file_name, ".o");
+#endif
+}
+
+#ifdef _WIN32
+
+int get_job_count(Configuration* config)
+{
+    int jobs = config->jobs;
+    if (jobs == 0)
+        jobs = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    if (jobs < 1)
+        jobs = 1;
+
+    // WaitForMultipleObjects() can't wait on more than this many processes
+    if (jobs > MAXIMUM_WAIT_OBJECTS)
+        jobs = MAXIMUM_WAIT_OBJECTS;
+    return jobs;
+}
+
+// Compiler output goes to a temporary file, so that it can be printed in one piece after the process
+// exits, instead of interleaving with the output of the other jobs.
+bool start_compile_job(Configuration* config, Compile_Job* job)
+{
+    SECURITY_ATTRIBUTES security = {};
+    security.nLength = sizeof(security);
+    security.bInheritHandle = TRUE;
+
+    char output_path[MAX_PATH];
+    if (!GetTempFileNameA(config->obj_output, "lkb", 0, output_path))
+    {
+        printf("GetTempFileNameA() failed in folder %s\n", config->obj_output);
+        return false;
+    }
+
+    job->output = CreateFileA(output_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              &security, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (job->output == INVALID_HANDLE_VALUE)
+    {
+        printf("CreateFileA() failed for temporary file %s\n", output_path);
+        DeleteFileA(output_path);
+        return false;
+    }
+
+    // Only this job's output file is inherited. Otherwise every compiler would also inherit the output files
+    // of the other running jobs, and they wouldn't be deleted until the slowest of those compilers exits.
+    // That's also why there's no standard input, the compiler doesn't read it anyway.
+    SIZE_T attributes_size = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attributes_size);
+    LPPROC_THREAD_ATTRIBUTE_LIST attributes = (LPPROC_THREAD_ATTRIBUTE_LIST) malloc(attributes_size);
+    if (!InitializeProcThreadAttributeList(attributes, 1, 0, &attributes_size))
+    {
+        printf("InitializeProcThreadAttributeList() failed for the compiler for %s\n", job->file->path);
+        free(attributes);
+        CloseHandle(job->output);
+        return false;
+    }
+    if (!UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, &job->output, sizeof(HANDLE), NULL, NULL))
+    {
+        printf("UpdateProcThreadAttribute() failed for the compiler for %s\n", job->file->path);
+        DeleteProcThreadAttributeList(attributes);
+        free(attributes);
+        CloseHandle(job->output);
+        return false;
+    }
+
+    STARTUPINFOEXA startup = {};
+    startup.StartupInfo.cb = sizeof(startup);
+    startup.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startup.StartupInfo.hStdInput = NULL;
+    startup.StartupInfo.hStdOutput = job->output;
+    startup.StartupInfo.hStdError = job->output;
+    startup.lpAttributeList = attributes;
+
+    if (job->preprocess)
+        sprintf(line_buffer, "%s -nologo -showIncludes \"%s\" %s -P -Fi\"%s.i\" %s",
+            config->compiler, job->file->path, has_debug_info(config) ? "" : "-EP",
+            get_object_path(config, job->file), config->compiler_options);
+    else // -FS, because parallel jobs with -Zi all write the same PDB
+        sprintf(line_buffer, "%s -nologo -showIncludes -FS \"%s\" -c -Fo\"%s\" %s",
+            config->compiler, job->file->path, get_object_path(config, job->file), config->compiler_options);
+
+    PROCESS_INFORMATION process;
+    BOOL created = CreateProcessA(NULL, line_buffer, NULL, NULL, TRUE, EXTENDED_STARTUPINFO_PRESENT, NULL, NULL, &startup.StartupInfo, &process);
+    DeleteProcThreadAttributeList(attributes);
+    free(attributes);
+    if (!created)
+    {
+        printf("CreateProcessA() failed to start the compiler for %s. Is %s on the PATH?\n", job->file->path, config->compiler);
+        CloseHandle(job->output);
+        return false;
+    }
+
+    CloseHandle(process.hThread);
+    job->process = process.hProcess;
+    return true;
+}
+
+// Returns the index of a job that finished.
+size_t wait_for_compile_job(std::vector<Compile_Job>& running)
+{
+    HANDLE processes[MAXIMUM_WAIT_OBJECTS];
+    for (size_t i = 0; i < running.size(); i++)
+        processes[i] = running[i].process;
+
+    DWORD count = (DWORD) running.size();
+    DWORD wait = WaitForMultipleObjects(count, processes, FALSE, INFINITE);
+    if (wait < WAIT_OBJECT_0 || wait >= WAIT_OBJECT_0 + count)
+    {
+        printf("WaitForMultipleObjects() failed while waiting for the compiler!\n");
         exit(0);
     }
 
-    fprintf(out, "%s", string);
-    fclose(out);
+    return wait - WAIT_OBJECT_0;
 }
 
-void clear_build_failed(char* failure_file)
+// Returns true if the compiler succeeded. The files cl reports with -showIncludes are taken out of its
+// output and returned as dependencies. Note that cl translates the prefix, this only understands English.
+bool finish_compile_job(Configuration* config, Compile_Job* job, std::vector<char*>& dependencies)
 {
-    DeleteFileA(failure_file);
+    DWORD exit_code = 1;
+    GetExitCodeProcess(job->process, &exit_code);
+    CloseHandle(job->process);
+
+    std::string output;
+    SetFilePointer(job->output, 0, NULL, FILE_BEGIN);
+    DWORD read;
+    while (ReadFile(job->output, line_buffer, sizeof(line_buffer), &read, NULL) && read)
+        output.append(line_buffer, read);
+    CloseHandle(job->output);
+
+    char* prefix = "Note: including file:";
+    char* line = (char*) output.c_str();
+    while (*line)
+    {
+        char* end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+
+        if (starts_with(line, prefix))
+        {
+            // trim() goes to the end of the string, so the path is copied out of the rest of the output
+            char* cursor = copy_string(line + strlen(prefix), end);
+            char* path = trim(&cursor);
+            if (path)
+                add_dependency(config, dependencies, path);
+        }
+        else if (!job->preprocess) // the compile that follows reports the same errors
+        {
+            fwrite(line, 1, end - line, stdout);
+        }
+
+        line = end;
+    }
+    fflush(stdout);
+
+    return exit_code == 0;
 }
 
-bool check_build_failed(char* failure_file)
+#else
+
+// Splits an options string from lk_build.txt into arguments. There's no shell in between, so double
+// quotes are handled here, for paths with spaces.
+void split_arguments(std::vector<const char*>& arguments, char* string)
 {
-    if (PathFileExistsA(failure_file))
+    char* cursor = string;
+    while (true)
     {
-        clear_build_failed(failure_file);
-        return true;
+        eat_whitespace(&cursor);
+        if (!*cursor) break;
+
+        std::string argument;
+        bool quoted = false;
+        while (*cursor && (quoted || !isspace(*cursor)))
+        {
+            if (*cursor == '"')
+                quoted = !quoted;
+            else
+                argument += *cursor;
+            cursor++;
+        }
+
+        arguments.push_back(copy_string((char*) argument.c_str()));
+    }
+}
+
+// Starts a program without going through a shell. The output file descriptor, if any, receives both
+// stdout and stderr. Returns 0 on failure.
+pid_t spawn_process(std::vector<const char*>& arguments, int output)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, output, STDERR_FILENO);
+    }
+
+    arguments.push_back(NULL);
+    pid_t process = 0;
+    int error = posix_spawnp(&process, arguments[0], &actions, NULL, (char* const*) arguments.data(), environ);
+    arguments.pop_back();
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error)
+    {
+        printf("posix_spawnp() failed to start %s: %s\n", arguments[0], strerror(error));
+        return 0;
+    }
+
+    return process;
+}
+
+int get_job_count(Configuration* config)
+{
+    int jobs = config->jobs;
+    if (jobs == 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+    return jobs;
+}
+
+// Compiler output goes to a temporary file, so that it can be printed in one piece after the process
+// exits, instead of interleaving with the output of the other jobs.
+bool start_compile_job(Configuration* config, Compile_Job* job)
+{
+    char* output_path = concatenate(config->obj_output, "lk_build_XXXXXX");
+    job->output = mkostemp(output_path, O_CLOEXEC);
+    if (job->output < 0)
+    {
+        printf("mkostemp() failed in folder %s: %s\n", config->obj_output, strerror(errno));
+        return false;
+    }
+    unlink(output_path); // the file is gone once the descriptor is closed
+
+    std::vector<const char*> arguments;
+    arguments.push_back(config->compiler);
+    split_arguments(arguments, config->compiler_options);
+    if (job->preprocess)
+    {
+        arguments.push_back("-E");
+        if (!has_debug_info(config))
+            arguments.push_back("-P");
+        arguments.push_back(job->file->path);
+        arguments.push_back("-o");
+        arguments.push_back(concatenate(get_object_path(config, job->file), ".i"));
+    }
+    else
+    {
+        arguments.push_back("-c");
+        arguments.push_back(job->file->path);
+        arguments.push_back("-o");
+        arguments.push_back(get_object_path(config, job->file));
+    }
+    arguments.push_back("-MMD");
+    arguments.push_back("-MF");
+    arguments.push_back(concatenate(get_object_path(config, job->file), ".d"));
+
+    job->process = spawn_process(arguments, job->output);
+    if (!job->process)
+    {
+        close(job->output);
+        return false;
+    }
+
+    return true;
+}
+
+// Returns the index of a job that finished.
+size_t wait_for_compile_job(std::vector<Compile_Job>& running)
+{
+    while (true)
+    {
+        int status;
+        pid_t process = waitpid(-1, &status, 0);
+        if (process < 0)
+        {
+            if (errno == EINTR) continue;
+            printf("waitpid() failed while waiting for the compiler: %s\n", strerror(errno));
+            exit(0);
+        }
+
+        for (size_t i = 0; i < running.size(); i++)
+        {
+            if (running[i].process == process)
+            {
+                running[i].status = status;
+                return i;
+            }
+        }
     }
+}
+
+// Reads the make rule the compiler wrote with -MMD. Its prerequisites are the source and everything it
+// included, except system headers.
+void read_dependency_file(Configuration* config, std::vector<char*>& dependencies, char* path)
+{
+    FILE* in = fopen(path, "rb");
+    if (!in)
+    {
+        printf("WARNING! The compiler didn't write the dependency file %s\n", path);
+        return;
+    }
+
+    int length = fread(line_buffer, 1, sizeof(line_buffer) - 1, in);
+    line_buffer[length] = 0;
+    fclose(in);
+
+    char* cursor = strstr(line_buffer, ": ");
+    if (!cursor) return;
+    cursor++;
+
+    std::string name;
+    while (true)
+    {
+        char c = *cursor++;
+        if (c == '\\' && (*cursor == '\n' || (*cursor == '\r' && cursor[1] == '\n')))
+        {
+            cursor += (*cursor == '\r') ? 2 : 1;
+            c = ' ';
+        }
+        else if ((c == '\\' && *cursor == ' ') || (c == '$' && *cursor == '$'))
+        {
+            c = *cursor++;
+            name += c;
+            continue;
+        }
+
+        if (c && !isspace(c))
+        {
+            name += c;
+            continue;
+        }
+
+        if (!name.empty())
+            add_dependency(config, dependencies, (char*) name.c_str());
+        name.clear();
+
+        if (!c || c == '\n') break; // the end of the rule
+    }
+}
+
+// Returns true if the compiler succeeded.
+bool finish_compile_job(Configuration* config, Compile_Job* job, std::vector<char*>& dependencies)
+{
+    // the compile that follows reports the same errors
+    lseek(job->output, 0, SEEK_SET);
+    ssize_t count;
+    while (!job->preprocess && (count = read(job->output, line_buffer, sizeof(line_buffer))) > 0)
+        fwrite(line_buffer, 1, count, stdout);
+    fflush(stdout);
+    close(job->output);
+
+    bool success = WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0;
+    if (success)
+        read_dependency_file(config, dependencies, concatenate(get_object_path(config, job->file), ".d"));
+    return success;
+}
+
+#endif
 
+// Dependencies the file didn't have before weren't looked at by find_file_times().
+void update_dependencies(Configuration* config, Tracked_File* file, std::vector<char*>& dependencies)
+{
+    set_dependencies(config, file, dependencies);
+    for (Tracked_File* dependency : file->depends)
+    {
+        if (dependency->write_time) continue;
+        if (get_file_time(dependency->path, &dependency->write_time))
+            dependency->db_time = dependency->write_time;
+        if (config->content_hash)
+            dependency->hashed = hash_file(dependency->path, &dependency->hash);
+    }
+}
+
+// Returns true if the source doesn't need to be compiled, because it preprocesses to the same thing
+// as when its object file was compiled. Otherwise, the compile job gets the new hash.
+bool check_early_cutoff(Configuration* config, Compile_Job* job, Compile_Job* compile, bool preprocessed)
+{
+    char* object_path = get_object_path(config, job->file);
+    char* preprocessed_path = concatenate(object_path, ".i");
+
+    Content_Hash hash;
+    bool hashed = false;
+    if (preprocessed && has_debug_info(config))
+        hashed = hash_file(preprocessed_path, &hash);
+    else if (preprocessed)
+        hashed = hash_preprocessed_file(preprocessed_path, &hash);
+    remove(preprocessed_path);
+
+    unsigned long long object_time;
+    if (hashed && job->file->has_preprocessed_hash && same_hash(hash, job->file->preprocessed_hash) &&
+        get_file_time(object_path, &object_time))
+        return true;
+
+    compile->file = job->file;
+    compile->has_preprocessed_hash = hashed;
+    compile->preprocessed_hash = hash;
     return false;
 }
 
 void do_incremental_compilation(Configuration* config, int* success_count, int* failure_count)
 {
-    read_database(config);
     mark_dirty_files(config);
 
-    char* bat_file = concatenate(config->obj_output, "lk_build_temp.bat");
-    char* failure_file = concatenate(config->obj_output, "lk_build_failure");
-    clear_build_failed(failure_file);
-
+    std::vector<Compile_Job> queue;
     for (auto& it : config->tracked_files)
     {
         Tracked_File* file = it.second;
         if (file->dirty && file->is_source)
         {
-            sprintf(line_buffer,
-                "@echo off\n"
-                "cl -nologo \"%s\" -c -Fo\"%s\\\" %s\n"
-                "if not \"%%ERRORLEVEL%%\"==\"0\" echo biatch > \"%s\"\n",
-                file->path, config->obj_output, config->cl_options, failure_file);
+            Compile_Job job = {};
+            job.file = file;
+            job.preprocess = config->early_cutoff;
+            queue.push_back(job);
+            file->db_time = 0;
+        }
+        else
+            file->db_time = file->write_time;
+    }
+
+    size_t job_count = get_job_count(config);
+    std::vector<Compile_Job> running;
+    int unchanged_count = 0;
+
+    // Sources that fail, or that are never started because of stop_on_error, are forgotten by the
+    // database, so they're dirty again on the next build even if only a dependency changed.
+    // Preprocessing jobs add compile jobs to the end of the queue.
+    size_t next = 0;
+    bool stopping = false;
+    while (true)
+    {
+        while (!stopping && next < queue.size() && running.size() < job_count)
+        {
+            Compile_Job job = queue[next++];
+            if (start_compile_job(config, &job))
+            {
+                running.push_back(job);
+                continue;
+            }
 
-            write_to_temporary_batch(bat_file, line_buffer);
-            system(bat_file);
+            if (job.preprocess)
+            {
+                Compile_Job compile = {};
+                check_early_cutoff(config, &job, &compile, false);
+                queue.push_back(compile);
+                continue;
+            }
 
-            if (check_build_failed(failure_file))
+            printf("FAILURE: %s\n", job.file->path);
+            (*failure_count)++;
+            if (config->stop_on_error)
+                stopping = true;
+        }
+
+        if (running.empty())
+            break;
+
+        size_t finished = wait_for_compile_job(running);
+        Compile_Job job = running[finished];
+        running.erase(running.begin() + finished);
+
+        std::vector<char*> dependencies;
+        bool success = finish_compile_job(config, &job, dependencies);
+
+        if (job.preprocess)
+        {
+            Compile_Job compile = {};
+            if (check_early_cutoff(config, &job, &compile, success))
             {
-                printf("FAILURE: %s\n", file->path);
-                (*failure_count)++;
-                goto failed;
+                job.file->db_time = job.file->write_time;
+                update_dependencies(config, job.file, dependencies);
+                unchanged_count++;
             }
             else
             {
-                (*success_count)++;
+                queue.push_back(compile);
             }
         }
+        else if (success)
+        {
+            job.file->db_time = job.file->write_time;
+            job.file->has_preprocessed_hash = job.has_preprocessed_hash;
+            job.file->preprocessed_hash = job.preprocessed_hash;
+            update_dependencies(config, job.file, dependencies);
+            (*success_count)++;
+        }
+        else
+        {
+            printf("FAILURE: %s\n", job.file->path);
+            (*failure_count)++;
+            if (config->stop_on_error)
+                stopping = true;
+        }
+    }
 
-        file->db_time = file->write_time;
-        failed:;
+    if (stopping && next < queue.size())
+    {
+        int skipped = (int) (queue.size() - next);
+        printf("Stopped after the first error, %d compilation unit%s not compiled\n", skipped, EnglishPlural(skipped));
     }
 
+    if (unchanged_count)
+        printf("%d compilation unit%s skipped, the preprocessed source didn't change\n", unchanged_count, EnglishPlural(unchanged_count));
+
     write_database(config);
 }
 
+#ifdef _WIN32
+
 void do_linking(Configuration* config)
 {
     #define Append (line_buffer + strlen(line_buffer))
 
     line_buffer[0] = 0;
-    sprintf(Append, "link %s %s", config->link_options, config->libraries);
+    sprintf(Append, "%s %s %s", config->linker, config->link_options, config->libraries);
 
     for (auto& it : config->tracked_files)
     {
         Tracked_File* file = it.second;
         if (file->is_source)
-        {
-            char* file_name = file->path + strlen(file->path);
-            while (file_name >= file->path && *file_name != '\\')
-                file_name--;
-            file_name++;
-
-            file_name = copy_string(file_name);
-                 if (ends_with(file_name, ".c"  )) file_name[strlen(file_name) - 2] = 0;
-            else if (ends_with(file_name, ".cc" )) file_name[strlen(file_name) - 3] = 0;
-            else if (ends_with(file_name, ".cpp")) file_name[strlen(file_name) - 4] = 0;
-            else if (ends_with(file_name, ".cxx")) file_name[strlen(file_name) - 4] = 0;
-
-            char* obj_path = concatenate(config->obj_output, file_name, ".obj");
-            sprintf(Append, " %s", obj_path);
-        }
+            sprintf(Append, " %s", get_object_path(config, file));
     }
 
     system(line_buffer);
@@ -737,7 +1735,37 @@ double time_stamp()
     return (double) time.QuadPart / (double) time_frequency.QuadPart;
 }
 
-#define EnglishPlural(number) (((number) == 1) ? "" : "s")
+#else
+
+void do_linking(Configuration* config)
+{
+    // the linker resolves libraries against the objects before them
+    std::vector<const char*> arguments;
+    arguments.push_back(config->linker);
+    split_arguments(arguments, config->link_options);
+    for (auto& it : config->tracked_files)
+    {
+        Tracked_File* file = it.second;
+        if (file->is_source)
+            arguments.push_back(get_object_path(config, file));
+    }
+    split_arguments(arguments, config->libraries);
+
+    pid_t process = spawn_process(arguments, -1);
+    if (!process) return;
+
+    int status;
+    while (waitpid(process, &status, 0) < 0 && errno == EINTR) {}
+}
+
+double time_stamp()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+#endif
 
 int main(int argc, char** argv)
 {
@@ -745,7 +1773,7 @@ int main(int argc, char** argv)
 
     if (argc > 2)
     {
-        printf("Usage: lk_build.exe config.txt\n");
+        printf("Usage: lk_build [config.txt]\n");
         exit(0);
     }
 
@@ -758,6 +1786,8 @@ int main(int argc, char** argv)
     Configuration config;
     read_config_file(&config, configuration_path);
 
+    find_root(&config);
+    read_database(&config);
     find_all_source_files(&config);
     find_dependencies(&config);
     find_file_times(&config);
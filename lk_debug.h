@@ -1,11 +1,82 @@
-//  lk_platform.h - public domain utility for runtime profiling and debug event gathering
+//  lk_debug.h - public domain utility for runtime profiling and debug event gathering
 //  no warranty is offered or implied
 
 /*********************************************************************************************
 
 QUICK NOTES
     Call lkdbg_start() at the beginning and lkdbg_end() at the end of your program, or part of the program you're profiling.
-    Also remember to call lkdbg_register_thread() once for each thread.
+    Threads register themselves on their first event, named after their thread id, so code running on threads
+    you didn't create (like a library's thread pool) can be instrumented too. Call lkdbg_register_thread() to
+    give a thread a proper name, before or after its first event.
+    Threads can keep pushing events while lkdbg_end() runs. Their events from then on are dropped, and
+    lkdbg_end() waits for pushes that are already in progress before it frees anything. For that, every
+    thread that ever registers keeps a few bytes for the rest of the process, even after it exits.
+    On Linux, the implementation needs _GNU_SOURCE; g++ defines it, but compile C with -D_GNU_SOURCE.
+
+    On x86, events are timestamped with rdtsc when the TSC is invariant (constant rate, and in sync between
+    processors; on Linux, we also want the kernel to be using it as its clock source). lkdbg_start() then
+    spends 10 ms measuring its frequency against the system clock, and the measurement keeps improving
+    for as long as the program runs. Otherwise, or if you define LKDBG_NO_TSC, events use
+    QueryPerformanceCounter or clock_gettime(CLOCK_MONOTONIC), which cost several times as much.
+
+    lkdbg_start(LKDBG_CAPTURE_CONTEXT_SWITCHES) also records context switches, so you can see when your threads
+    weren't running. On Windows that goes through ETW and needs administrator rights. On Linux it goes through
+    perf_event_open, and sees the whole system with CAP_PERFMON, or only this process without it.
+
+    lkdbg_start(LKDBG_CAPTURE_PERF_COUNTERS) also samples per-thread counters at the beginning and end of each
+    block, and records their deltas right after the block's end event. On Linux those are cycles, instructions,
+    cache misses and branch misses when the PMU is available (it often isn't in VMs), and page faults, context
+    switches and task clock, which are always available. On Windows, only cycles are recorded.
+    This makes every block event quite a bit more expensive, so only turn it on when you need it.
+
+    lkdbg_start(LKDBG_CAPTURE_SAMPLES) also samples the call stack of each registered thread, so you can see
+    where time goes inside and between your blocks. Each thread gets a timer on its own CPU clock, which
+    sends it a SIGPROF at the rate set by lkdbg_set_sample_rate() (1000 per second by default) while it's
+    running. The handler walks the stack through frame pointers, so compile with -fno-omit-frame-pointer,
+    and link with -rdynamic if you want names for functions in your executable. Addresses are turned into
+    function names at lkdbg_end(). Only available on Linux for now.
+
+    lkdbg_start(LKDBG_COLLECT_STATISTICS) also keeps running statistics for every block name: count, inclusive
+    and exclusive time, min, max and a latency histogram. Each thread updates its own table without locks, and
+    lkdbg_query_statistics() merges them whenever you ask, from any thread:
+
+        LKDBG_Statistics statistics[64];
+        LK_U64 count = lkdbg_query_statistics(statistics, 64);
+        for (LK_U64 i = 0; i < count; i++)
+            printf("%s: %llu calls, p99 %llu ns\n", statistics[i].name, statistics[i].count,
+                   lkdbg_statistics_percentile(&statistics[i], 0.99));
+
+    Add LKDBG_STATISTICS_ONLY to skip recording block events altogether, which is cheap enough to leave on in
+    production; pass 0 to lkdbg_end() if you don't want a profile file either.
+
+    Every event pushed inside a block makes that block look longer by the cost of the push, so deeply nested
+    blocks inflate their parents. lkdbg_start() measures that cost on the current machine with the flags it
+    was given (lkdbg_get_event_overhead() returns it), and stores it in the profile header. Add
+    LKDBG_SUBTRACT_OVERHEAD to take it out of the live statistics, and pass -o to lk_debug_analyze or
+    lk_debug_diff to take it out of a profile's block times. Either way, a block loses the overhead once for
+    each event pushed between its begin and its end, so the corrected times are comparable between machines.
+    The overhead is what every push has in common, so a nested block's own statistics and counter reads are
+    still counted in its parents: the correction can come out short, but it doesn't take out too much.
+
+    lkdbg_start(LKDBG_FLIGHT_RECORDER) keeps only the most recent events of each thread, in a ring of
+    lkdbg_set_flight_recorder_size() events (65536 by default) that overwrites the oldest ones. Memory use
+    stays fixed however long the program runs. When something interesting happens, call
+        lkdbg_snapshot("spike.lkdbg", 2.0);
+    to write the last 2 seconds of all threads to a profile, while they keep running. To get one when the
+    program crashes, call lkdbg_snapshot_on_crash() once after lkdbg_start(). That one is best effort:
+    writing a file from a crashed process isn't safe, but it usually works. lkdbg_end() writes everything
+    that's still in the rings.
+
+    A flight recorder can also be watched live, instead of waiting for lkdbg_end(). Start a receiver, like
+        lk_debug_record /tmp/app.sock live.lkdbg
+    and then, after lkdbg_start(LKDBG_FLIGHT_RECORDER), call
+        lkdbg_stream("/tmp/app.sock");
+    A collector thread then sends what every thread pushed to its ring, every LKDBG_STREAM_INTERVAL
+    milliseconds (10 by default), over that Unix domain socket. It never makes your threads wait: if the
+    receiver falls behind, or the ring wraps around before the collector gets to it, events are dropped,
+    and the receiver is told how many. lk_debug_record writes what it receives to a normal profile when
+    the program calls lkdbg_end(), or when it's stopped with Ctrl+C. See LKDBG_Stream_Message for the
+    format, if you want to write your own receiver. Only available on Linux for now.
 
     The following macros are only defined for C++ (or for C using GCC-specific extensions):
         LKDBG_FUNCTION          Place this at the very beginning of a function to make the entire function a block.
@@ -28,8 +99,70 @@ QUICK NOTES
             LKDBG_END_BLOCK()
         }
 
+    Blocks have verbosity levels, so you can keep fine-grained ones in the code without paying for them
+    in release builds. LKDBG_FUNCTION, LKDBG_BLOCK, LKDBG_BEGIN_BLOCK and LKDBG_END_BLOCK are level 1.
+    Add _2 or _3 to their names (LKDBG_FUNCTION_2, LKDBG_BLOCK_3(name), ...) for more detailed levels.
+    Blocks above LKDBG_LEVEL compile to nothing. It's 3 (everything) by default; define it to 0 before
+    including lk_debug.h to remove all instrumentation.
+
+    Blocks that are compiled in can still be switched off at runtime with lkdbg_set_enabled(0). While
+    disabled, a block costs a single branch on a global; it doesn't read the clock or even need the thread
+    to be registered. lkdbg_set_enabled(1) turns them back on, from any thread, while the program is running.
+    Blocks that were open when the switch flipped still end properly.
+
+    Numbers that change over time (queue depth, bytes allocated, frame time...) go on the same timeline with:
+        LKDBG_COUNTER(name, value)  Records the value of a counter. 'value' is converted to double.
+        LKDBG_MARK(name)            Records that something happened, an instant with no duration.
+    The same rules apply to their names as to block names. Both are level 1 and follow lkdbg_set_enabled().
+    With LKDBG_COLLECT_STATISTICS, counters also keep their min, max, sum and last value, and marks their count.
+
+    Work that moves between threads (a job going from a producer, through a queue, to a worker) can be
+    followed with flow events, tied together by any 64-bit id you pick, unique while the item is in flight:
+        LKDBG_FLOW_BEGIN(name, id)  The item was created or enqueued.
+        LKDBG_FLOW_STEP(id)         Something picked the item up (the first step ends its queue wait).
+        LKDBG_FLOW_END(id)          The item is done.
+    The exporters draw arrows between them, so put them inside blocks. An item's queue wait is the time
+    from its begin to its first step, and its service time from the first step to its end;
+    "lk_debug_analyze profile.lkdbg flows" reports both for each flow name.
+
+    Memory goes on the timeline too, if your allocators report what they do:
+        LKDBG_ALLOCATE(address, size, memory_class, site)  'site' is a string naming the call site, or 0.
+        LKDBG_DEALLOCATE(address, memory_class)
+    'memory_class' is LKDBG_MEMORY_HEAP (malloc and friends), LKDBG_MEMORY_PAGES (straight from the OS),
+    or LKDBG_MEMORY_REGION (carved out of pages the allocator already reported, like an arena or lk_region
+    allocation, never freed individually). Both are level 1 and follow lkdbg_set_enabled(). Unlike the other
+    macros they're safe to put in an allocator: registering a thread allocates, so they don't do it, and on
+    threads that haven't registered yet, or outside lkdbg_start() and lkdbg_end(), they do nothing.
+    A malloc wrapper could look like:
+
+        void* my_malloc(size_t size, const char* site)
+        {
+            void* memory = malloc(size);
+            LKDBG_ALLOCATE(memory, size, LKDBG_MEMORY_HEAP, site);
+            return memory;
+        }
+
+    lk_region.h has hooks for this, see LK_REGION_TRACK_ALLOC there. lk_debug's own memory (LKDBG_MALLOC)
+    isn't reported, that would have it recording events about recording events.
+    "lk_debug_analyze profile.lkdbg memory" draws live memory over time and lists the biggest allocation sites,
+    and its top report shows how much each block allocated.
+
+    Time spent waiting for locks hides inside blocks. To see it, use these locks, which record how long each
+    acquisition waited and how long the lock was then held:
+        LKDBG_Lock          lkdbg_lock_init(&lock, "name"), lkdbg_lock(), lkdbg_unlock(), lkdbg_lock_free()
+        LKDBG_RW_Lock       lkdbg_rw_lock_init(), lkdbg_read_lock(), lkdbg_read_unlock(),
+                            lkdbg_write_lock(), lkdbg_write_unlock(), lkdbg_rw_lock_free()
+        LKDBG_Spin_Lock     lkdbg_spin_lock_init(), lkdbg_spin_lock(), lkdbg_spin_unlock()
+    They're pthread mutexes and rwlocks on Linux, and SRW locks on Windows. An acquisition that gets the lock
+    right away records one event; only contended ones also record when they started waiting. Locks are told
+    apart by name, so locks that share a name are reported together. They work at any time, but only record
+    between lkdbg_start() and lkdbg_end(), while lkdbg_set_enabled() is on. For your own locks, call
+    lkdbg_push_lock_event() around them.
+    "lk_debug_analyze profile.lkdbg locks" lists the most contended locks.
+
     If for some reason you don't want to use these macros, you can use:
         lkdbg_push_block_event(name, begin)
+    It doesn't look at lkdbg_set_enabled().
     However, **BE VERY CAREFUL** when using this function. The name **POINTER** must be equal when beginning
     and ending a block. This is not guaranteed for identical string literals by the C/C++ standards.
     For example, the following code may be INCORRECT:
@@ -38,6 +171,24 @@ QUICK NOTES
         ...
         lkdbg_push_block_event("My Block", 0);  // may be a different address!
 
+    To read a profile back, write:
+        #define LKDBG_READER_IMPLEMENTATION
+    before including lk_debug.h in one of your compilation units. The reader doesn't need
+    LKDBG_IMPLEMENTATION, so analysis tools don't have to link the profiler itself. Then:
+
+        LKDBG_Profile profile;
+        if (lkdbg_open_profile(&profile, "profile.lkdbg"))
+        {
+            LKDBG_Profile_Iterator it;
+            lkdbg_profile_begin(&it, &profile, LKDBG_ALL_THREADS, t0, t1);
+            while (const LKDBG_Event* event = lkdbg_profile_next(&it))
+            {
+                // it.thread is the index of the thread the event was recorded on
+            }
+            lkdbg_profile_end(&it);
+            lkdbg_close_profile(&profile);
+        }
+
 LICENSE
     This software is in the public domain. Anyone can use it, modify it,
     roll'n'smoke hardcopies of the source code, sell it to the terrorists, etc.
@@ -51,6 +202,11 @@ DOCUMENTATION
 
  *********************************************************************************************/
 
+#ifndef LK_DEBUG_HEADER
+#define LK_DEBUG_HEADER
+
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -60,99 +216,190 @@ extern "C"
 // Header
 ////////////////////////////////////////////////////////////////////////////////
 
-void lkdbg_register_thread(const char* name);
+void lkdbg_register_thread(const char* name); // optional, see QUICK NOTES; 'name' isn't copied
 void lkdbg_push_block_event(const char* name, int begin);
-void lkdbg_start(int do_etw);
+void lkdbg_push_counter_event(const char* name, double value);
+void lkdbg_push_mark_event(const char* name);
+
+#define LKDBG_FLOW_PHASE_BEGIN 0
+#define LKDBG_FLOW_PHASE_STEP  1
+#define LKDBG_FLOW_PHASE_END   2
+void lkdbg_push_flow_event(const char* name, unsigned long long id, int phase); // name is only used on begin
+
+#define LKDBG_MEMORY_HEAP   0
+#define LKDBG_MEMORY_PAGES  1
+#define LKDBG_MEMORY_REGION 2
+void lkdbg_push_allocation_event(const void* address, unsigned long long size, int memory_class, const char* site);
+void lkdbg_push_deallocation_event(const void* address, int memory_class);
+
+#define LKDBG_LOCK_PHASE_WAIT     0 // started waiting for a lock that was taken
+#define LKDBG_LOCK_PHASE_ACQUIRED 1
+#define LKDBG_LOCK_PHASE_RELEASED 2
+void lkdbg_push_lock_event(const char* name, int phase, int shared);
+
+// The storage is big enough for the OS lock on every platform, and checked in the implementation.
+typedef struct { unsigned long long storage[8]; const char* name; } LKDBG_Lock;
+typedef struct { unsigned long long storage[8]; const char* name; } LKDBG_RW_Lock;
+typedef struct { volatile long locked; const char* name; } LKDBG_Spin_Lock;
+
+void lkdbg_lock_init(LKDBG_Lock* lock, const char* name);
+void lkdbg_lock_free(LKDBG_Lock* lock);
+void lkdbg_lock(LKDBG_Lock* lock);
+void lkdbg_unlock(LKDBG_Lock* lock);
+
+void lkdbg_rw_lock_init(LKDBG_RW_Lock* lock, const char* name);
+void lkdbg_rw_lock_free(LKDBG_RW_Lock* lock);
+void lkdbg_read_lock(LKDBG_RW_Lock* lock);
+void lkdbg_read_unlock(LKDBG_RW_Lock* lock);
+void lkdbg_write_lock(LKDBG_RW_Lock* lock);
+void lkdbg_write_unlock(LKDBG_RW_Lock* lock);
+
+void lkdbg_spin_lock_init(LKDBG_Spin_Lock* lock, const char* name);
+void lkdbg_spin_lock(LKDBG_Spin_Lock* lock);
+void lkdbg_spin_unlock(LKDBG_Spin_Lock* lock);
+
+#define LKDBG_CAPTURE_CONTEXT_SWITCHES 1
+#define LKDBG_CAPTURE_PERF_COUNTERS    2
+#define LKDBG_CAPTURE_SAMPLES          4
+#define LKDBG_COLLECT_STATISTICS       8
+#define LKDBG_STATISTICS_ONLY          (16 | LKDBG_COLLECT_STATISTICS)
+#define LKDBG_FLIGHT_RECORDER          32
+#define LKDBG_SUBTRACT_OVERHEAD        64
+
+void lkdbg_set_sample_rate(int samples_per_second);      // call before lkdbg_start()
+void lkdbg_set_flight_recorder_size(int events_per_thread); // call before lkdbg_start(), rounded up to a power of two
+void lkdbg_start(int flags);
 void lkdbg_end(const char* profile_path);
 
-#define LKDBG_BEGIN_BLOCK(name) \
-    const char* lkdbg_block_name = name; \
-    lkdbg_push_block_event(lkdbg_block_name, 1);
+// Nanoseconds one pushed event adds to the blocks around it, measured by lkdbg_start().
+double lkdbg_get_event_overhead(void);
+
+// The clock events are timestamped with, for timing things yourself (lk_bench.h does). It's the TSC between
+// lkdbg_start() and lkdbg_end() when that's usable, otherwise the system clock. Any thread can call these.
+unsigned long long lkdbg_get_time(void);
+unsigned long long lkdbg_get_time_frequency(void); // ticks per second
+
+// Reads the calling thread's perf counters into LKDBG_PERF_COUNTER_COUNT values (see LKDBG_Perf_Counter_Kind),
+// for threads registered after lkdbg_start(LKDBG_CAPTURE_PERF_COUNTERS). Returns a mask of the counters
+// that are available (bit 1 << LKDBG_PERF_CYCLES, ...), or 0 if none are.
+unsigned int lkdbg_read_perf_counters(unsigned long long* values);
+
+// Only with LKDBG_FLIGHT_RECORDER. Writes the events of the last 'seconds' (everything if <= 0) to a profile.
+void lkdbg_snapshot(const char* profile_path, double seconds);
+void lkdbg_snapshot_on_crash(const char* profile_path, double seconds);
+
+// Needs LKDBG_FLIGHT_RECORDER. Returns 0 if nothing is listening on 'socket_path'.
+int lkdbg_stream(const char* socket_path);
 
-#define LKDBG_END_BLOCK() \
-    lkdbg_push_block_event(lkdbg_block_name, 0);
+// Set by lkdbg_set_enabled(), 1 by default. The block macros check this before doing anything else.
+extern volatile int lkdbg_enabled;
+void lkdbg_set_enabled(int enabled);
+
+#ifndef LKDBG_LEVEL
+#define LKDBG_LEVEL 3
+#endif
+
+#define LKDBG_BEGIN_BLOCK_ON(name) \
+    const char* lkdbg_block_name = lkdbg_enabled ? (name) : 0; \
+    if (lkdbg_block_name) lkdbg_push_block_event(lkdbg_block_name, 1);
+
+#define LKDBG_END_BLOCK_ON() \
+    if (lkdbg_block_name) lkdbg_push_block_event(lkdbg_block_name, 0);
 
 #if defined(__cplusplus)
 
 struct LKDBG_Debug_Block
 {
     const char* name;
-    LKDBG_Debug_Block(const char* name): name(name) { lkdbg_push_block_event(name, 1); }
-    ~LKDBG_Debug_Block() { lkdbg_push_block_event(name, 0); }
+    LKDBG_Debug_Block(const char* name): name(lkdbg_enabled ? name : 0) { if (this->name) lkdbg_push_block_event(name, 1); }
+    ~LKDBG_Debug_Block() { if (name) lkdbg_push_block_event(name, 0); }
 };
 
-#define LKDBG_FUNCTION LKDBG_Debug_Block lkdbg_debug_function(__FUNCTION__);
-#define LKDBG_BLOCK(name) LKDBG_Debug_Block lkdbg_debug_block(name);
+#define LKDBG_FUNCTION_ON LKDBG_Debug_Block lkdbg_debug_function(__FUNCTION__);
+#define LKDBG_BLOCK_ON(name) LKDBG_Debug_Block lkdbg_debug_block(name);
 
 #elif defined(__GNUC__)
 
-#define LKDBG_BLOCK(name) \
-    void lkdbg_debug_block_cleanup(); \
-    const char* lkdbg_debug_block_name __attribute__((cleanup(lkdbg_debug_block_cleanup))) = name; \
-    lkdbg_push_block_event(name, 1); \
-    void lkdbg_debug_block_cleanup(const char** name) \
+#define LKDBG_BLOCK_ON(name) \
+    auto void lkdbg_debug_block_cleanup(const char** block_name); \
+    const char* lkdbg_debug_block_name __attribute__((cleanup(lkdbg_debug_block_cleanup))) = lkdbg_enabled ? (name) : 0; \
+    if (lkdbg_debug_block_name) lkdbg_push_block_event(lkdbg_debug_block_name, 1); \
+    void lkdbg_debug_block_cleanup(const char** block_name) \
     { \
-        lkdbg_push_block_event(*name, 0); \
+        if (*block_name) lkdbg_push_block_event(*block_name, 0); \
     }
 
-#define LKDBG_FUNCTION LKDBG_BLOCK(__FUNCTION__)
-
-#endif
-
-////////////////////////////////////////////////////////////////////////////////
-// Implementation
-////////////////////////////////////////////////////////////////////////////////
-
-#ifdef LKDBG_IMPLEMENTATION
-
-#ifndef LKDBG_MALLOC
- #define LKDBG_MALLOC(size) malloc(size)
-#endif
+#define LKDBG_FUNCTION_ON LKDBG_BLOCK_ON(__FUNCTION__)
 
-#ifndef LKDBG_FREE
- #define LKDBG_FREE(size) free(size)
 #endif
 
-#ifndef LKDBG_MEMCPY
-  #define LKDBG_MEMCPY(dest, src, size) memcpy(dest, src, size)
+#if LKDBG_LEVEL >= 1
+#define LKDBG_BEGIN_BLOCK(name) LKDBG_BEGIN_BLOCK_ON(name)
+#define LKDBG_END_BLOCK()       LKDBG_END_BLOCK_ON()
+#define LKDBG_BLOCK(name)       LKDBG_BLOCK_ON(name)
+#define LKDBG_FUNCTION          LKDBG_FUNCTION_ON
+#define LKDBG_COUNTER(name, value) do { if (lkdbg_enabled) lkdbg_push_counter_event(name, (double)(value)); } while (0)
+#define LKDBG_MARK(name)           do { if (lkdbg_enabled) lkdbg_push_mark_event(name); } while (0)
+#define LKDBG_FLOW_BEGIN(name, id) do { if (lkdbg_enabled) lkdbg_push_flow_event(name, id, LKDBG_FLOW_PHASE_BEGIN); } while (0)
+#define LKDBG_FLOW_STEP(id)        do { if (lkdbg_enabled) lkdbg_push_flow_event(0, id, LKDBG_FLOW_PHASE_STEP); } while (0)
+#define LKDBG_FLOW_END(id)         do { if (lkdbg_enabled) lkdbg_push_flow_event(0, id, LKDBG_FLOW_PHASE_END); } while (0)
+#define LKDBG_ALLOCATE(address, size, memory_class, site) do { if (lkdbg_enabled) lkdbg_push_allocation_event(address, size, memory_class, site); } while (0)
+#define LKDBG_DEALLOCATE(address, memory_class)            do { if (lkdbg_enabled) lkdbg_push_deallocation_event(address, memory_class); } while (0)
+#else
+#define LKDBG_BEGIN_BLOCK(name)
+#define LKDBG_END_BLOCK()
+#define LKDBG_BLOCK(name)
+#define LKDBG_FUNCTION
+#define LKDBG_COUNTER(name, value) do {} while (0)
+#define LKDBG_MARK(name)           do {} while (0)
+#define LKDBG_FLOW_BEGIN(name, id) do {} while (0)
+#define LKDBG_FLOW_STEP(id)        do {} while (0)
+#define LKDBG_FLOW_END(id)         do {} while (0)
+#define LKDBG_ALLOCATE(address, size, memory_class, site) do {} while (0)
+#define LKDBG_DEALLOCATE(address, memory_class)            do {} while (0)
 #endif
 
-#ifndef LKDBG_ASSERT
-  #include <assert.h>
-  #define LKDBG_ASSERT(test, message) assert((test) && (message))
+#if LKDBG_LEVEL >= 2
+#define LKDBG_BEGIN_BLOCK_2(name) LKDBG_BEGIN_BLOCK_ON(name)
+#define LKDBG_END_BLOCK_2()       LKDBG_END_BLOCK_ON()
+#define LKDBG_BLOCK_2(name)       LKDBG_BLOCK_ON(name)
+#define LKDBG_FUNCTION_2          LKDBG_FUNCTION_ON
+#else
+#define LKDBG_BEGIN_BLOCK_2(name)
+#define LKDBG_END_BLOCK_2()
+#define LKDBG_BLOCK_2(name)
+#define LKDBG_FUNCTION_2
 #endif
 
-#ifndef LKDBG_THREAD_LOCAL
-  #if defined(_MSC_VER)
-    #define LKDBG_THREAD_LOCAL __declspec(thread)
-  #elif defined(__GNUC__)
-    #define LKDBG_THREAD_LOCAL __thread
-  #elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
-    #define LKDBG_THREAD_LOCAL _Thread_local
-  #elif defined(__cplusplus) && (__cplusplus > 199711L)
-    #define LKDBG_THREAD_LOCAL thread_local
-  #else
-    #define LKDBG_THREAD_LOCAL
-  #endif
+#if LKDBG_LEVEL >= 3
+#define LKDBG_BEGIN_BLOCK_3(name) LKDBG_BEGIN_BLOCK_ON(name)
+#define LKDBG_END_BLOCK_3()       LKDBG_END_BLOCK_ON()
+#define LKDBG_BLOCK_3(name)       LKDBG_BLOCK_ON(name)
+#define LKDBG_FUNCTION_3          LKDBG_FUNCTION_ON
+#else
+#define LKDBG_BEGIN_BLOCK_3(name)
+#define LKDBG_END_BLOCK_3()
+#define LKDBG_BLOCK_3(name)
+#define LKDBG_FUNCTION_3
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+// File format
+////////////////////////////////////////////////////////////////////////////////
 
-#include <windows.h>
-#define INITGUID
-#include <evntrace.h>
-#include <evntcons.h>
-
-
-#ifndef LK_SIMPLE_TYPES
+// These are fixed width so that a profile recorded on one platform can be read on another.
+// lk_platform.h defines the same types, so don't redefine them if it's already included.
+#if !defined(LK_SIMPLE_TYPES) && !defined(LK_PLATFORM_HEADER)
 #define LK_SIMPLE_TYPES
-typedef signed char  LK_S8;
-typedef signed short LK_S16;
-typedef signed long  LK_S32;
+typedef int8_t  LK_S8;
+typedef int16_t LK_S16;
+typedef int32_t LK_S32;
+typedef int64_t LK_S64;
 
-typedef unsigned char      LK_U8;
-typedef unsigned short     LK_U16;
-typedef unsigned long      LK_U32;
-typedef unsigned long long LK_U64;
+typedef uint8_t  LK_U8;
+typedef uint16_t LK_U16;
+typedef uint32_t LK_U32;
+typedef uint64_t LK_U64;
 
 typedef LK_U8  LK_B8;
 typedef LK_U16 LK_B16;
@@ -162,19 +409,46 @@ typedef float  LK_F32;
 typedef double LK_F64;
 #endif
 
+// A profile file is laid out like this:
+//     LKDBG_File_Header
+//     LKDBG_File_String[string_count]  sorted by ptr, so names can be looked up with a binary search
+//     LKDBG_File_Thread[thread_count]
+//     LKDBG_Event[event_count]         grouped by thread, and sorted by time within each thread
+//     LK_U64[index_count]              time index, see LKDBG_File_Thread
+// All sections are 8-byte aligned, so the whole file can be memory mapped and used in place.
+
+#define LKDBG_FILE_MAGIC   0x4742444Bu // "KDBG"
+#define LKDBG_FILE_VERSION 3
+
+#ifndef LKDBG_INDEX_STRIDE
+#define LKDBG_INDEX_STRIDE 4096
+#endif
 
 typedef struct
 {
+    LK_U32 magic;
+    LK_U32 version;
     LK_U64 time_frequency;
     LK_U64 string_count;
     LK_U64 thread_count;
     LK_U64 event_count;
+    LK_U64 index_stride;
+    LK_U64 index_count;
+    LK_F64 event_overhead; // ticks one pushed event adds to the blocks around it, see lkdbg_subtract_overhead()
 } LKDBG_File_Header;
 
 typedef struct
 {
     LK_U32 thread_id;
     const char* name;
+
+    LK_U64 first_event;  // this thread's events are event_count events starting from here
+    LK_U64 event_count;
+
+    // index entry i is the time of the (i * index_stride)th event of this thread,
+    // so a time range can be found without touching most of the event pages
+    LK_U64 first_index;
+    LK_U64 index_count;
 } LKDBG_File_Thread;
 
 typedef struct
@@ -183,6 +457,33 @@ typedef struct
     char string[128];
 } LKDBG_File_String;
 
+// lkdbg_stream() sends SOCK_SEQPACKET messages of at most LKDBG_STREAM_MESSAGE_SIZE bytes, laid out as:
+//     LKDBG_Stream_Message
+//     LKDBG_File_Header                only in LKDBG_STREAM_HEADER and LKDBG_STREAM_END messages
+//     LKDBG_File_String[string_count]  names the events use, at least the first time they're sent
+//     LKDBG_Event[event_count]         in the order they were pushed, so not quite sorted by time
+// Events of a thread arrive in order, but after a drop, the first few may be continuations of events
+// that were lost.
+
+#define LKDBG_STREAM_MAGIC        0x5242444Bu // "KDBR"
+#define LKDBG_STREAM_MESSAGE_SIZE 65536
+
+#define LKDBG_STREAM_HEADER 0 // sent first, with zeros for the counts in the file header
+#define LKDBG_STREAM_EVENTS 1
+#define LKDBG_STREAM_END    2 // sent by lkdbg_end(), with the final time frequency
+
+typedef struct
+{
+    LK_U32 magic;
+    LK_U32 kind;
+    LK_U32 thread_id;
+    LK_U32 thread_index; // threads are numbered in the order they registered
+    const char* thread_name;
+    LK_U64 string_count;
+    LK_U64 event_count;
+    LK_U64 dropped;      // events of this thread lost right before these
+} LKDBG_Stream_Message;
+
 
 
 typedef struct
@@ -202,10 +503,118 @@ typedef struct
     LK_U64 time;
 } LKDBG_Context_Switch;
 
+typedef enum
+{
+    LKDBG_PERF_CYCLES,
+    LKDBG_PERF_INSTRUCTIONS,
+    LKDBG_PERF_CACHE_MISSES,
+    LKDBG_PERF_BRANCH_MISSES,
+    LKDBG_PERF_PAGE_FAULTS,
+    LKDBG_PERF_CONTEXT_SWITCHES,
+    LKDBG_PERF_TASK_CLOCK, // nanoseconds
+
+    LKDBG_PERF_COUNTER_COUNT
+} LKDBG_Perf_Counter_Kind;
+
+// One of these follows a block's end event for each counter that was available.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U8  counter; // LKDBG_Perf_Counter_Kind
+    LK_U32 thread_id;
+    LK_U64 delta;
+    LK_U64 time;    // same as the block's end event
+} LKDBG_Perf_Counter;
+
+#define LKDBG_MAX_SAMPLE_DEPTH 64
+
+// A sampled call stack is one of these for each frame, leaf first. 'address' is resolved
+// to a function name through the string table, like block names are.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U8  depth; // 0 for the interrupted instruction, 1 for its caller, and so on
+    LK_U32 thread_id;
+    LK_U64 address;
+    LK_U64 time;  // same for all frames of a sample
+} LKDBG_Sample;
+
+// LKDBG_COUNTER is always followed by an LKDBG_COUNTER_VALUE with the same time, there's no room for both
+// the name and the value in one event. LKDBG_MARK is an LKDBG_Named_Event on its own.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U32 thread_id;
+    const char* name;
+    LK_U64 time;
+} LKDBG_Named_Event;
+
+typedef struct
+{
+    LK_U8  kind;
+    LK_U32 thread_id;
+    LK_F64 value;
+    LK_U64 time;
+} LKDBG_Counter_Value;
+
+// A flow begin is followed by an LKDBG_FLOW_NAME (an LKDBG_Named_Event) with the same time.
+// Steps and ends only have the id; the name is the one the id began with.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U8  phase; // LKDBG_FLOW_PHASE_BEGIN, _STEP or _END
+    LK_U32 thread_id;
+    LK_U64 id;
+    LK_U64 time;
+} LKDBG_Flow;
+
+// LKDBG_ALLOCATION is followed by an LKDBG_ALLOCATION_SIZE, and then by an LKDBG_ALLOCATION_SITE
+// (an LKDBG_Named_Event) if it has one, all with the same time. LKDBG_DEALLOCATION is on its own.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U8  memory_class; // LKDBG_MEMORY_HEAP, _PAGES or _REGION
+    LK_U32 thread_id;
+    LK_U64 address;
+    LK_U64 time;
+} LKDBG_Allocation;
+
+typedef struct
+{
+    LK_U8  kind;
+    LK_U32 thread_id;
+    LK_U64 size;
+    LK_U64 time;
+} LKDBG_Allocation_Size;
+
+// An uncontended acquisition is just LKDBG_LOCK_PHASE_ACQUIRED, a contended one is preceded by
+// LKDBG_LOCK_PHASE_WAIT, and either is followed by LKDBG_LOCK_PHASE_RELEASED on the same thread.
+typedef struct
+{
+    LK_U8  kind;
+    LK_U8  phase;  // LKDBG_LOCK_PHASE_WAIT, _ACQUIRED or _RELEASED
+    LK_U8  shared; // 1 for read locks of an LKDBG_RW_Lock
+    LK_U32 thread_id;
+    const char* name;
+    LK_U64 time;
+} LKDBG_Lock_Event;
+
 typedef enum
 {
     LKDBG_BLOCK,
     LKDBG_CONTEXT_SWITCH,
+    LKDBG_PERF_COUNTER,
+    LKDBG_SAMPLE,
+    LKDBG_COUNTER,
+    LKDBG_COUNTER_VALUE,
+    LKDBG_MARK,
+    LKDBG_FLOW,
+    LKDBG_FLOW_NAME,
+    LKDBG_ALLOCATION,
+    LKDBG_ALLOCATION_SIZE,
+    LKDBG_ALLOCATION_SITE,
+    LKDBG_DEALLOCATION,
+    LKDBG_LOCK,
 } LKDBG_Event_Kind;
 
 typedef union
@@ -213,6 +622,18 @@ typedef union
     LK_U8 kind;
     LKDBG_Block block;
     LKDBG_Context_Switch context_switch;
+    LKDBG_Perf_Counter perf_counter;
+    LKDBG_Sample sample;
+    LKDBG_Named_Event counter;
+    LKDBG_Counter_Value counter_value;
+    LKDBG_Named_Event mark;
+    LKDBG_Flow flow;
+    LKDBG_Named_Event flow_name;
+    LKDBG_Allocation allocation;
+    LKDBG_Allocation_Size allocation_size;
+    LKDBG_Named_Event allocation_site;
+    LKDBG_Allocation deallocation;
+    LKDBG_Lock_Event lock;
 } LKDBG_Event;
 
 static LK_U64 lkdbg_get_event_time(const LKDBG_Event* a)
@@ -221,414 +642,3645 @@ static LK_U64 lkdbg_get_event_time(const LKDBG_Event* a)
     {
     case LKDBG_BLOCK:          return a->block.time;
     case LKDBG_CONTEXT_SWITCH: return a->context_switch.time;
+    case LKDBG_PERF_COUNTER:   return a->perf_counter.time;
+    case LKDBG_SAMPLE:         return a->sample.time;
+    case LKDBG_COUNTER:        return a->counter.time;
+    case LKDBG_COUNTER_VALUE:  return a->counter_value.time;
+    case LKDBG_MARK:           return a->mark.time;
+    case LKDBG_FLOW:           return a->flow.time;
+    case LKDBG_FLOW_NAME:      return a->flow_name.time;
+    case LKDBG_ALLOCATION:      return a->allocation.time;
+    case LKDBG_ALLOCATION_SIZE: return a->allocation_size.time;
+    case LKDBG_ALLOCATION_SITE: return a->allocation_site.time;
+    case LKDBG_DEALLOCATION:    return a->deallocation.time;
+    case LKDBG_LOCK:            return a->lock.time;
     default:                   return 0;
     }
 }
 
-
-typedef struct
+// Events that were pushed by a call to one of the lkdbg_push_* functions, as opposed to the ones that
+// continue them, samples and context switches. Those are what instrumentation overhead is counted in.
+static inline int lkdbg_is_pushed_event(const LKDBG_Event* a)
 {
-    LK_U32 thread_id;
-    const char* name;
-
-    LKDBG_Event* events;
-    LK_U64 event_count;
-    LK_U64 event_capacity;
-} LKDBG_Thread;
+    return a->kind == LKDBG_BLOCK || a->kind == LKDBG_COUNTER || a->kind == LKDBG_MARK || a->kind == LKDBG_FLOW ||
+           a->kind == LKDBG_ALLOCATION || a->kind == LKDBG_DEALLOCATION || a->kind == LKDBG_LOCK;
+}
 
-typedef struct
+// Takes the instrumentation overhead out of a block's duration. 'events' is the number of pushed events
+// from the block's begin to its end: the end's index minus the begin's. That counts the begin itself,
+// which only adds to the block's duration after its clock was read, so it's one more than the events
+// pushed inside.
+static inline LK_U64 lkdbg_subtract_overhead(LK_U64 ticks, LK_U64 events, LK_F64 event_overhead)
 {
-    CRITICAL_SECTION lock;
+    if (events <= 1) return ticks;
+    LK_U64 overhead = (LK_U64)((LK_F64)(events - 1) * event_overhead);
+    return ticks > overhead ? ticks - overhead : 0;
+}
 
-    LKDBG_Thread** threads;
-    LK_U64 thread_count;
-    LK_U64 thread_capacity;
+////////////////////////////////////////////////////////////////////////////////
+// Live statistics
+////////////////////////////////////////////////////////////////////////////////
 
-    TRACEHANDLE etw_consumer_handle;
-    HANDLE etw_thread;
-} LKDBG_Context;
+// The histogram has 4 buckets for every power of two of the duration in ticks,
+// so a percentile read from it is within 25% of the real one.
+#define LKDBG_HISTOGRAM_BUCKETS 256
 
-static void lkdbg_array_push(void** address, LK_U64* count, LK_U64* capacity, void* data, LK_U64 size)
+#ifndef LKDBG_MAX_BLOCK_STATISTICS
+#define LKDBG_MAX_BLOCK_STATISTICS 256 // per thread, must be a power of two
+#endif
+
+// All times are in nanoseconds, except the histogram, which is indexed by duration in ticks.
+// 'kind' says what the name was used for: LKDBG_BLOCK, LKDBG_COUNTER or LKDBG_MARK. Blocks fill in the
+// times and histogram, counters the values, and marks only the count.
+typedef struct
 {
-    if (*count == *capacity)
-    {
-        LK_U64 old_capacity = *capacity;
-        LK_U64 new_capacity = old_capacity * 2;
-        if (new_capacity == 0)
-        {
-            new_capacity = 2048;
-        }
+    const char* name;
+    LK_U8  kind;
+    LK_U64 count;
+    LK_U64 inclusive_time;
+    LK_U64 exclusive_time; // not counting time spent in nested blocks
+    LK_U64 min_time;
+    LK_U64 max_time;
+    LK_U64 time_frequency;
+    LK_U64 histogram[LKDBG_HISTOGRAM_BUCKETS];
 
-        void* new_address = LKDBG_MALLOC(size * new_capacity);
+    LK_F64 min_value;
+    LK_F64 max_value;
+    LK_F64 sum_value;
+    LK_F64 last_value;
+    LK_U64 last_time; // when 'last_value' was recorded, in ticks
+} LKDBG_Statistics;
 
-        if (*address)
-        {
-            LKDBG_MEMCPY(new_address, *address, old_capacity * size);
-            LKDBG_FREE(*address);
-        }
+// Merges the statistics of all threads into 'statistics', one entry per name, and returns how many
+// entries were filled. If that's 'max_count', some names may have been left out.
+// Statistics are cumulative since lkdbg_start().
+LK_U64 lkdbg_query_statistics(LKDBG_Statistics* statistics, LK_U64 max_count);
 
-        *address = new_address;
-        *capacity = new_capacity;
-    }
+// Estimates a percentile (0.5 for the median, 0.99 for p99, ...) of the block's duration, in nanoseconds.
+LK_U64 lkdbg_statistics_percentile(const LKDBG_Statistics* statistics, double percentile);
 
-    LKDBG_MEMCPY((LK_U8*) *address + ((*count)++ * size), data, size);
-}
+LK_U64 lkdbg_histogram_bucket(LK_U64 ticks);
+LK_U64 lkdbg_histogram_bucket_start(LK_U64 bucket);
 
+////////////////////////////////////////////////////////////////////////////////
+// Reader header
+////////////////////////////////////////////////////////////////////////////////
 
-LKDBG_Context lkdbg_context;
-LKDBG_THREAD_LOCAL LKDBG_Thread* lkdbg_thread;
+// The reader memory maps the profile, so opening even a huge profile is cheap,
+// and only the pages you actually iterate over are ever read from disk.
 
-void lkdbg_register_thread(const char* name)
+typedef struct
 {
-    LKDBG_ASSERT(!lkdbg_thread, "same thread registered more than once");
+    const LKDBG_File_Header* header;
+    const LKDBG_File_String* strings;
+    const LKDBG_File_Thread* threads;
+    const LKDBG_Event*       events;
+    const LK_U64*            index;
 
-    LKDBG_Thread* thread = (LKDBG_Thread*) LKDBG_MALLOC(sizeof(LKDBG_Thread));
-    lkdbg_thread = thread;
-
-    thread->thread_id = GetCurrentThreadId();
-    thread->name = name;
-    thread->events = 0;
-    thread->event_count = 0;
-    thread->event_capacity = 0;
+    void*  mapping;
+    LK_U64 mapping_size;
+    void*  os_file;
+    void*  os_mapping;
+} LKDBG_Profile;
 
-    EnterCriticalSection(&lkdbg_context.lock);
-    lkdbg_array_push((void**) &lkdbg_context.threads, &lkdbg_context.thread_count, &lkdbg_context.thread_capacity, &thread, sizeof(LKDBG_Thread*));
-    LeaveCriticalSection(&lkdbg_context.lock);
-}
+#define LKDBG_ALL_THREADS ((LK_U64) -1)
 
-void lkdbg_push_block_event(const char* name, int begin)
+typedef struct
 {
-    LKDBG_ASSERT(lkdbg_thread, "pushed events on thread before it was registered");
-
-    LARGE_INTEGER qpc;
-    QueryPerformanceCounter(&qpc);
+    const LKDBG_Profile* profile;
+    LK_U64 to_time;
 
-    LKDBG_Event event;
-    event.kind = LKDBG_BLOCK;
-    event.block.begin = begin ? 1 : 0;
-    event.block.thread_id = GetCurrentThreadId();
-    event.block.name = name;
-    event.block.time = qpc.QuadPart;
+    LK_U64 cursor_count;
+    const LKDBG_Event** cursors;
+    const LKDBG_Event** ends;
+    LK_U64* cursor_threads;
 
-    lkdbg_array_push((void**) &lkdbg_thread->events, &lkdbg_thread->event_count, &lkdbg_thread->event_capacity, &event, sizeof(LKDBG_Event));
-}
+    LK_U64 thread; // thread index of the event last returned by lkdbg_profile_next()
+} LKDBG_Profile_Iterator;
 
-static void lkdbg_etw_start();
-static void lkdbg_etw_end();
+// Returns 1 on success, 0 if the file can't be opened or isn't a valid profile.
+int  lkdbg_open_profile(LKDBG_Profile* profile, const char* path);
+void lkdbg_close_profile(LKDBG_Profile* profile);
 
-void lkdbg_start(int do_etw)
-{
-    InitializeCriticalSection(&lkdbg_context.lock);
+// Event and thread names are stored as the pointers they had in the profiled program.
+// This turns them back into strings. Returns "" for unknown pointers.
+const char* lkdbg_profile_string(const LKDBG_Profile* profile, const void* ptr);
 
-    lkdbg_context.etw_consumer_handle = INVALID_PROCESSTRACE_HANDLE;
+// Returns the index (relative to the thread's first event) of the first event at or after 'time'.
+LK_U64 lkdbg_profile_seek(const LKDBG_Profile* profile, LK_U64 thread_index, LK_U64 time);
 
-    if (do_etw)
-    {
-        lkdbg_etw_start();
-    }
-}
+// Given a block end event returned by lkdbg_profile_next(), fills 'deltas' with the performance counters
+// recorded for that block. Returns a mask of (1 << LKDBG_Perf_Counter_Kind) for the counters that were found.
+LK_U32 lkdbg_profile_perf_counters(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* end_event, LK_U64 deltas[LKDBG_PERF_COUNTER_COUNT]);
+const char* lkdbg_perf_counter_name(int counter);
 
-static void lkdbg_add_file_string(const char* str, LKDBG_File_String** strings, LK_U64* count, LK_U64* capacity)
-{
-    for (LK_U64 i = 0; i < *count; i++)
-        if ((*strings)[i].ptr == str)
-            return;
+// Given an LKDBG_COUNTER event, returns its value through 'value'. Returns 0 if the value event is missing
+// (which can happen at the start of a flight recorder snapshot), 1 otherwise.
+int lkdbg_profile_counter_value(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* counter, LK_F64* value);
 
-    LKDBG_File_String string;
-    string.ptr = str;
+// Given an LKDBG_FLOW begin event, returns the pointer of its name (for lkdbg_profile_string()), or 0 if it's missing.
+const void* lkdbg_profile_flow_name(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* flow);
 
-    int i = 0;
-    while (str[i] && i < (sizeof(string.string) - 1))
-    {
-        string.string[i] = str[i];
-        i++;
-    }
-    string.string[i] = 0;
+// Given the first (depth 0) event of a sample, fills 'addresses' with its call stack, leaf first,
+// and returns the number of frames. Pass the addresses to lkdbg_profile_string() for function names.
+LK_U64 lkdbg_profile_sample_stack(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* sample, LK_U64* addresses, LK_U64 max_depth);
 
-    lkdbg_array_push((void**) strings, count, capacity, &string, sizeof(LKDBG_File_String));
-}
+// Given an LKDBG_ALLOCATION event, finds its size and the pointer of its site's name (0 if it has none).
+// Returns 1 on success, 0 if the size is missing.
+int lkdbg_profile_allocation(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* allocation, LK_U64* size, const void** site);
 
-void lkdbg_end(const char* profile_path)
-{
-    if (lkdbg_context.etw_consumer_handle != INVALID_PROCESSTRACE_HANDLE)
-    {
-        lkdbg_etw_end();
-    }
+// Iterates over all events in [from_time, to_time), in time order.
+// Pass LKDBG_ALL_THREADS to merge the events of all threads, or a thread index to only visit one thread.
+// Every lkdbg_profile_begin() must be paired with an lkdbg_profile_end().
+void lkdbg_profile_begin(LKDBG_Profile_Iterator* it, const LKDBG_Profile* profile, LK_U64 thread_index, LK_U64 from_time, LK_U64 to_time);
+const LKDBG_Event* lkdbg_profile_next(LKDBG_Profile_Iterator* it);
+void lkdbg_profile_end(LKDBG_Profile_Iterator* it);
 
-    if (profile_path)
-    {
-        LK_U64 total_event_capacity = 0;
-        for (LK_U64 i = 0; i < lkdbg_context.thread_count; i++)
-        {
-            LKDBG_Thread* thread = lkdbg_context.threads[i];
-            total_event_capacity += thread->event_count;
-        }
+#ifdef __cplusplus
+}
+#endif
 
-        LKDBG_Event* temp_events = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * total_event_capacity);
-        LKDBG_Event* all_events = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * total_event_capacity);
-        LK_U64 all_count = 0;
+#endif // LK_DEBUG_HEADER
 
-        LKDBG_File_String* strings = 0;
-        LK_U64 string_count = 0;
-        LK_U64 string_capacity = 0;
+////////////////////////////////////////////////////////////////////////////////
+// Implementation
+////////////////////////////////////////////////////////////////////////////////
 
-        for (LK_U64 i = 0; i < lkdbg_context.thread_count; i++)
-        {
-            LKDBG_MEMCPY(temp_events, all_events, sizeof(LKDBG_Event) * all_count);
-            LKDBG_Thread* thread = lkdbg_context.threads[i];
+#ifdef LKDBG_IMPLEMENTATION
+#ifndef LKDBG_IMPLEMENTED
+#define LKDBG_IMPLEMENTED
 
-            lkdbg_add_file_string(thread->name, &strings, &string_count, &string_capacity);
-            for (LK_U64 j = 0; j < thread->event_count; j++)
-            {
-                if (thread->events[j].kind != LKDBG_BLOCK) continue;
-                lkdbg_add_file_string(thread->events[j].block.name, &strings, &string_count, &string_capacity);
-            }
+#ifndef LKDBG_MALLOC
+ #include <stdlib.h>
+ #define LKDBG_MALLOC(size) malloc(size)
+#endif
 
-            LK_U64 ai = 0;
-            LK_U64 ti = 0;
-            LK_U64 ei = 0;
-            while (ti < all_count && ei < thread->event_count)
-            {
-                LK_U64 t_qpc = lkdbg_get_event_time(&temp_events[ti]);
-                LK_U64 e_qpc = lkdbg_get_event_time(&thread->events[ei]);
-                if (t_qpc < e_qpc)
-                    all_events[ai++] = temp_events[ti++];
-                else
-                    all_events[ai++] = thread->events[ei++];
-            }
+#ifndef LKDBG_FREE
+ #define LKDBG_FREE(size) free(size)
+#endif
 
-            while (ti < all_count)
-                all_events[ai++] = temp_events[ti++];
+#ifndef LKDBG_MEMCPY
+  #include <string.h>
+  #define LKDBG_MEMCPY(dest, src, size) memcpy(dest, src, size)
+#endif
 
-            while (ei < thread->event_count)
-                all_events[ai++] = thread->events[ei++];
+#ifndef LKDBG_ASSERT
+  #include <assert.h>
+  #define LKDBG_ASSERT(test, message) assert((test) && (message))
+#endif
 
-            all_count += thread->event_count;
-        }
+#ifndef LKDBG_THREAD_LOCAL
+  #if defined(_MSC_VER)
+    #define LKDBG_THREAD_LOCAL __declspec(thread)
+  #elif defined(__GNUC__)
+    #define LKDBG_THREAD_LOCAL __thread
+  #elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+    #define LKDBG_THREAD_LOCAL _Thread_local
+  #elif defined(__cplusplus) && (__cplusplus > 199711L)
+    #define LKDBG_THREAD_LOCAL thread_local
+  #else
+    #define LKDBG_THREAD_LOCAL
+  #endif
+#endif
 
-        LKDBG_FREE(temp_events);
 
-        FILE* out = fopen(profile_path, "wb");
-        if (out)
-        {
-            LARGE_INTEGER frequency;
-            QueryPerformanceFrequency(&frequency);
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 
-            LKDBG_File_Header header;
-            header.time_frequency = frequency.QuadPart;
-            header.string_count = string_count;
-            header.thread_count = lkdbg_context.thread_count;
-            header.event_count = all_count;
-            fwrite(&header, sizeof(header), 1, out);
+#if defined(_WIN32)
+#include <windows.h>
+#define INITGUID
+#include <evntrace.h>
+#include <evntcons.h>
+#elif defined(__linux__)
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#else
+#error Unrecognized operating system
+#endif
+
+#if !defined(LKDBG_NO_TSC) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define LKDBG_HAS_TSC 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#else
+#define LKDBG_HAS_TSC 0
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// OS layer
+
+#if defined(_WIN32)
+
+typedef CRITICAL_SECTION LKDBG_Mutex;
+
+static void lkdbg_os_mutex_make(LKDBG_Mutex* mutex)   { InitializeCriticalSection(mutex); }
+static void lkdbg_os_mutex_free(LKDBG_Mutex* mutex)   { DeleteCriticalSection(mutex);     }
+static void lkdbg_os_mutex_lock(LKDBG_Mutex* mutex)   { EnterCriticalSection(mutex);      }
+static void lkdbg_os_mutex_unlock(LKDBG_Mutex* mutex) { LeaveCriticalSection(mutex);      }
+
+#if defined(_M_ARM64)
+static void lkdbg_os_fence_acquire() { __dmb(_ARM64_BARRIER_ISH); }
+static void lkdbg_os_fence_release() { __dmb(_ARM64_BARRIER_ISH); }
+#else
+static void lkdbg_os_fence_acquire() { _ReadWriteBarrier(); }
+static void lkdbg_os_fence_release() { _ReadWriteBarrier(); }
+#endif
+static void lkdbg_os_fence_full() { MemoryBarrier(); }
+
+static void lkdbg_os_yield() { SwitchToThread(); }
+
+// Both return the previous value.
+static void* lkdbg_os_compare_exchange_pointer(void* volatile* address, void* expected, void* desired)
+{
+    return InterlockedCompareExchangePointer(address, desired, expected);
+}
+
+static LK_U64 lkdbg_os_fetch_add(volatile LK_U64* address, LK_U64 value)
+{
+    return (LK_U64) InterlockedExchangeAdd64((volatile LONG64*) address, (LONG64) value);
+}
+
+static LK_U32 lkdbg_os_thread_id()
+{
+    return GetCurrentThreadId();
+}
+
+static LK_U64 lkdbg_os_time()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+static LK_U64 lkdbg_os_time_frequency()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+}
+
+static void lkdbg_os_symbol_name(LK_U64 address, char* buffer, int size)
+{
+    snprintf(buffer, size, "0x%llx", (unsigned long long) address);
+}
+
+#elif defined(__linux__)
+
+typedef pthread_mutex_t LKDBG_Mutex;
+
+static void lkdbg_os_mutex_make(LKDBG_Mutex* mutex)   { pthread_mutex_init(mutex, 0);  }
+static void lkdbg_os_mutex_free(LKDBG_Mutex* mutex)   { pthread_mutex_destroy(mutex);  }
+static void lkdbg_os_mutex_lock(LKDBG_Mutex* mutex)   { pthread_mutex_lock(mutex);     }
+static void lkdbg_os_mutex_unlock(LKDBG_Mutex* mutex) { pthread_mutex_unlock(mutex);   }
+
+static void lkdbg_os_fence_acquire() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+static void lkdbg_os_fence_release() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+static void lkdbg_os_fence_full()    { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+static void lkdbg_os_yield() { sched_yield(); }
+
+// Both return the previous value.
+static void* lkdbg_os_compare_exchange_pointer(void* volatile* address, void* expected, void* desired)
+{
+    __atomic_compare_exchange_n(address, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return expected;
+}
+
+static LK_U64 lkdbg_os_fetch_add(volatile LK_U64* address, LK_U64 value)
+{
+    return __atomic_fetch_add(address, value, __ATOMIC_RELAXED);
+}
+
+static LK_U32 lkdbg_os_thread_id()
+{
+    return (LK_U32) syscall(SYS_gettid);
+}
+
+// CLOCK_MONOTONIC, because perf can be asked to timestamp its records with the same clock.
+static LK_U64 lkdbg_os_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (LK_U64) ts.tv_sec * 1000000000 + (LK_U64) ts.tv_nsec;
+}
+
+static LK_U64 lkdbg_os_time_frequency()
+{
+    return 1000000000;
+}
+
+// Writes the name of the function containing 'address' into 'buffer'.
+// dladdr() only knows about exported symbols, so executables need -rdynamic.
+static void lkdbg_os_symbol_name(LK_U64 address, char* buffer, int size)
+{
+    Dl_info info;
+    int found = dladdr((void*)(uintptr_t) address, &info);
+    if (found && info.dli_sname)
+    {
+        snprintf(buffer, size, "%s", info.dli_sname);
+    }
+    else if (found && info.dli_fname && info.dli_fbase)
+    {
+        const char* module = strrchr(info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        snprintf(buffer, size, "%s+0x%llx", module, (unsigned long long)(address - (LK_U64)(uintptr_t) info.dli_fbase));
+    }
+    else
+    {
+        snprintf(buffer, size, "0x%llx", (unsigned long long) address);
+    }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Cross-platform
+
+// 'sequence' is odd while the owning thread is updating the entry, and readers retry until they see
+// the same even value before and after copying it.
+typedef struct
+{
+    volatile LK_U64 sequence;
+    LKDBG_Statistics statistics;
+} LKDBG_Block_Statistics;
+
+typedef struct
+{
+    const char* name;
+    LK_U64 begin_time;
+    LK_U64 begin_index; // 'pushed_events' at the begin
+    LK_U64 child_time;
+} LKDBG_Open_Block;
+
+typedef struct LKDBG_Thread
+{
+    LK_U32 thread_id;
+    const char* name;
+    char default_name[32]; // what 'name' points to for threads that registered on their first event
+
+    struct LKDBG_Thread* next; // the thread that registered before this one
+    LK_U64 index;              // registration order, from 0
+    volatile LK_U32* pushing;  // the owning thread's lkdbg_thread_pushing, see lkdbg_begin_push()
+
+    // with LKDBG_FLIGHT_RECORDER, 'events' is a ring of 'event_capacity' events, and 'ring_head'
+    // counts all events ever pushed; 'event_count' is unused until the ring is copied out
+    LKDBG_Event* events;
+    LK_U64 event_count;
+    LK_U64 event_capacity;
+    volatile LK_U64 ring_head;
+    LK_U64 pushed_events; // calls to the lkdbg_push_* functions, see lkdbg_is_pushed_event()
+
+    // open addressing by name pointer, allocated at registration so readers never see it move
+    LKDBG_Block_Statistics* statistics;
+    LK_U64 statistics_dropped;
+    LKDBG_Open_Block* open_blocks;
+    LK_U64 open_block_count;
+    LK_U64 open_block_capacity;
+
+    // counter values at the beginning of each open block, LKDBG_PERF_COUNTER_COUNT per block
+    LK_U32 perf_counter_mask;
+    LK_U64* perf_counter_stack;
+    LK_U64 perf_counter_stack_count;
+    LK_U64 perf_counter_stack_capacity;
+#if defined(__linux__)
+    int perf_counter_fds[LKDBG_PERF_COUNTER_COUNT];
+    LK_U8 perf_counter_order[LKDBG_PERF_COUNTER_COUNT]; // which counter each member of the group is
+    int perf_counter_fd_count;
+
+    // written only by the SIGPROF handler, and moved into 'events' with SIGPROF blocked
+    LKDBG_Event* samples;
+    volatile LK_U64 sample_count;
+    LK_U64 samples_dropped;
+    LK_U64 stack_low;
+    LK_U64 stack_high;
+    timer_t sample_timer;
+    int sample_timer_active;
+#endif
+} LKDBG_Thread;
+
+#define LKDBG_PERF_MAX_CPUS 256
+
+typedef struct
+{
+    LK_U64 tsc;
+    LK_U64 os_time;
+} LKDBG_Clock_Pair;
+
+typedef struct
+{
+    LKDBG_Mutex lock;
+    int flags;
+    int sample_rate;
+    int flight_recorder_size;
+    LK_F64 event_overhead; // in ticks
+
+    int use_tsc;
+    LKDBG_Clock_Pair tsc_start;
+
+    // Registered threads, newest first. Registering pushes onto the front with a compare-exchange, and 'next'
+    // pointers never change after that, so readers can walk the list while threads are being added.
+    // Nothing is removed until lkdbg_end(), which frees the whole list.
+    void* volatile thread_list;
+    volatile LK_U64 thread_count;
+
+    volatile int running;       // between lkdbg_start() and lkdbg_end()
+    volatile LK_U32 generation; // changes at lkdbg_start() and lkdbg_end(), see lkdbg_registered_thread()
+    volatile LK_U64 registering; // threads inside lkdbg_register_thread(), see lkdbg_end()
+
+#if defined(_WIN32)
+    TRACEHANDLE etw_consumer_handle;
+    HANDLE etw_thread;
+#elif defined(__linux__)
+    int perf_running;
+    int perf_stop;
+    int perf_tracepoint;    // 1 for sched:sched_switch, 0 for PERF_RECORD_SWITCH records
+    int perf_next_pid_offset;
+    int perf_cpu_count;
+    int perf_fds[LKDBG_PERF_MAX_CPUS];
+    void* perf_buffers[LKDBG_PERF_MAX_CPUS];
+    LK_U64 perf_buffer_size;
+    pthread_t perf_thread;
+    LKDBG_Clock_Pair perf_anchor; // see lkdbg_perf_time()
+    LK_F64 perf_tsc_per_tick;
+
+    int sample_handler_installed;
+    struct sigaction sample_previous_action; // put back by lkdbg_sampling_end()
+
+    int stream_running;
+    int stream_stop;
+    int stream_fd;
+    pthread_t stream_thread;
+    struct LKDBG_Stream* stream;
+#endif
+} LKDBG_Context;
+
+static void lkdbg_array_push(void** address, LK_U64* count, LK_U64* capacity, void* data, LK_U64 size)
+{
+    if (*count == *capacity)
+    {
+        LK_U64 old_capacity = *capacity;
+        LK_U64 new_capacity = old_capacity * 2;
+        if (new_capacity == 0)
+        {
+            new_capacity = 2048;
+        }
+
+        void* new_address = LKDBG_MALLOC(size * new_capacity);
+
+        if (*address)
+        {
+            LKDBG_MEMCPY(new_address, *address, old_capacity * size);
+            LKDBG_FREE(*address);
+        }
+
+        *address = new_address;
+        *capacity = new_capacity;
+    }
+
+    LKDBG_MEMCPY((LK_U8*) *address + ((*count)++ * size), data, size);
+}
+
+static void lkdbg_array_push_many(void** address, LK_U64* count, LK_U64* capacity, void* data, LK_U64 size, LK_U64 data_count)
+{
+    for (LK_U64 i = 0; i < data_count; i++)
+        lkdbg_array_push(address, count, capacity, (LK_U8*) data + i * size, size);
+}
+
+
+LKDBG_Context lkdbg_context;
+LKDBG_THREAD_LOCAL LKDBG_Thread* lkdbg_thread;
+LKDBG_THREAD_LOCAL LK_U32 lkdbg_thread_generation;
+LKDBG_THREAD_LOCAL volatile LK_U32* lkdbg_thread_pushing;
+volatile int lkdbg_enabled = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+// Clock
+
+#ifndef LKDBG_TSC_CALIBRATION_TIME
+#define LKDBG_TSC_CALIBRATION_TIME 0.01 // seconds
+#endif
+
+#if LKDBG_HAS_TSC
+
+static LK_U64 lkdbg_rdtsc()
+{
+    return __rdtsc();
+}
+
+static int lkdbg_tsc_is_invariant()
+{
+    unsigned int edx;
+#if defined(_MSC_VER)
+    int registers[4];
+    __cpuid(registers, 0x80000000);
+    if ((unsigned int) registers[0] < 0x80000007) return 0;
+    __cpuid(registers, 0x80000007);
+    edx = (unsigned int) registers[3];
+#else
+    unsigned int eax, ebx, ecx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return 0;
+#endif
+    if (!(edx & (1u << 8))) return 0;
+
+#if defined(__linux__)
+    // the kernel checks that the TSCs of all processors agree, and stops using it as its clock if they don't
+    FILE* in = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (in)
+    {
+        char name[32] = { 0 };
+        int is_tsc = fgets(name, sizeof(name), in) && !strncmp(name, "tsc", 3);
+        fclose(in);
+        return is_tsc;
+    }
+#endif
+    return 1;
+}
+
+#else
+
+static LK_U64 lkdbg_rdtsc() { return 0; }
+static int lkdbg_tsc_is_invariant() { return 0; }
+
+#endif
+
+static LK_U64 lkdbg_time()
+{
+#if LKDBG_HAS_TSC
+    if (lkdbg_context.use_tsc) return lkdbg_rdtsc();
+#endif
+    return lkdbg_os_time();
+}
+
+// The TSC value at the middle of the quickest of a few system clock reads.
+static LKDBG_Clock_Pair lkdbg_read_clock_pair()
+{
+    LKDBG_Clock_Pair best = { 0, 0 };
+    LK_U64 best_width = (LK_U64) -1;
+    for (int i = 0; i < 5; i++)
+    {
+        LK_U64 before = lkdbg_rdtsc();
+        LK_U64 os_time = lkdbg_os_time();
+        LK_U64 after = lkdbg_rdtsc();
+        if (after - before < best_width)
+        {
+            best_width = after - before;
+            best.tsc = before + (after - before) / 2;
+            best.os_time = os_time;
+        }
+    }
+    return best;
+}
+
+// TSC ticks per system clock tick, measured from lkdbg_start() until 'now'.
+static LK_F64 lkdbg_tsc_per_os_tick(LKDBG_Clock_Pair now)
+{
+    LKDBG_Clock_Pair start = lkdbg_context.tsc_start;
+    if (now.os_time <= start.os_time) return 1;
+    return (LK_F64)(now.tsc - start.tsc) / (LK_F64)(now.os_time - start.os_time);
+}
+
+static void lkdbg_clock_start()
+{
+    lkdbg_context.use_tsc = lkdbg_tsc_is_invariant();
+    if (!lkdbg_context.use_tsc) return;
+
+    lkdbg_context.tsc_start = lkdbg_read_clock_pair();
+
+    LK_U64 wait = (LK_U64)(LKDBG_TSC_CALIBRATION_TIME * (double) lkdbg_os_time_frequency());
+    while (lkdbg_os_time() - lkdbg_context.tsc_start.os_time < wait) {}
+}
+
+static LK_U64 lkdbg_time_frequency()
+{
+    if (!lkdbg_context.use_tsc) return lkdbg_os_time_frequency();
+    LK_F64 ratio = lkdbg_tsc_per_os_tick(lkdbg_read_clock_pair());
+    return (LK_U64)(ratio * (LK_F64) lkdbg_os_time_frequency() + 0.5);
+}
+
+void lkdbg_set_enabled(int enabled)
+{
+    lkdbg_enabled = enabled ? 1 : 0;
+}
+
+// Must only be called by the thread that owns 'thread', the ring is read without locks.
+static void lkdbg_push_event(LKDBG_Thread* thread, LKDBG_Event* event)
+{
+    if (lkdbg_context.flags & LKDBG_FLIGHT_RECORDER)
+    {
+        LK_U64 head = thread->ring_head;
+        thread->events[head & (thread->event_capacity - 1)] = *event;
+        lkdbg_os_fence_release();
+        thread->ring_head = head + 1;
+    }
+    else
+    {
+        lkdbg_array_push((void**) &thread->events, &thread->event_count, &thread->event_capacity, event, sizeof(LKDBG_Event));
+    }
+}
+
+static void lkdbg_perf_counters_open(LKDBG_Thread* thread);
+static void lkdbg_perf_counters_close(LKDBG_Thread* thread);
+static void lkdbg_perf_counters_read(LKDBG_Thread* thread, LK_U64* values);
+
+static void lkdbg_sampling_start();
+static void lkdbg_sampling_end();
+static void lkdbg_sampling_register_thread(LKDBG_Thread* thread);
+static void lkdbg_sampling_drain(LKDBG_Thread* thread, int force);
+
+// Everything a thread needs to push events, except sampling and being in the thread list.
+static LKDBG_Thread* lkdbg_make_thread(const char* name)
+{
+    LKDBG_Thread* thread = (LKDBG_Thread*) LKDBG_MALLOC(sizeof(LKDBG_Thread));
+    memset(thread, 0, sizeof(LKDBG_Thread));
+
+    thread->thread_id = lkdbg_os_thread_id();
+    thread->name = name;
+    if (lkdbg_context.flags & LKDBG_FLIGHT_RECORDER)
+    {
+        LK_U64 size = 1;
+        while (size < (LK_U64) lkdbg_context.flight_recorder_size)
+            size *= 2;
+        thread->events = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * size);
+        thread->event_capacity = size;
+    }
+
+    if (lkdbg_context.flags & LKDBG_COLLECT_STATISTICS)
+    {
+        LK_U64 size = sizeof(LKDBG_Block_Statistics) * LKDBG_MAX_BLOCK_STATISTICS;
+        thread->statistics = (LKDBG_Block_Statistics*) LKDBG_MALLOC(size);
+        memset(thread->statistics, 0, size);
+    }
+
+    if (lkdbg_context.flags & LKDBG_CAPTURE_PERF_COUNTERS)
+    {
+        lkdbg_perf_counters_open(thread);
+    }
+    return thread;
+}
+
+static void lkdbg_free_thread(LKDBG_Thread* thread)
+{
+    if (thread->events)
+    {
+        LKDBG_FREE(thread->events);
+    }
+    if (thread->perf_counter_stack)
+    {
+        LKDBG_FREE(thread->perf_counter_stack);
+    }
+    if (thread->statistics)
+    {
+        if (thread->statistics_dropped)
+        {
+            printf("%llu block statistics were dropped on thread %s, increase LKDBG_MAX_BLOCK_STATISTICS\n", (unsigned long long) thread->statistics_dropped, thread->name);
+        }
+        LKDBG_FREE(thread->statistics);
+    }
+    if (thread->open_blocks)
+    {
+        LKDBG_FREE(thread->open_blocks);
+    }
+    lkdbg_perf_counters_close(thread);
+    LKDBG_FREE(thread);
+}
+
+// lkdbg_end() frees every thread, but can't clear the other threads' lkdbg_thread, so a thread's pointer
+// is only good if it was set since the last lkdbg_start(), and lkdbg_end() hasn't started yet. Outside of
+// lkdbg_begin_push(), the thread may still be freed right after this returns.
+static LKDBG_Thread* lkdbg_registered_thread()
+{
+    LKDBG_Thread* thread = lkdbg_thread;
+    if (thread && lkdbg_thread_generation == lkdbg_context.generation) return thread;
+    return 0;
+}
+
+static void lkdbg_add_thread(LKDBG_Thread* thread)
+{
+    thread->index = lkdbg_os_fetch_add(&lkdbg_context.thread_count, 1);
+
+    void* head = lkdbg_context.thread_list;
+    while (1)
+    {
+        thread->next = (LKDBG_Thread*) head;
+        void* previous = lkdbg_os_compare_exchange_pointer(&lkdbg_context.thread_list, head, thread);
+        if (previous == head) break;
+        head = previous;
+    }
+}
+
+// The registered threads, oldest first, in a new allocation. A thread that's registering at the same time
+// may or may not be included.
+static LKDBG_Thread** lkdbg_collect_threads(LK_U64* count)
+{
+    LKDBG_Thread* newest = (LKDBG_Thread*) lkdbg_context.thread_list;
+    lkdbg_os_fence_acquire();
+
+    LK_U64 thread_count = 0;
+    for (LKDBG_Thread* thread = newest; thread; thread = thread->next)
+        thread_count++;
+
+    LKDBG_Thread** threads = (LKDBG_Thread**) LKDBG_MALLOC(sizeof(LKDBG_Thread*) * (thread_count + 1));
+    LK_U64 i = thread_count;
+    for (LKDBG_Thread* thread = newest; thread; thread = thread->next)
+        threads[--i] = thread;
+
+    *count = thread_count;
+    return threads;
+}
+
+// The count is in its own allocation, which is never freed, because lkdbg_end() may read it after the
+// thread it belongs to has exited.
+static volatile LK_U32* lkdbg_get_thread_pushing()
+{
+    if (!lkdbg_thread_pushing)
+    {
+        volatile LK_U32* pushing = (volatile LK_U32*) LKDBG_MALLOC(sizeof(LK_U32));
+        *pushing = 0;
+        lkdbg_thread_pushing = pushing;
+    }
+    return lkdbg_thread_pushing;
+}
+
+static LKDBG_Thread* lkdbg_begin_push(int register_thread);
+static void lkdbg_end_push();
+
+// Registering a thread that already registered (maybe on its first event) just renames it.
+void lkdbg_register_thread(const char* name)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(0);
+    if (thread)
+    {
+        if (name) thread->name = name;
+        lkdbg_end_push();
+        return;
+    }
+
+    // lkdbg_end() clears 'running' and then waits for 'registering' to drop to 0, so a thread either sees
+    // that it's too late, or is in the list by the time lkdbg_end() collects it
+    lkdbg_os_fetch_add(&lkdbg_context.registering, 1);
+    lkdbg_os_fence_full();
+    if (lkdbg_context.running)
+    {
+        thread = lkdbg_make_thread(name);
+        if (!name)
+        {
+            snprintf(thread->default_name, sizeof(thread->default_name), "thread %u", (unsigned) thread->thread_id);
+            thread->name = thread->default_name;
+        }
+        thread->pushing = lkdbg_get_thread_pushing();
+
+        lkdbg_thread = thread;
+        lkdbg_thread_generation = lkdbg_context.generation;
+        lkdbg_sampling_register_thread(thread);
+        lkdbg_add_thread(thread);
+    }
+    lkdbg_os_fetch_add(&lkdbg_context.registering, (LK_U64) -1);
+}
+
+// Everything that touches the calling thread's LKDBG_Thread goes between these. Returns the thread,
+// registering it first if this is its first event and 'register_thread' is set, or 0 if there's nothing to
+// push to, in which case there's no lkdbg_end_push().
+// lkdbg_end() bumps the generation and then waits for each thread's push count to drop to 0 before it
+// reads or frees the thread. A push raises the count before it checks the generation, with a full fence
+// in between, so either lkdbg_end() sees the count and waits for the push, or the push sees the new
+// generation and leaves the thread alone. It's a count because allocation events and the SIGPROF handler
+// can run in the middle of another push on the same thread.
+static LKDBG_Thread* lkdbg_begin_push(int register_thread)
+{
+    if (register_thread && !lkdbg_registered_thread())
+    {
+        lkdbg_register_thread(0);
+    }
+
+    volatile LK_U32* pushing = lkdbg_thread_pushing;
+    if (!pushing) return 0;
+
+    (*pushing)++;
+    lkdbg_os_fence_full();
+
+    LKDBG_Thread* thread = lkdbg_registered_thread();
+    if (!thread)
+    {
+        (*pushing)--;
+    }
+    return thread;
+}
+
+static void lkdbg_end_push()
+{
+    lkdbg_os_fence_release();
+    (*lkdbg_thread_pushing)--;
+}
+
+static void lkdbg_push_perf_counter_deltas(LKDBG_Thread* thread, LK_U64* end_values, LK_U64 time)
+{
+    if (!thread->perf_counter_stack_count) return; // unbalanced end event
+
+    thread->perf_counter_stack_count -= LKDBG_PERF_COUNTER_COUNT;
+    LK_U64* begin_values = thread->perf_counter_stack + thread->perf_counter_stack_count;
+
+    for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+    {
+        if (!(thread->perf_counter_mask & (1u << i))) continue;
+
+        LKDBG_Event event;
+        event.kind = LKDBG_PERF_COUNTER;
+        event.perf_counter.counter = (LK_U8) i;
+        event.perf_counter.thread_id = thread->thread_id;
+        event.perf_counter.delta = end_values[i] - begin_values[i];
+        event.perf_counter.time = time;
+
+        lkdbg_push_event(thread, &event);
+    }
+}
+
+static LK_U64 lkdbg_highest_bit(LK_U64 x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return index;
+#else
+    return 63 - __builtin_clzll(x);
+#endif
+}
+
+LK_U64 lkdbg_histogram_bucket(LK_U64 ticks)
+{
+    if (ticks < 4) return ticks;
+    LK_U64 bit = lkdbg_highest_bit(ticks);
+    return (bit - 1) * 4 + ((ticks >> (bit - 2)) & 3);
+}
+
+LK_U64 lkdbg_histogram_bucket_start(LK_U64 bucket)
+{
+    if (bucket < 4) return bucket;
+    LK_U64 bit = bucket / 4 + 1;
+    return (4 + (bucket & 3)) << (bit - 2);
+}
+
+// Finds the entry for 'name' and marks it as being written; call lkdbg_end_statistics_update() when done.
+// Returns 0 if the table is full.
+static LKDBG_Statistics* lkdbg_begin_statistics_update(LKDBG_Thread* thread, const char* name, int kind)
+{
+    LK_U64 mask = LKDBG_MAX_BLOCK_STATISTICS - 1;
+    LK_U64 slot = (((LK_U64)(uintptr_t) name) >> 3) & mask;
+    for (LK_U64 probe = 0; thread->statistics[slot].statistics.name != name; probe++)
+    {
+        if (!thread->statistics[slot].statistics.name) break;
+        if (probe == mask)
+        {
+            thread->statistics_dropped++;
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    LKDBG_Block_Statistics* entry = &thread->statistics[slot];
+    entry->sequence++;
+    lkdbg_os_fence_release();
+
+    if (!entry->statistics.name)
+    {
+        entry->statistics.name = name;
+        entry->statistics.kind = (LK_U8) kind;
+    }
+    return &entry->statistics;
+}
+
+static void lkdbg_end_statistics_update(LKDBG_Statistics* statistics)
+{
+    LKDBG_Block_Statistics* entry = (LKDBG_Block_Statistics*)((LK_U8*) statistics - offsetof(LKDBG_Block_Statistics, statistics));
+    lkdbg_os_fence_release();
+    entry->sequence++;
+}
+
+static void lkdbg_update_statistics(LKDBG_Thread* thread, const char* name, LK_U64 duration, LK_U64 child_time)
+{
+    LKDBG_Statistics* statistics = lkdbg_begin_statistics_update(thread, name, LKDBG_BLOCK);
+    if (!statistics) return;
+
+    if (!statistics->count)
+    {
+        statistics->min_time = duration;
+    }
+
+    statistics->count++;
+    statistics->inclusive_time += duration;
+    statistics->exclusive_time += duration > child_time ? duration - child_time : 0;
+    if (duration < statistics->min_time) statistics->min_time = duration;
+    if (duration > statistics->max_time) statistics->max_time = duration;
+    statistics->histogram[lkdbg_histogram_bucket(duration)]++;
+
+    lkdbg_end_statistics_update(statistics);
+}
+
+static void lkdbg_update_counter_statistics(LKDBG_Thread* thread, const char* name, LK_F64 value, LK_U64 time)
+{
+    LKDBG_Statistics* statistics = lkdbg_begin_statistics_update(thread, name, LKDBG_COUNTER);
+    if (!statistics) return;
+
+    if (!statistics->count)
+    {
+        statistics->min_value = value;
+        statistics->max_value = value;
+    }
+
+    statistics->count++;
+    statistics->sum_value += value;
+    if (value < statistics->min_value) statistics->min_value = value;
+    if (value > statistics->max_value) statistics->max_value = value;
+    statistics->last_value = value;
+    statistics->last_time = time;
+
+    lkdbg_end_statistics_update(statistics);
+}
+
+static void lkdbg_update_mark_statistics(LKDBG_Thread* thread, const char* name, LK_U64 time)
+{
+    LKDBG_Statistics* statistics = lkdbg_begin_statistics_update(thread, name, LKDBG_MARK);
+    if (!statistics) return;
+
+    statistics->count++;
+    statistics->last_time = time;
+
+    lkdbg_end_statistics_update(statistics);
+}
+
+static void lkdbg_push_block_statistics(LKDBG_Thread* thread, const char* name, int begin, LK_U64 time)
+{
+    if (begin)
+    {
+        LKDBG_Open_Block block;
+        block.name = name;
+        block.begin_time = time;
+        block.begin_index = thread->pushed_events;
+        block.child_time = 0;
+        lkdbg_array_push((void**) &thread->open_blocks, &thread->open_block_count, &thread->open_block_capacity, &block, sizeof(LKDBG_Open_Block));
+        return;
+    }
+
+    if (!thread->open_block_count) return; // unbalanced end event
+
+    LKDBG_Open_Block* block = &thread->open_blocks[--thread->open_block_count];
+    LK_U64 duration = time - block->begin_time;
+    if (lkdbg_context.flags & LKDBG_SUBTRACT_OVERHEAD)
+    {
+        duration = lkdbg_subtract_overhead(duration, thread->pushed_events - block->begin_index, lkdbg_context.event_overhead);
+    }
+    lkdbg_update_statistics(thread, block->name, duration, block->child_time);
+
+    if (thread->open_block_count)
+    {
+        thread->open_blocks[thread->open_block_count - 1].child_time += duration;
+    }
+}
+
+void lkdbg_push_block_event(const char* name, int begin)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(1);
+    if (!thread) return;
+    thread->pushed_events++;
+
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_push_block_statistics(thread, name, begin, lkdbg_time());
+        lkdbg_sampling_drain(thread, 0);
+        lkdbg_end_push();
+        return;
+    }
+
+    // counters are read after the clock on begin and before it on end, so they don't count our own bookkeeping
+    LK_U64 counters[LKDBG_PERF_COUNTER_COUNT];
+    if (thread->perf_counter_mask && !begin)
+    {
+        lkdbg_perf_counters_read(thread, counters);
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_BLOCK;
+    event.block.begin = begin ? 1 : 0;
+    event.block.thread_id = thread->thread_id;
+    event.block.name = name;
+    event.block.time = lkdbg_time();
+
+    lkdbg_push_event(thread, &event);
+    lkdbg_sampling_drain(thread, 0);
+
+    if (thread->statistics)
+    {
+        lkdbg_push_block_statistics(thread, name, begin, event.block.time);
+    }
+
+    if (thread->perf_counter_mask)
+    {
+        if (begin)
+        {
+            lkdbg_perf_counters_read(thread, counters);
+            lkdbg_array_push_many((void**) &thread->perf_counter_stack, &thread->perf_counter_stack_count, &thread->perf_counter_stack_capacity, counters, sizeof(LK_U64), LKDBG_PERF_COUNTER_COUNT);
+        }
+        else
+        {
+            lkdbg_push_perf_counter_deltas(thread, counters, event.block.time);
+        }
+    }
+    lkdbg_end_push();
+}
+
+void lkdbg_push_counter_event(const char* name, double value)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(1);
+    if (!thread) return;
+    thread->pushed_events++;
+
+    LK_U64 time = lkdbg_time();
+    if (thread->statistics)
+    {
+        lkdbg_update_counter_statistics(thread, name, value, time);
+    }
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_COUNTER;
+    event.counter.thread_id = thread->thread_id;
+    event.counter.name = name;
+    event.counter.time = time;
+    lkdbg_push_event(thread, &event);
+
+    event.kind = LKDBG_COUNTER_VALUE;
+    event.counter_value.thread_id = thread->thread_id;
+    event.counter_value.value = value;
+    event.counter_value.time = time;
+    lkdbg_push_event(thread, &event);
+    lkdbg_end_push();
+}
+
+void lkdbg_push_mark_event(const char* name)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(1);
+    if (!thread) return;
+    thread->pushed_events++;
+
+    LK_U64 time = lkdbg_time();
+    if (thread->statistics)
+    {
+        lkdbg_update_mark_statistics(thread, name, time);
+    }
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_MARK;
+    event.mark.thread_id = thread->thread_id;
+    event.mark.name = name;
+    event.mark.time = time;
+    lkdbg_push_event(thread, &event);
+    lkdbg_end_push();
+}
+
+// Allocators call these from anywhere, including from the allocations that registering a thread makes,
+// so unlike the other push functions they don't register the thread, they just ignore it until it has.
+void lkdbg_push_allocation_event(const void* address, unsigned long long size, int memory_class, const char* site)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(0);
+    if (!thread) return;
+    thread->pushed_events++;
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LK_U64 time = lkdbg_time();
+
+    LKDBG_Event event;
+    event.kind = LKDBG_ALLOCATION;
+    event.allocation.memory_class = (LK_U8) memory_class;
+    event.allocation.thread_id = thread->thread_id;
+    event.allocation.address = (LK_U64)(uintptr_t) address;
+    event.allocation.time = time;
+    lkdbg_push_event(thread, &event);
+
+    event.kind = LKDBG_ALLOCATION_SIZE;
+    event.allocation_size.thread_id = thread->thread_id;
+    event.allocation_size.size = size;
+    event.allocation_size.time = time;
+    lkdbg_push_event(thread, &event);
+
+    if (site)
+    {
+        event.kind = LKDBG_ALLOCATION_SITE;
+        event.allocation_site.thread_id = thread->thread_id;
+        event.allocation_site.name = site;
+        event.allocation_site.time = time;
+        lkdbg_push_event(thread, &event);
+    }
+    lkdbg_end_push();
+}
+
+void lkdbg_push_deallocation_event(const void* address, int memory_class)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(0);
+    if (!thread) return;
+    thread->pushed_events++;
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_DEALLOCATION;
+    event.deallocation.memory_class = (LK_U8) memory_class;
+    event.deallocation.thread_id = thread->thread_id;
+    event.deallocation.address = (LK_U64)(uintptr_t) address;
+    event.deallocation.time = lkdbg_time();
+    lkdbg_push_event(thread, &event);
+    lkdbg_end_push();
+}
+
+void lkdbg_push_lock_event(const char* name, int phase, int shared)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(1);
+    if (!thread) return;
+    thread->pushed_events++;
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_LOCK;
+    event.lock.phase = (LK_U8) phase;
+    event.lock.shared = shared ? 1 : 0;
+    event.lock.thread_id = thread->thread_id;
+    event.lock.name = name;
+    event.lock.time = lkdbg_time();
+    lkdbg_push_event(thread, &event);
+    lkdbg_end_push();
+}
+
+#if defined(_WIN32)
+typedef SRWLOCK LKDBG_OS_Lock;
+typedef SRWLOCK LKDBG_OS_RW_Lock;
+#else
+typedef pthread_mutex_t LKDBG_OS_Lock;
+typedef pthread_rwlock_t LKDBG_OS_RW_Lock;
+#endif
+
+typedef char lkdbg_lock_storage_check[sizeof(LKDBG_OS_Lock) <= sizeof(((LKDBG_Lock*) 0)->storage) ? 1 : -1];
+typedef char lkdbg_rw_lock_storage_check[sizeof(LKDBG_OS_RW_Lock) <= sizeof(((LKDBG_RW_Lock*) 0)->storage) ? 1 : -1];
+
+static void lkdbg_lock_wait_event(const char* name, int shared)
+{
+    if (lkdbg_enabled) lkdbg_push_lock_event(name, LKDBG_LOCK_PHASE_WAIT, shared);
+}
+
+static void lkdbg_lock_acquired_event(const char* name, int shared)
+{
+    if (lkdbg_enabled) lkdbg_push_lock_event(name, LKDBG_LOCK_PHASE_ACQUIRED, shared);
+}
+
+static void lkdbg_lock_released_event(const char* name, int shared)
+{
+    if (lkdbg_enabled) lkdbg_push_lock_event(name, LKDBG_LOCK_PHASE_RELEASED, shared);
+}
+
+void lkdbg_lock_init(LKDBG_Lock* lock, const char* name)
+{
+    LKDBG_OS_Lock* os_lock = (LKDBG_OS_Lock*) lock->storage;
+#if defined(_WIN32)
+    InitializeSRWLock(os_lock);
+#else
+    pthread_mutex_init(os_lock, 0);
+#endif
+    lock->name = name;
+}
+
+void lkdbg_lock_free(LKDBG_Lock* lock)
+{
+#if !defined(_WIN32)
+    pthread_mutex_destroy((LKDBG_OS_Lock*) lock->storage);
+#endif
+}
+
+void lkdbg_lock(LKDBG_Lock* lock)
+{
+    LKDBG_OS_Lock* os_lock = (LKDBG_OS_Lock*) lock->storage;
+#if defined(_WIN32)
+    if (!TryAcquireSRWLockExclusive(os_lock))
+    {
+        lkdbg_lock_wait_event(lock->name, 0);
+        AcquireSRWLockExclusive(os_lock);
+    }
+#else
+    if (pthread_mutex_trylock(os_lock) != 0)
+    {
+        lkdbg_lock_wait_event(lock->name, 0);
+        pthread_mutex_lock(os_lock);
+    }
+#endif
+    lkdbg_lock_acquired_event(lock->name, 0);
+}
+
+void lkdbg_unlock(LKDBG_Lock* lock)
+{
+    lkdbg_lock_released_event(lock->name, 0);
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive((LKDBG_OS_Lock*) lock->storage);
+#else
+    pthread_mutex_unlock((LKDBG_OS_Lock*) lock->storage);
+#endif
+}
+
+void lkdbg_rw_lock_init(LKDBG_RW_Lock* lock, const char* name)
+{
+    LKDBG_OS_RW_Lock* os_lock = (LKDBG_OS_RW_Lock*) lock->storage;
+#if defined(_WIN32)
+    InitializeSRWLock(os_lock);
+#else
+    pthread_rwlock_init(os_lock, 0);
+#endif
+    lock->name = name;
+}
+
+void lkdbg_rw_lock_free(LKDBG_RW_Lock* lock)
+{
+#if !defined(_WIN32)
+    pthread_rwlock_destroy((LKDBG_OS_RW_Lock*) lock->storage);
+#endif
+}
+
+void lkdbg_read_lock(LKDBG_RW_Lock* lock)
+{
+    LKDBG_OS_RW_Lock* os_lock = (LKDBG_OS_RW_Lock*) lock->storage;
+#if defined(_WIN32)
+    if (!TryAcquireSRWLockShared(os_lock))
+    {
+        lkdbg_lock_wait_event(lock->name, 1);
+        AcquireSRWLockShared(os_lock);
+    }
+#else
+    if (pthread_rwlock_tryrdlock(os_lock) != 0)
+    {
+        lkdbg_lock_wait_event(lock->name, 1);
+        pthread_rwlock_rdlock(os_lock);
+    }
+#endif
+    lkdbg_lock_acquired_event(lock->name, 1);
+}
+
+void lkdbg_read_unlock(LKDBG_RW_Lock* lock)
+{
+    lkdbg_lock_released_event(lock->name, 1);
+#if defined(_WIN32)
+    ReleaseSRWLockShared((LKDBG_OS_RW_Lock*) lock->storage);
+#else
+    pthread_rwlock_unlock((LKDBG_OS_RW_Lock*) lock->storage);
+#endif
+}
+
+void lkdbg_write_lock(LKDBG_RW_Lock* lock)
+{
+    LKDBG_OS_RW_Lock* os_lock = (LKDBG_OS_RW_Lock*) lock->storage;
+#if defined(_WIN32)
+    if (!TryAcquireSRWLockExclusive(os_lock))
+    {
+        lkdbg_lock_wait_event(lock->name, 0);
+        AcquireSRWLockExclusive(os_lock);
+    }
+#else
+    if (pthread_rwlock_trywrlock(os_lock) != 0)
+    {
+        lkdbg_lock_wait_event(lock->name, 0);
+        pthread_rwlock_wrlock(os_lock);
+    }
+#endif
+    lkdbg_lock_acquired_event(lock->name, 0);
+}
+
+void lkdbg_write_unlock(LKDBG_RW_Lock* lock)
+{
+    lkdbg_lock_released_event(lock->name, 0);
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive((LKDBG_OS_RW_Lock*) lock->storage);
+#else
+    pthread_rwlock_unlock((LKDBG_OS_RW_Lock*) lock->storage);
+#endif
+}
+
+static int lkdbg_spin_try_lock(LKDBG_Spin_Lock* lock)
+{
+#if defined(_MSC_VER)
+    return InterlockedExchange(&lock->locked, 1) == 0;
+#else
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+#endif
+}
+
+static void lkdbg_spin_pause()
+{
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void lkdbg_spin_lock_init(LKDBG_Spin_Lock* lock, const char* name)
+{
+    lock->locked = 0;
+    lock->name = name;
+}
+
+void lkdbg_spin_lock(LKDBG_Spin_Lock* lock)
+{
+    if (!lkdbg_spin_try_lock(lock))
+    {
+        lkdbg_lock_wait_event(lock->name, 0);
+        do
+        {
+            // only try the exchange once the lock looks free, so waiters don't fight over the cache line
+            while (lock->locked)
+                lkdbg_spin_pause();
+        }
+        while (!lkdbg_spin_try_lock(lock));
+    }
+    lkdbg_lock_acquired_event(lock->name, 0);
+}
+
+void lkdbg_spin_unlock(LKDBG_Spin_Lock* lock)
+{
+    lkdbg_lock_released_event(lock->name, 0);
+#if defined(_MSC_VER)
+    InterlockedExchange(&lock->locked, 0);
+#else
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+void lkdbg_push_flow_event(const char* name, unsigned long long id, int phase)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(1);
+    if (!thread) return;
+    thread->pushed_events++;
+    if ((lkdbg_context.flags & LKDBG_STATISTICS_ONLY) == LKDBG_STATISTICS_ONLY)
+    {
+        lkdbg_end_push();
+        return;
+    }
+
+    LKDBG_Event event;
+    event.kind = LKDBG_FLOW;
+    event.flow.phase = (LK_U8) phase;
+    event.flow.thread_id = thread->thread_id;
+    event.flow.id = id;
+    event.flow.time = lkdbg_time();
+    lkdbg_push_event(thread, &event);
+
+    if (phase == LKDBG_FLOW_PHASE_BEGIN)
+    {
+        LK_U64 time = event.flow.time;
+        event.kind = LKDBG_FLOW_NAME;
+        event.flow_name.thread_id = thread->thread_id;
+        event.flow_name.name = name;
+        event.flow_name.time = time;
+        lkdbg_push_event(thread, &event);
+    }
+    lkdbg_end_push();
+}
+
+// Holds the context lock, which lkdbg_end() takes before it frees threads, but never blocks the threads being read.
+LK_U64 lkdbg_query_statistics(LKDBG_Statistics* statistics, LK_U64 max_count)
+{
+    LK_U64 frequency = lkdbg_time_frequency();
+    LK_U64 count = 0;
+
+    lkdbg_os_mutex_lock(&lkdbg_context.lock);
+    LKDBG_Thread* newest = (LKDBG_Thread*) lkdbg_context.thread_list;
+    lkdbg_os_fence_acquire();
+    for (LKDBG_Thread* thread = newest; thread; thread = thread->next)
+    {
+        if (!thread->statistics) continue;
+
+        for (LK_U64 slot = 0; slot < LKDBG_MAX_BLOCK_STATISTICS; slot++)
+        {
+            LKDBG_Block_Statistics* entry = &thread->statistics[slot];
+            if (!entry->statistics.name) continue;
+
+            LKDBG_Statistics copy;
+            while (1)
+            {
+                LK_U64 sequence = entry->sequence;
+                lkdbg_os_fence_acquire();
+                LKDBG_MEMCPY(&copy, (const void*) &entry->statistics, sizeof(copy));
+                lkdbg_os_fence_acquire();
+                if (!(sequence & 1) && sequence == entry->sequence) break;
+            }
+            if (!copy.count) continue;
+
+            // few distinct names, so a linear search is fine
+            LK_U64 j;
+            for (j = 0; j < count; j++)
+                if (statistics[j].name == copy.name)
+                    break;
+
+            if (j == count)
+            {
+                if (count == max_count) continue;
+                count++;
+                statistics[j] = copy;
+                statistics[j].time_frequency = frequency;
+                continue;
+            }
+
+            LKDBG_Statistics* merged = &statistics[j];
+            merged->inclusive_time += copy.inclusive_time;
+            merged->exclusive_time += copy.exclusive_time;
+            if (copy.min_time < merged->min_time) merged->min_time = copy.min_time;
+            if (copy.max_time > merged->max_time) merged->max_time = copy.max_time;
+            for (LK_U64 k = 0; k < LKDBG_HISTOGRAM_BUCKETS; k++)
+                merged->histogram[k] += copy.histogram[k];
+
+            if (copy.min_value < merged->min_value) merged->min_value = copy.min_value;
+            if (copy.max_value > merged->max_value) merged->max_value = copy.max_value;
+            merged->sum_value += copy.sum_value;
+            if (copy.last_time > merged->last_time)
+            {
+                merged->last_value = copy.last_value;
+                merged->last_time = copy.last_time;
+            }
+            merged->count += copy.count;
+        }
+    }
+    lkdbg_os_mutex_unlock(&lkdbg_context.lock);
+
+    for (LK_U64 i = 0; i < count; i++)
+    {
+        LKDBG_Statistics* s = &statistics[i];
+        s->inclusive_time = s->inclusive_time / frequency * 1000000000ull + s->inclusive_time % frequency * 1000000000ull / frequency;
+        s->exclusive_time = s->exclusive_time / frequency * 1000000000ull + s->exclusive_time % frequency * 1000000000ull / frequency;
+        s->min_time       = s->min_time       / frequency * 1000000000ull + s->min_time       % frequency * 1000000000ull / frequency;
+        s->max_time       = s->max_time       / frequency * 1000000000ull + s->max_time       % frequency * 1000000000ull / frequency;
+    }
+
+    return count;
+}
+
+LK_U64 lkdbg_statistics_percentile(const LKDBG_Statistics* statistics, double percentile)
+{
+    if (!statistics->count) return 0;
+
+    double target = percentile * (double) statistics->count;
+    LK_U64 seen = 0;
+    LK_U64 bucket;
+    for (bucket = 0; bucket < LKDBG_HISTOGRAM_BUCKETS - 1; bucket++)
+    {
+        if ((double)(seen + statistics->histogram[bucket]) >= target) break;
+        seen += statistics->histogram[bucket];
+    }
+
+    // interpolate linearly within the bucket
+    double start = (double) lkdbg_histogram_bucket_start(bucket);
+    double end = (double) lkdbg_histogram_bucket_start(bucket + 1);
+    double fraction = statistics->histogram[bucket] ? (target - (double) seen) / (double) statistics->histogram[bucket] : 0;
+    if (fraction < 0) fraction = 0;
+    double ticks = start + (end - start) * fraction;
+
+    LK_U64 nanoseconds = (LK_U64)(ticks * 1000000000.0 / (double) statistics->time_frequency);
+    if (nanoseconds < statistics->min_time) nanoseconds = statistics->min_time;
+    if (nanoseconds > statistics->max_time) nanoseconds = statistics->max_time;
+    return nanoseconds;
+}
+
+static void lkdbg_context_switches_start();
+static void lkdbg_context_switches_end();
+
+void lkdbg_set_sample_rate(int samples_per_second)
+{
+    lkdbg_context.sample_rate = samples_per_second;
+}
+
+void lkdbg_set_flight_recorder_size(int events_per_thread)
+{
+    lkdbg_context.flight_recorder_size = events_per_thread;
+}
+
+// Long enough to get past the first few slow pushes, short enough not to hold up lkdbg_start().
+#define LKDBG_CALIBRATION_EVENTS 2000
+#define LKDBG_CALIBRATION_ROUNDS 8
+
+// Times the part of a push that every kind of event has, with the flags we were started with: finding
+// the thread, reading the clock and recording the event. That's a mark on a thread without statistics or
+// counters. The bookkeeping a push does for its own kind (a block's statistics, open block stack and
+// counter reads, a counter's statistics) isn't in it, because it differs between kinds and would be
+// taken out of every other kind too. The thread is our own and is thrown away after, so nothing shows
+// up in the profile or the statistics. The fastest round is the one least disturbed.
+static void lkdbg_calibrate_overhead()
+{
+    static const char name[] = "lk_debug calibration";
+    LKDBG_Thread* previous = lkdbg_thread;
+    LK_U32 previous_generation = lkdbg_thread_generation;
+    LKDBG_Thread* thread = lkdbg_make_thread(name);
+    thread->pushing = lkdbg_get_thread_pushing();
+    lkdbg_thread = thread;
+    lkdbg_thread_generation = lkdbg_context.generation;
+
+    LKDBG_Block_Statistics* statistics = thread->statistics;
+    thread->statistics = 0;
+
+    LK_U64 best = (LK_U64) -1;
+    for (int round = 0; round < LKDBG_CALIBRATION_ROUNDS; round++)
+    {
+        thread->event_count = 0;
+
+        LK_U64 start = lkdbg_time();
+        for (int i = 0; i < LKDBG_CALIBRATION_EVENTS; i++)
+        {
+            lkdbg_push_mark_event(name);
+        }
+        LK_U64 elapsed = lkdbg_time() - start;
+        if (elapsed < best) best = elapsed;
+    }
+
+    lkdbg_context.event_overhead = (LK_F64) best / LKDBG_CALIBRATION_EVENTS;
+
+    thread->statistics = statistics;
+    lkdbg_thread = previous;
+    lkdbg_thread_generation = previous_generation;
+    lkdbg_free_thread(thread);
+}
+
+double lkdbg_get_event_overhead(void)
+{
+    return lkdbg_context.event_overhead * 1000000000.0 / (double) lkdbg_time_frequency();
+}
+
+unsigned long long lkdbg_get_time(void)
+{
+    return lkdbg_time();
+}
+
+unsigned long long lkdbg_get_time_frequency(void)
+{
+    return lkdbg_time_frequency();
+}
+
+unsigned int lkdbg_read_perf_counters(unsigned long long* values)
+{
+    LKDBG_Thread* thread = lkdbg_begin_push(0);
+    if (!thread) return 0;
+
+    LK_U32 mask = thread->perf_counter_mask;
+    if (mask)
+    {
+        LK_U64 read[LKDBG_PERF_COUNTER_COUNT];
+        lkdbg_perf_counters_read(thread, read);
+        for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+            values[i] = read[i];
+    }
+    lkdbg_end_push();
+    return mask;
+}
+
+void lkdbg_start(int flags)
+{
+    lkdbg_os_mutex_make(&lkdbg_context.lock);
+    lkdbg_context.flags = flags;
+    lkdbg_context.generation++;
+    lkdbg_context.running = 1;
+    lkdbg_clock_start();
+    if (lkdbg_context.flight_recorder_size <= 0)
+    {
+        lkdbg_context.flight_recorder_size = 65536;
+    }
+
+#if defined(_WIN32)
+    lkdbg_context.etw_consumer_handle = INVALID_PROCESSTRACE_HANDLE;
+#endif
+
+    if (flags & LKDBG_CAPTURE_CONTEXT_SWITCHES)
+    {
+        lkdbg_context_switches_start();
+    }
+
+    if (flags & LKDBG_CAPTURE_SAMPLES)
+    {
+        lkdbg_sampling_start();
+    }
+
+    lkdbg_calibrate_overhead();
+}
+
+// Strings are deduplicated through a small direct-mapped cache of pointers.
+// That catches almost all duplicates cheaply; the ones it misses are removed after sorting.
+#define LKDBG_STRING_CACHE_SIZE 1024
+
+static int lkdbg_check_file_string_cache(const void* ptr, const void** cache)
+{
+    LK_U64 slot = (((LK_U64)(uintptr_t) ptr) >> 3) & (LKDBG_STRING_CACHE_SIZE - 1);
+    if (cache[slot] == ptr) return 1;
+    cache[slot] = ptr;
+    return 0;
+}
+
+static void lkdbg_add_file_string_for(const void* ptr, const char* str, LKDBG_File_String** strings, LK_U64* count, LK_U64* capacity)
+{
+    LKDBG_File_String string;
+    string.ptr = ptr;
+
+    int i = 0;
+    while (str[i] && i < (int)(sizeof(string.string) - 1))
+    {
+        string.string[i] = str[i];
+        i++;
+    }
+    while (i < (int) sizeof(string.string))
+    {
+        string.string[i++] = 0;
+    }
+
+    lkdbg_array_push((void**) strings, count, capacity, &string, sizeof(LKDBG_File_String));
+}
+
+static void lkdbg_add_file_string(const char* str, const void** cache, LKDBG_File_String** strings, LK_U64* count, LK_U64* capacity)
+{
+    if (!str) return;
+    if (lkdbg_check_file_string_cache(str, cache)) return;
+    lkdbg_add_file_string_for(str, str, strings, count, capacity);
+}
+
+static void lkdbg_add_file_symbol(LK_U64 address, const void** cache, LKDBG_File_String** strings, LK_U64* count, LK_U64* capacity)
+{
+    const void* ptr = (const void*)(uintptr_t) address;
+    if (lkdbg_check_file_string_cache(ptr, cache)) return;
+
+    char name[sizeof(((LKDBG_File_String*) 0)->string)];
+    lkdbg_os_symbol_name(address, name, sizeof(name));
+    lkdbg_add_file_string_for(ptr, name, strings, count, capacity);
+}
+
+static void lkdbg_add_event_string(const LKDBG_Event* event, const void** cache, LKDBG_File_String** strings, LK_U64* count, LK_U64* capacity)
+{
+    switch (event->kind)
+    {
+    case LKDBG_BLOCK:           lkdbg_add_file_string(event->block.name, cache, strings, count, capacity);           break;
+    case LKDBG_COUNTER:         lkdbg_add_file_string(event->counter.name, cache, strings, count, capacity);         break;
+    case LKDBG_MARK:            lkdbg_add_file_string(event->mark.name, cache, strings, count, capacity);            break;
+    case LKDBG_FLOW_NAME:       lkdbg_add_file_string(event->flow_name.name, cache, strings, count, capacity);       break;
+    case LKDBG_ALLOCATION_SITE: lkdbg_add_file_string(event->allocation_site.name, cache, strings, count, capacity); break;
+    case LKDBG_LOCK:            lkdbg_add_file_string(event->lock.name, cache, strings, count, capacity);            break;
+    case LKDBG_SAMPLE:          lkdbg_add_file_symbol(event->sample.address, cache, strings, count, capacity);       break;
+    default: break;
+    }
+}
+
+static int lkdbg_compare_file_strings(const void* a, const void* b)
+{
+    uintptr_t pa = (uintptr_t)((const LKDBG_File_String*) a)->ptr;
+    uintptr_t pb = (uintptr_t)((const LKDBG_File_String*) b)->ptr;
+    return (pa > pb) - (pa < pb);
+}
+
+// Events from a single thread are almost always pushed in order, but ETW and perf deliver
+// their buffers per processor, and samples are moved in from their own buffer in batches,
+// so this needs a sort. It's stable, so the frames of a sample (which share a time) stay together.
+static void lkdbg_sort_events(LKDBG_Event* events, LK_U64 count)
+{
+    LK_U64 i;
+    for (i = 1; i < count; i++)
+        if (lkdbg_get_event_time(&events[i - 1]) > lkdbg_get_event_time(&events[i]))
+            break;
+    if (i >= count) return;
+
+    LKDBG_Event* temp = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * count);
+    LKDBG_Event* from = events;
+    LKDBG_Event* to = temp;
+
+    for (LK_U64 width = 1; width < count; width *= 2)
+    {
+        for (LK_U64 left = 0; left < count; left += 2 * width)
+        {
+            LK_U64 middle = left + width;
+            LK_U64 right = middle + width;
+            if (middle > count) middle = count;
+            if (right > count) right = count;
+
+            LK_U64 a = left;
+            LK_U64 b = middle;
+            LK_U64 o = left;
+            while (a < middle && b < right)
+            {
+                if (lkdbg_get_event_time(&from[b]) < lkdbg_get_event_time(&from[a]))
+                    to[o++] = from[b++];
+                else
+                    to[o++] = from[a++];
+            }
+            while (a < middle) to[o++] = from[a++];
+            while (b < right)  to[o++] = from[b++];
+        }
+
+        LKDBG_Event* swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != events)
+    {
+        LKDBG_MEMCPY(events, from, sizeof(LKDBG_Event) * count);
+    }
+
+    LKDBG_FREE(temp);
+}
+
+typedef struct
+{
+    LKDBG_Thread* thread;
+    LKDBG_Event* events;
+    LK_U64 event_count;
+} LKDBG_Thread_Events;
+
+static void lkdbg_write_profile(const char* profile_path, LKDBG_Thread_Events* threads, LK_U64 thread_count)
+{
+    LKDBG_File_String* strings = 0;
+    LK_U64 string_count = 0;
+    LK_U64 string_capacity = 0;
+
+    const void* string_cache[LKDBG_STRING_CACHE_SIZE] = { 0 };
+
+    LK_U64 total_event_count = 0;
+    LK_U64 total_index_count = 0;
+    for (LK_U64 i = 0; i < thread_count; i++)
+    {
+        LKDBG_Thread_Events* thread = &threads[i];
+        lkdbg_sort_events(thread->events, thread->event_count);
+
+        lkdbg_add_file_string(thread->thread->name, string_cache, &strings, &string_count, &string_capacity);
+        for (LK_U64 j = 0; j < thread->event_count; j++)
+            lkdbg_add_event_string(&thread->events[j], string_cache, &strings, &string_count, &string_capacity);
+
+        total_event_count += thread->event_count;
+        total_index_count += (thread->event_count + LKDBG_INDEX_STRIDE - 1) / LKDBG_INDEX_STRIDE;
+    }
+
+    if (string_count)
+    {
+        qsort(strings, string_count, sizeof(LKDBG_File_String), lkdbg_compare_file_strings);
+
+        LK_U64 unique_count = 1;
+        for (LK_U64 i = 1; i < string_count; i++)
+            if (strings[i].ptr != strings[unique_count - 1].ptr)
+                strings[unique_count++] = strings[i];
+        string_count = unique_count;
+    }
+
+    FILE* out = fopen(profile_path, "wb");
+    if (out)
+    {
+        LKDBG_File_Header header;
+        header.magic = LKDBG_FILE_MAGIC;
+        header.version = LKDBG_FILE_VERSION;
+        header.time_frequency = lkdbg_time_frequency();
+        header.string_count = string_count;
+        header.thread_count = thread_count;
+        header.event_count = total_event_count;
+        header.index_stride = LKDBG_INDEX_STRIDE;
+        header.index_count = total_index_count;
+        header.event_overhead = lkdbg_context.event_overhead;
+        fwrite(&header, sizeof(header), 1, out);
+
+        fwrite(strings, sizeof(LKDBG_File_String), string_count, out);
+
+        LK_U64 first_event = 0;
+        LK_U64 first_index = 0;
+        for (LK_U64 i = 0; i < thread_count; i++)
+        {
+            LKDBG_Thread_Events* thread = &threads[i];
+
+            LKDBG_File_Thread thread_data;
+            memset(&thread_data, 0, sizeof(thread_data));
+            thread_data.thread_id = thread->thread->thread_id;
+            thread_data.name = thread->thread->name;
+            thread_data.first_event = first_event;
+            thread_data.event_count = thread->event_count;
+            thread_data.first_index = first_index;
+            thread_data.index_count = (thread->event_count + LKDBG_INDEX_STRIDE - 1) / LKDBG_INDEX_STRIDE;
+            fwrite(&thread_data, sizeof(thread_data), 1, out);
+
+            first_event += thread_data.event_count;
+            first_index += thread_data.index_count;
+        }
+
+        for (LK_U64 i = 0; i < thread_count; i++)
+        {
+            LKDBG_Thread_Events* thread = &threads[i];
+            fwrite(thread->events, sizeof(LKDBG_Event), thread->event_count, out);
+        }
+
+        for (LK_U64 i = 0; i < thread_count; i++)
+        {
+            LKDBG_Thread_Events* thread = &threads[i];
+            for (LK_U64 j = 0; j < thread->event_count; j += LKDBG_INDEX_STRIDE)
+            {
+                LK_U64 time = lkdbg_get_event_time(&thread->events[j]);
+                fwrite(&time, sizeof(time), 1, out);
+            }
+        }
+
+        fclose(out);
+    }
+    else
+    {
+        printf("Failed to open profile file %s for writing\n", profile_path);
+    }
+
+    if (strings)
+    {
+        LKDBG_FREE(strings);
+    }
+}
+
+// Copies the events of the flight recorder ring that are at or after 'since' into a new allocation.
+// The owning thread keeps pushing while we copy, so anything it might have overwritten in the meantime is dropped.
+static void lkdbg_copy_ring(LKDBG_Thread* thread, LK_U64 since, LKDBG_Thread_Events* result)
+{
+    LK_U64 capacity = thread->event_capacity;
+    LK_U64 head = thread->ring_head;
+    lkdbg_os_fence_acquire();
+
+    LK_U64 first = head > capacity ? head - capacity : 0;
+    LKDBG_Event* events = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * (head - first + 1));
+    for (LK_U64 i = first; i < head; i++)
+        events[i - first] = thread->events[i & (capacity - 1)];
+
+    lkdbg_os_fence_acquire();
+    LK_U64 new_head = thread->ring_head;
+
+    // the event at 'new_head' may be half written over the one 'capacity' before it
+    LK_U64 valid = new_head + 1 > capacity ? new_head + 1 - capacity : 0;
+    LK_U64 skip = valid > first ? valid - first : 0;
+    LK_U64 count = head - first;
+    if (skip > count) skip = count;
+
+    count -= skip;
+    memmove(events, events + skip, sizeof(LKDBG_Event) * count);
+    lkdbg_sort_events(events, count);
+
+    LK_U64 cut = 0;
+    while (cut < count && lkdbg_get_event_time(&events[cut]) < since)
+        cut++;
+    count -= cut;
+    memmove(events, events + cut, sizeof(LKDBG_Event) * count);
+
+    result->thread = thread;
+    result->events = events;
+    result->event_count = count;
+}
+
+static void lkdbg_write_snapshot(const char* profile_path, double seconds)
+{
+    LK_U64 since = 0;
+    if (seconds > 0)
+    {
+        LK_U64 now = lkdbg_time();
+        LK_U64 window = (LK_U64)(seconds * (double) lkdbg_time_frequency());
+        since = now > window ? now - window : 0;
+    }
+
+    LK_U64 thread_count;
+    LKDBG_Thread** registered = lkdbg_collect_threads(&thread_count);
+    LKDBG_Thread_Events* threads = (LKDBG_Thread_Events*) LKDBG_MALLOC(sizeof(LKDBG_Thread_Events) * (thread_count + 1));
+    for (LK_U64 i = 0; i < thread_count; i++)
+        lkdbg_copy_ring(registered[i], since, &threads[i]);
+
+    lkdbg_write_profile(profile_path, threads, thread_count);
+
+    for (LK_U64 i = 0; i < thread_count; i++)
+        LKDBG_FREE(threads[i].events);
+    LKDBG_FREE(threads);
+    LKDBG_FREE(registered);
+}
+
+void lkdbg_snapshot(const char* profile_path, double seconds)
+{
+    LKDBG_ASSERT(lkdbg_context.flags & LKDBG_FLIGHT_RECORDER, "snapshots need LKDBG_FLIGHT_RECORDER");
+
+    lkdbg_os_mutex_lock(&lkdbg_context.lock);
+    lkdbg_write_snapshot(profile_path, seconds);
+    lkdbg_os_mutex_unlock(&lkdbg_context.lock);
+}
+
+static char lkdbg_crash_snapshot_path[1024];
+static double lkdbg_crash_snapshot_seconds;
+
+// Called from the crash handlers. Doesn't take the context lock, the crashing thread might be holding it.
+static void lkdbg_crash_snapshot()
+{
+    static int already_crashed;
+    if (already_crashed) return;
+    already_crashed = 1;
+
+    printf("Crashed, writing the flight recorder to %s\n", lkdbg_crash_snapshot_path);
+    lkdbg_write_snapshot(lkdbg_crash_snapshot_path, lkdbg_crash_snapshot_seconds);
+}
+
+static void lkdbg_os_install_crash_handler();
+static void lkdbg_stream_end();
+
+void lkdbg_snapshot_on_crash(const char* profile_path, double seconds)
+{
+    LKDBG_ASSERT(lkdbg_context.flags & LKDBG_FLIGHT_RECORDER, "snapshots need LKDBG_FLIGHT_RECORDER");
+
+    snprintf(lkdbg_crash_snapshot_path, sizeof(lkdbg_crash_snapshot_path), "%s", profile_path);
+    lkdbg_crash_snapshot_seconds = seconds;
+    lkdbg_os_install_crash_handler();
+}
+
+void lkdbg_end(const char* profile_path)
+{
+    // no new threads join, and the ones joining right now finish first, so they're all in the list below
+    lkdbg_context.running = 0;
+    lkdbg_os_fence_full();
+    while (lkdbg_context.registering)
+        lkdbg_os_yield();
+
+    // every thread's lkdbg_thread is stale from here on, so new pushes drop their events, see lkdbg_begin_push()
+    lkdbg_context.generation++;
+    lkdbg_os_fence_full();
+
+    lkdbg_context_switches_end();
+    lkdbg_sampling_end();
+
+    // queries and snapshots hold the lock while they read threads, so they're done before anything is freed
+    lkdbg_os_mutex_lock(&lkdbg_context.lock);
+
+    // pushes that checked the generation before it changed are still writing to their thread
+    LK_U64 thread_count;
+    LKDBG_Thread** registered = lkdbg_collect_threads(&thread_count);
+    for (LK_U64 i = 0; i < thread_count; i++)
+    {
+        while (*registered[i]->pushing)
+            lkdbg_os_yield();
+    }
+    lkdbg_os_fence_acquire();
+
+    // the threads are quiet now, so their samples and event lists are ours
+    for (LK_U64 i = 0; i < thread_count; i++)
+    {
+        lkdbg_sampling_drain(registered[i], 1);
+    }
+
+    lkdbg_stream_end();
+
+    if (profile_path)
+    {
+        if (lkdbg_context.flags & LKDBG_FLIGHT_RECORDER)
+        {
+            lkdbg_write_snapshot(profile_path, 0);
+        }
+        else
+        {
+            LKDBG_Thread_Events* threads = (LKDBG_Thread_Events*) LKDBG_MALLOC(sizeof(LKDBG_Thread_Events) * (thread_count + 1));
+            for (LK_U64 i = 0; i < thread_count; i++)
+            {
+                threads[i].thread = registered[i];
+                threads[i].events = registered[i]->events;
+                threads[i].event_count = registered[i]->event_count;
+            }
+
+            lkdbg_write_profile(profile_path, threads, thread_count);
+            LKDBG_FREE(threads);
+        }
+    }
+
+    for (LK_U64 i = 0; i < thread_count; i++)
+    {
+        lkdbg_free_thread(registered[i]);
+    }
+    LKDBG_FREE(registered);
+
+    lkdbg_context.thread_list = 0;
+    lkdbg_context.thread_count = 0;
+    lkdbg_thread = 0;
+
+    lkdbg_os_mutex_unlock(&lkdbg_context.lock);
+    lkdbg_os_mutex_free(&lkdbg_context.lock);
+}
+
+#if defined(_WIN32)
+
+////////////////////////////////////////////////////////////////////////////////
+// Context switches through ETW
+
+static void lkdbg_etw_print_error(const char* what, LK_U32 error_code)
+{
+    printf("%s %u", what, error_code);
+    switch (error_code)
+    {
+    case ERROR_ACCESS_DENIED:          printf(" (ERROR_ACCESS_DENIED)");          break;
+    case ERROR_ALREADY_EXISTS:         printf(" (ERROR_ALREADY_EXISTS)");         break;
+    case ERROR_BAD_LENGTH:             printf(" (ERROR_BAD_LENGTH)");             break;
+    case ERROR_BAD_PATHNAME:           printf(" (ERROR_BAD_PATHNAME)");           break;
+    case ERROR_CANCELLED:              printf(" (ERROR_CANCELLED)");              break;
+    case ERROR_DISK_FULL:              printf(" (ERROR_DISK_FULL)");              break;
+    case ERROR_INVALID_HANDLE:         printf(" (ERROR_INVALID_HANDLE)");         break;
+    case ERROR_INVALID_PARAMETER:      printf(" (ERROR_INVALID_PARAMETER)");      break;
+    case ERROR_INVALID_TIME:           printf(" (ERROR_INVALID_TIME)");           break;
+    case ERROR_MORE_DATA:              printf(" (ERROR_MORE_DATA)");              break;
+    case ERROR_NO_SYSTEM_RESOURCES:    printf(" (ERROR_NO_SYSTEM_RESOURCES)");    break;
+    case ERROR_NOACCESS:               printf(" (ERROR_NOACCESS)");               break;
+    case ERROR_WMI_ALREADY_ENABLED:    printf(" (ERROR_WMI_ALREADY_ENABLED)");    break;
+    case ERROR_WMI_INSTANCE_NOT_FOUND: printf(" (ERROR_WMI_INSTANCE_NOT_FOUND)"); break;
+    }
+    printf("\n");
+}
+
+
+static void WINAPI lkdbg_etw_callback(PEVENT_RECORD event)
+{
+    static GUID ThreadGuid = { 0x3d6fa8d1, 0xfe05, 0x11d0, { 0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c } };
+
+    typedef struct
+    {
+        LK_U32 NewThreadId;
+        LK_U32 OldThreadId;
+        LK_S8  NewThreadPriority;
+        LK_S8  OldThreadPriority;
+        LK_U8  PreviousCState;
+        LK_S8  SpareByte;
+        LK_S8  OldThreadWaitReason;
+        LK_S8  OldThreadWaitMode;
+        LK_S8  OldThreadState;
+        LK_S8  OldThreadWaitIdealProcessor;
+        LK_U32 NewThreadWaitTime;
+        LK_U32 Reserved;
+    } CSwitch;
+
+    if (((LK_U64*) &event->EventHeader.ProviderId)[0] != ((LK_U64*) &ThreadGuid)[0]) return;
+    if (((LK_U64*) &event->EventHeader.ProviderId)[1] != ((LK_U64*) &ThreadGuid)[1]) return;
+    if (event->EventHeader.EventDescriptor.Opcode != 36) return;
+    if (event->UserDataLength != sizeof(CSwitch)) return;
+
+    CSwitch* cswitch = (CSwitch*) event->UserData;
+    LK_U32 thread_id = cswitch->NewThreadId;
+
+    LKDBG_Event debug_event;
+    debug_event.kind = LKDBG_CONTEXT_SWITCH;
+    debug_event.context_switch.processor = event->BufferContext.ProcessorNumber;
+    debug_event.context_switch.thread_id = thread_id;
+    debug_event.context_switch.time = event->EventHeader.TimeStamp.QuadPart;
+
+    lkdbg_push_event(lkdbg_thread, &debug_event); // ProcessTrace calls us on the ETW processing thread
+}
+
+static DWORD WINAPI lkdbg_etw_processing_thread(LPVOID userdata)
+{
+    lkdbg_register_thread("ETW processing thread");
+
+    TRACEHANDLE consumer_handle = (TRACEHANDLE) userdata;
+    ULONG status = ProcessTrace(&consumer_handle, 1, 0, 0);
+    if (status != ERROR_SUCCESS)
+    {
+        lkdbg_etw_print_error("ProcessTrace failure", status);
+    }
+
+    return 0;
+}
+
+static void lkdbg_etw_start()
+{
+    ULONG status;
+    ULONG buffer_size = sizeof(EVENT_TRACE_PROPERTIES) + sizeof(KERNEL_LOGGER_NAME);
+    EVENT_TRACE_PROPERTIES* session_properties = (EVENT_TRACE_PROPERTIES*) LKDBG_MALLOC(buffer_size);
+
+    // ControlTrace
+
+    ZeroMemory(session_properties, sizeof(EVENT_TRACE_PROPERTIES));
+    session_properties->Wnode.BufferSize = buffer_size;
+    session_properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    session_properties->Wnode.ClientContext = lkdbg_context.use_tsc ? 3 : 1; // magic constants, timestamps should be rdtsc or QueryPerformanceCounter, like ours
+    session_properties->Wnode.Guid = SystemTraceControlGuid;
+    session_properties->EnableFlags = EVENT_TRACE_FLAG_CSWITCH;
+    session_properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+    session_properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    LKDBG_MEMCPY((LPSTR)(session_properties + 1), KERNEL_LOGGER_NAME, sizeof(KERNEL_LOGGER_NAME));
+
+    status = ControlTrace(0, KERNEL_LOGGER_NAME, session_properties, EVENT_TRACE_CONTROL_STOP);
+    if (status != ERROR_SUCCESS && status != ERROR_WMI_INSTANCE_NOT_FOUND)
+    {
+        lkdbg_etw_print_error("ControlTrace failure", status);
+        return;
+    }
+
+    // StartTrace
+
+    // set this struct again, because ControlTrace seems to do something to it that StartTrace doesn't like
+    ZeroMemory(session_properties, sizeof(EVENT_TRACE_PROPERTIES));
+    session_properties->Wnode.BufferSize = buffer_size;
+    session_properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    session_properties->Wnode.ClientContext = lkdbg_context.use_tsc ? 3 : 1; // magic constants, timestamps should be rdtsc or QueryPerformanceCounter, like ours
+    session_properties->Wnode.Guid = SystemTraceControlGuid;
+    session_properties->EnableFlags = EVENT_TRACE_FLAG_CSWITCH;
+    session_properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+    session_properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    LKDBG_MEMCPY((LPSTR)(session_properties + 1), KERNEL_LOGGER_NAME, sizeof(KERNEL_LOGGER_NAME));
+
+    TRACEHANDLE session_handle;
+    status = StartTrace(&session_handle, KERNEL_LOGGER_NAME, session_properties);
+    if (status != ERROR_SUCCESS)
+    {
+        printf("StartTrace failure %d", status);
+        lkdbg_etw_print_error("StartTrace failure", status);
+        return;
+    }
+
+    // OpenTrace
+
+    EVENT_TRACE_LOGFILE log_file = {0};
+    log_file.LoggerName = KERNEL_LOGGER_NAME;
+    log_file.ProcessTraceMode = (PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD | PROCESS_TRACE_MODE_RAW_TIMESTAMP);
+    log_file.EventRecordCallback = lkdbg_etw_callback;
+
+    TRACEHANDLE consumer_handle = OpenTrace(&log_file);
+    if (consumer_handle == INVALID_PROCESSTRACE_HANDLE)
+    {
+        lkdbg_etw_print_error("OpenTrace failure", GetLastError());
+        return;
+    }
+
+    // processing thread
+
+    lkdbg_context.etw_thread = CreateThread(0, 0, lkdbg_etw_processing_thread, (LPVOID) consumer_handle, 0, 0);
+    lkdbg_context.etw_consumer_handle = consumer_handle;
+}
+
+static void lkdbg_etw_end()
+{
+    if (lkdbg_context.etw_consumer_handle)
+    {
+        CloseTrace(lkdbg_context.etw_consumer_handle);
+
+        printf("Waiting for ETW processing thread...\n");
+        WaitForSingleObject(lkdbg_context.etw_thread, INFINITE);
+    }
+}
+
+static void lkdbg_context_switches_start()
+{
+    lkdbg_etw_start();
+}
+
+static void lkdbg_context_switches_end()
+{
+    if (lkdbg_context.etw_consumer_handle != INVALID_PROCESSTRACE_HANDLE)
+    {
+        lkdbg_etw_end();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-block performance counters
+
+// Windows doesn't let user mode programs at the PMU without a driver, so all we have is cycles.
+
+static void lkdbg_perf_counters_open(LKDBG_Thread* thread)
+{
+    thread->perf_counter_mask = 1u << LKDBG_PERF_CYCLES;
+}
+
+static void lkdbg_perf_counters_close(LKDBG_Thread* thread)
+{
+    thread->perf_counter_mask = 0;
+}
+
+static void lkdbg_perf_counters_read(LKDBG_Thread* thread, LK_U64* values)
+{
+    ULONG64 cycles;
+    QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    values[LKDBG_PERF_CYCLES] = cycles;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sampling
+
+static void lkdbg_sampling_start()
+{
+    printf("lk_debug sampling isn't supported on Windows yet, no samples will be recorded\n");
+}
+
+static void lkdbg_sampling_end() {}
+static void lkdbg_sampling_register_thread(LKDBG_Thread* thread) {}
+static void lkdbg_sampling_drain(LKDBG_Thread* thread, int force) {}
+
+////////////////////////////////////////////////////////////////////////////////
+// Live streaming
+
+int lkdbg_stream(const char* socket_path)
+{
+    printf("lk_debug streaming isn't supported on Windows yet\n");
+    return 0;
+}
+
+static void lkdbg_stream_end() {}
+
+////////////////////////////////////////////////////////////////////////////////
+// Crash handler
+
+static LPTOP_LEVEL_EXCEPTION_FILTER lkdbg_previous_exception_filter;
+
+static LONG WINAPI lkdbg_exception_filter(EXCEPTION_POINTERS* exception)
+{
+    lkdbg_crash_snapshot();
+    if (lkdbg_previous_exception_filter)
+        return lkdbg_previous_exception_filter(exception);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void lkdbg_os_install_crash_handler()
+{
+    lkdbg_previous_exception_filter = SetUnhandledExceptionFilter(lkdbg_exception_filter);
+}
+
+#elif defined(__linux__)
+
+////////////////////////////////////////////////////////////////////////////////
+// Context switches through perf_event_open
+
+// The sched:sched_switch tracepoint is opened on every processor first. Like ETW, that sees every
+// thread in the system, but it needs tracefs and CAP_PERFMON (or perf_event_paranoid <= -1).
+// If that fails, we fall back to PERF_RECORD_SWITCH records for this process only, which work
+// unprivileged, but only follow the main thread and threads created after lkdbg_start().
+// In that mode, a thread switching out is recorded as a switch to thread 0.
+//
+// Either way, records are timestamped with CLOCK_MONOTONIC, the same clock as lkdbg_os_time(),
+// and a collector thread drains the per-processor ring buffers into its own event list.
+// If block events use the TSC, the timestamps are converted as they're drained.
+
+#ifndef LKDBG_PERF_BUFFER_PAGES
+#define LKDBG_PERF_BUFFER_PAGES 64 // must be a power of two
+#endif
+
+static long lkdbg_perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int lkdbg_perf_find_sched_switch(LK_U64* id, int* next_pid_offset)
+{
+    const char* roots[] = { "/sys/kernel/tracing", "/sys/kernel/debug/tracing" };
+    for (int i = 0; i < 2; i++)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/events/sched/sched_switch/id", roots[i]);
+        FILE* in = fopen(path, "r");
+        if (!in) continue;
+
+        unsigned long long value;
+        int success = fscanf(in, "%llu", &value) == 1;
+        fclose(in);
+        if (!success) continue;
+
+        // the layout of the raw record differs between kernel versions, so look it up
+        snprintf(path, sizeof(path), "%s/events/sched/sched_switch/format", roots[i]);
+        in = fopen(path, "r");
+        if (!in) continue;
+
+        int offset = -1;
+        char line[256];
+        while (fgets(line, sizeof(line), in))
+        {
+            if (!strstr(line, " next_pid;")) continue;
+
+            const char* at = strstr(line, "offset:");
+            if (at) offset = atoi(at + 7);
+            break;
+        }
+        fclose(in);
+        if (offset < 0) continue;
+
+        *id = value;
+        *next_pid_offset = offset;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void lkdbg_perf_close_all()
+{
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+    {
+        if (lkdbg_context.perf_buffers[cpu])
+            munmap(lkdbg_context.perf_buffers[cpu], lkdbg_context.perf_buffer_size);
+        if (lkdbg_context.perf_fds[cpu] >= 0)
+            close(lkdbg_context.perf_fds[cpu]);
+
+        lkdbg_context.perf_buffers[cpu] = 0;
+        lkdbg_context.perf_fds[cpu] = -1;
+    }
+}
+
+static int lkdbg_perf_open_all(struct perf_event_attr* attr, pid_t pid)
+{
+    int opened = 0;
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+    {
+        lkdbg_context.perf_fds[cpu] = -1;
+        lkdbg_context.perf_buffers[cpu] = 0;
+    }
+
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+    {
+        int fd = (int) lkdbg_perf_event_open(attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENODEV) continue; // offline processor
+            lkdbg_perf_close_all();
+            return 0;
+        }
+
+        void* buffer = mmap(0, lkdbg_context.perf_buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (buffer == MAP_FAILED)
+        {
+            close(fd);
+            lkdbg_perf_close_all();
+            return 0;
+        }
+
+        lkdbg_context.perf_fds[cpu] = fd;
+        lkdbg_context.perf_buffers[cpu] = buffer;
+        opened++;
+    }
+
+    return opened > 0;
+}
+
+// Converts a CLOCK_MONOTONIC timestamp to our clock. The collector takes a fresh anchor before each drain,
+// and records are at most a few milliseconds older than it, so errors in the frequency barely matter.
+static LK_U64 lkdbg_perf_time(LK_U64 time)
+{
+    if (!lkdbg_context.use_tsc) return time;
+
+    LKDBG_Clock_Pair anchor = lkdbg_context.perf_anchor;
+    LK_F64 offset = (LK_F64)(LK_S64)(time - anchor.os_time) * lkdbg_context.perf_tsc_per_tick;
+    return anchor.tsc + (LK_U64)(LK_S64) offset;
+}
+
+static void lkdbg_perf_update_anchor()
+{
+    if (!lkdbg_context.use_tsc) return;
+    lkdbg_context.perf_anchor = lkdbg_read_clock_pair();
+    lkdbg_context.perf_tsc_per_tick = lkdbg_tsc_per_os_tick(lkdbg_context.perf_anchor);
+}
+
+static void lkdbg_perf_push_context_switch(LK_U32 cpu, LK_U32 thread_id, LK_U64 time)
+{
+    LKDBG_Event event;
+    event.kind = LKDBG_CONTEXT_SWITCH;
+    event.context_switch.processor = (LK_U8) cpu;
+    event.context_switch.thread_id = thread_id;
+    event.context_switch.time = lkdbg_perf_time(time);
+
+    lkdbg_push_event(lkdbg_thread, &event);
+}
+
+static void lkdbg_perf_handle_record(struct perf_event_header* header)
+{
+    // sample_type is TID | TIME | CPU (| RAW), and sample_id_all puts the same fields at the end of other records
+    typedef struct
+    {
+        LK_U32 pid;
+        LK_U32 tid;
+        LK_U64 time;
+        LK_U32 cpu;
+        LK_U32 reserved;
+    } Sample_Id;
+
+    LK_U8* body = (LK_U8*)(header + 1);
+
+    if (header->type == PERF_RECORD_SAMPLE && lkdbg_context.perf_tracepoint)
+    {
+        Sample_Id* id = (Sample_Id*) body;
+        LK_U32 raw_size = *(LK_U32*)(id + 1);
+        LK_U8* raw = (LK_U8*)(id + 1) + sizeof(LK_U32);
+        if (raw_size < lkdbg_context.perf_next_pid_offset + sizeof(LK_S32)) return;
+
+        LK_S32 next_pid;
+        LKDBG_MEMCPY(&next_pid, raw + lkdbg_context.perf_next_pid_offset, sizeof(next_pid));
+        lkdbg_perf_push_context_switch(id->cpu, (LK_U32) next_pid, id->time);
+    }
+    else if (header->type == PERF_RECORD_SWITCH && !lkdbg_context.perf_tracepoint)
+    {
+        Sample_Id* id = (Sample_Id*)((LK_U8*) header + header->size - sizeof(Sample_Id));
+        int switch_out = (header->misc & PERF_RECORD_MISC_SWITCH_OUT) != 0;
+        lkdbg_perf_push_context_switch(id->cpu, switch_out ? 0 : id->tid, id->time);
+    }
+}
+
+static void lkdbg_perf_drain(int cpu)
+{
+    static LK_U8 record[65536]; // perf_event_header::size is 16 bits
+
+    struct perf_event_mmap_page* meta = (struct perf_event_mmap_page*) lkdbg_context.perf_buffers[cpu];
+    if (!meta) return;
+
+    LK_U64 page_size = (LK_U64) sysconf(_SC_PAGESIZE);
+    LK_U8* data = (LK_U8*) meta + page_size;
+    LK_U64 data_size = LKDBG_PERF_BUFFER_PAGES * page_size;
+
+    LK_U64 head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    LK_U64 tail = meta->data_tail;
+
+    while (tail < head)
+    {
+        // records can wrap around the end of the ring, so copy each one out
+        LK_U64 offset = tail & (data_size - 1);
+        struct perf_event_header header;
+        for (LK_U64 i = 0; i < sizeof(header); i++)
+            ((LK_U8*) &header)[i] = data[(offset + i) & (data_size - 1)];
+        if (header.size < sizeof(header)) break;
+
+        LK_U64 first_part = data_size - offset;
+        if (first_part >= header.size)
+        {
+            LKDBG_MEMCPY(record, data + offset, header.size);
+        }
+        else
+        {
+            LKDBG_MEMCPY(record, data + offset, first_part);
+            LKDBG_MEMCPY(record + first_part, data, header.size - first_part);
+        }
+
+        lkdbg_perf_handle_record((struct perf_event_header*) record);
+        tail += header.size;
+    }
+
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void* lkdbg_perf_collector_thread(void* userdata)
+{
+    (void) userdata;
+    lkdbg_register_thread("perf collector thread");
+
+    struct pollfd fds[LKDBG_PERF_MAX_CPUS];
+    int fd_count = 0;
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+    {
+        if (lkdbg_context.perf_fds[cpu] < 0) continue;
+        fds[fd_count].fd = lkdbg_context.perf_fds[cpu];
+        fds[fd_count].events = POLLIN;
+        fd_count++;
+    }
+
+    while (!__atomic_load_n(&lkdbg_context.perf_stop, __ATOMIC_ACQUIRE))
+    {
+        poll(fds, fd_count, 10);
+        lkdbg_perf_update_anchor();
+        for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+            lkdbg_perf_drain(cpu);
+    }
+
+    // the events are disabled by now, so this picks up everything that's left
+    lkdbg_perf_update_anchor();
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+        lkdbg_perf_drain(cpu);
+
+    return 0;
+}
+
+static void lkdbg_context_switches_start()
+{
+    long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpu_count < 1) cpu_count = 1;
+    if (cpu_count > LKDBG_PERF_MAX_CPUS) cpu_count = LKDBG_PERF_MAX_CPUS;
+
+    lkdbg_context.perf_cpu_count = (int) cpu_count;
+    lkdbg_context.perf_buffer_size = (1 + LKDBG_PERF_BUFFER_PAGES) * (LK_U64) sysconf(_SC_PAGESIZE);
+    lkdbg_context.perf_stop = 0;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU;
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC;
+    attr.disabled = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = (LK_U32)(lkdbg_context.perf_buffer_size / 4);
+
+    LK_U64 tracepoint_id;
+    int opened = 0;
+    if (lkdbg_perf_find_sched_switch(&tracepoint_id, &lkdbg_context.perf_next_pid_offset))
+    {
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.config = tracepoint_id;
+        attr.sample_period = 1;
+        attr.sample_type |= PERF_SAMPLE_RAW;
+
+        lkdbg_context.perf_tracepoint = 1;
+        opened = lkdbg_perf_open_all(&attr, -1);
+    }
+
+    if (!opened)
+    {
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_DUMMY;
+        attr.sample_period = 0;
+        attr.sample_type &= ~(LK_U64) PERF_SAMPLE_RAW;
+        attr.sample_id_all = 1;
+        attr.context_switch = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        lkdbg_context.perf_tracepoint = 0;
+        opened = lkdbg_perf_open_all(&attr, getpid());
+    }
+
+    if (!opened)
+    {
+        printf("perf_event_open failure %d (%s), context switches won't be recorded\n", errno, strerror(errno));
+        return;
+    }
+
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+        if (lkdbg_context.perf_fds[cpu] >= 0)
+            ioctl(lkdbg_context.perf_fds[cpu], PERF_EVENT_IOC_ENABLE, 0);
+
+    if (pthread_create(&lkdbg_context.perf_thread, 0, lkdbg_perf_collector_thread, 0) != 0)
+    {
+        printf("pthread_create failure, context switches won't be recorded\n");
+        lkdbg_perf_close_all();
+        return;
+    }
+
+    lkdbg_context.perf_running = 1;
+}
+
+static void lkdbg_context_switches_end()
+{
+    if (!lkdbg_context.perf_running) return;
+
+    for (int cpu = 0; cpu < lkdbg_context.perf_cpu_count; cpu++)
+        if (lkdbg_context.perf_fds[cpu] >= 0)
+            ioctl(lkdbg_context.perf_fds[cpu], PERF_EVENT_IOC_DISABLE, 0);
+
+    __atomic_store_n(&lkdbg_context.perf_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(lkdbg_context.perf_thread, 0);
+
+    lkdbg_perf_close_all();
+    lkdbg_context.perf_running = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-block performance counters
+
+// All counters are opened as a single group on the registering thread, so one read() gets all of them.
+// Hardware counters that fail to open (no PMU, or not enough of them) are simply left out.
+// We'd like kernel time included (page faults and context switches happen there), but
+// perf_event_paranoid often forbids that, so we retry with exclude_kernel.
+
+static void lkdbg_perf_counters_open(LKDBG_Thread* thread)
+{
+    static const struct { LK_U32 type; LK_U64 config; } counters[LKDBG_PERF_COUNTER_COUNT] =
+    {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES       }, // LKDBG_PERF_CYCLES
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS     }, // LKDBG_PERF_INSTRUCTIONS
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES     }, // LKDBG_PERF_CACHE_MISSES
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES    }, // LKDBG_PERF_BRANCH_MISSES
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS      }, // LKDBG_PERF_PAGE_FAULTS
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }, // LKDBG_PERF_CONTEXT_SWITCHES
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK       }, // LKDBG_PERF_TASK_CLOCK
+    };
+
+    thread->perf_counter_fd_count = 0;
+    thread->perf_counter_mask = 0;
+
+    int exclude_kernel = 0;
+    for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+    {
+        int leader = thread->perf_counter_fd_count ? thread->perf_counter_fds[0] : -1;
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = (leader == -1);
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+
+        int fd = (int) lkdbg_perf_event_open(&attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && !exclude_kernel && (errno == EACCES || errno == EPERM))
+        {
+            exclude_kernel = 1;
+            attr.exclude_kernel = 1;
+            fd = (int) lkdbg_perf_event_open(&attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd < 0) continue;
+
+        thread->perf_counter_order[thread->perf_counter_fd_count] = (LK_U8) i;
+        thread->perf_counter_fds[thread->perf_counter_fd_count++] = fd;
+        thread->perf_counter_mask |= 1u << i;
+    }
+
+    if (thread->perf_counter_fd_count)
+    {
+        ioctl(thread->perf_counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void lkdbg_perf_counters_close(LKDBG_Thread* thread)
+{
+    for (int i = thread->perf_counter_fd_count - 1; i >= 0; i--)
+        close(thread->perf_counter_fds[i]);
+
+    thread->perf_counter_fd_count = 0;
+    thread->perf_counter_mask = 0;
+}
+
+static void lkdbg_perf_counters_read(LKDBG_Thread* thread, LK_U64* values)
+{
+    // with PERF_FORMAT_GROUP, the leader reads as the member count followed by each member's value
+    LK_U64 data[1 + LKDBG_PERF_COUNTER_COUNT];
+    if (read(thread->perf_counter_fds[0], data, sizeof(data)) < (ssize_t) sizeof(LK_U64))
+        data[0] = 0;
+
+    for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+        values[i] = 0;
+    for (LK_U64 i = 0; i < data[0] && i < (LK_U64) thread->perf_counter_fd_count; i++)
+        values[thread->perf_counter_order[i]] = data[1 + i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sampling
+
+// Each thread has a timer on its own CPU clock, which sends SIGPROF to that thread only.
+// The handler can't allocate, so it writes into a fixed size per-thread buffer, and the thread moves the
+// samples into its event list (with SIGPROF blocked) from lkdbg_push_block_event() when the buffer fills up.
+// Samples that don't fit are dropped.
+
+#ifndef LKDBG_SAMPLE_BUFFER_SIZE
+#define LKDBG_SAMPLE_BUFFER_SIZE 16384 // events, not samples
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static int lkdbg_sample_registers(void* context, LK_U64* pc, LK_U64* fp)
+{
+    ucontext_t* uc = (ucontext_t*) context;
+#if defined(__x86_64__)
+    *pc = (LK_U64) uc->uc_mcontext.gregs[REG_RIP];
+    *fp = (LK_U64) uc->uc_mcontext.gregs[REG_RBP];
+    return 1;
+#elif defined(__i386__)
+    *pc = (LK_U64) uc->uc_mcontext.gregs[REG_EIP];
+    *fp = (LK_U64) uc->uc_mcontext.gregs[REG_EBP];
+    return 1;
+#elif defined(__aarch64__)
+    *pc = (LK_U64) uc->uc_mcontext.pc;
+    *fp = (LK_U64) uc->uc_mcontext.regs[29];
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void lkdbg_record_sample(LKDBG_Thread* thread, void* context)
+{
+    LK_U64 time = lkdbg_time();
+
+    LK_U64 pc, fp;
+    if (!lkdbg_sample_registers(context, &pc, &fp)) return;
+
+    LK_U64 addresses[LKDBG_MAX_SAMPLE_DEPTH];
+    LK_U64 depth = 0;
+    addresses[depth++] = pc;
+
+    // every frame starts with the caller's frame pointer, followed by the return address;
+    // stop as soon as anything looks off, we're reading raw stack memory here
+    while (depth < LKDBG_MAX_SAMPLE_DEPTH &&
+           fp >= thread->stack_low && fp + 2 * sizeof(void*) <= thread->stack_high &&
+           (fp & (sizeof(void*) - 1)) == 0)
+    {
+        LK_U64 next_fp = (LK_U64)((uintptr_t*)(uintptr_t) fp)[0];
+        LK_U64 return_address = (LK_U64)((uintptr_t*)(uintptr_t) fp)[1];
+        if (!return_address) break;
+
+        addresses[depth++] = return_address - 1; // point into the call instruction, not after it
+        if (next_fp <= fp) break;
+        fp = next_fp;
+    }
+
+    LK_U64 count = thread->sample_count;
+    if (count + depth > LKDBG_SAMPLE_BUFFER_SIZE)
+    {
+        thread->samples_dropped++;
+        return;
+    }
+
+    for (LK_U64 i = 0; i < depth; i++)
+    {
+        LKDBG_Sample* sample = &thread->samples[count + i].sample;
+        sample->kind = LKDBG_SAMPLE;
+        sample->depth = (LK_U8) i;
+        sample->thread_id = thread->thread_id;
+        sample->address = addresses[i];
+        sample->time = time;
+    }
+
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    thread->sample_count = count + depth;
+}
+
+static void lkdbg_sample_signal_handler(int signal_number, siginfo_t* info, void* context)
+{
+    (void) signal_number;
+    (void) info;
+
+    LKDBG_Thread* thread = lkdbg_begin_push(0);
+    if (!thread) return;
+
+    int saved_errno = errno;
+    if (thread->samples)
+    {
+        lkdbg_record_sample(thread, context);
+    }
+    errno = saved_errno;
+    lkdbg_end_push();
+}
+
+static void lkdbg_sampling_start()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = lkdbg_sample_signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, &lkdbg_context.sample_previous_action) != 0)
+    {
+        printf("sigaction failure %d (%s), no samples will be recorded\n", errno, strerror(errno));
+        return;
+    }
+    lkdbg_context.sample_handler_installed = 1;
+}
+
+static void lkdbg_sampling_register_thread(LKDBG_Thread* thread)
+{
+    thread->samples = 0;
+    thread->sample_count = 0;
+    thread->samples_dropped = 0;
+    thread->sample_timer_active = 0;
+
+    if (!(lkdbg_context.flags & LKDBG_CAPTURE_SAMPLES)) return;
+
+    pthread_attr_t attributes;
+    void* stack_address;
+    size_t stack_size;
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0) return;
+    pthread_attr_getstack(&attributes, &stack_address, &stack_size);
+    pthread_attr_destroy(&attributes);
+
+    thread->stack_low = (LK_U64)(uintptr_t) stack_address;
+    thread->stack_high = thread->stack_low + stack_size;
+    thread->samples = (LKDBG_Event*) LKDBG_MALLOC(sizeof(LKDBG_Event) * LKDBG_SAMPLE_BUFFER_SIZE);
+
+    struct sigevent notification;
+    memset(&notification, 0, sizeof(notification));
+    notification.sigev_notify = SIGEV_THREAD_ID;
+    notification.sigev_signo = SIGPROF;
+    notification.sigev_notify_thread_id = thread->thread_id;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &notification, &thread->sample_timer) != 0)
+    {
+        printf("timer_create failure %d (%s), no samples will be recorded on thread %s\n", errno, strerror(errno), thread->name);
+        return;
+    }
+
+    int rate = lkdbg_context.sample_rate > 0 ? lkdbg_context.sample_rate : 1000;
+    LK_U64 period = 1000000000ull / rate;
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = period / 1000000000ull;
+    interval.it_interval.tv_nsec = period % 1000000000ull;
+    interval.it_value = interval.it_interval;
+    timer_settime(thread->sample_timer, 0, &interval, 0);
+
+    thread->sample_timer_active = 1;
+}
+
+static void lkdbg_sampling_drain(LKDBG_Thread* thread, int force)
+{
+    if (!thread->samples) return;
+    if (!force && thread->sample_count < LKDBG_SAMPLE_BUFFER_SIZE / 2) return;
+
+    // only blocks the signal on the calling thread; lkdbg_end() drains other threads, but only after they've
+    // left their pushes, and from then on neither they nor their SIGPROF handler touch the thread
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+
+    LK_U64 count = thread->sample_count;
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    for (LK_U64 i = 0; i < count; i++)
+        lkdbg_push_event(thread, &thread->samples[i]);
+    thread->sample_count = 0;
+
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+
+    if (force)
+    {
+        if (thread->samples_dropped)
+        {
+            printf("%llu samples were dropped on thread %s\n", (unsigned long long) thread->samples_dropped, thread->name);
+        }
+
+        LKDBG_FREE(thread->samples);
+        thread->samples = 0;
+    }
+}
+
+static void lkdbg_sampling_end()
+{
+    if (!(lkdbg_context.flags & LKDBG_CAPTURE_SAMPLES)) return;
+
+    LKDBG_Thread* newest = (LKDBG_Thread*) lkdbg_context.thread_list;
+    lkdbg_os_fence_acquire();
+    for (LKDBG_Thread* thread = newest; thread; thread = thread->next)
+    {
+        if (!thread->sample_timer_active) continue;
+
+        timer_delete(thread->sample_timer);
+        thread->sample_timer_active = 0;
+    }
+
+    // a SIGPROF from someone else (setitimer, another profiler) after this goes where it used to
+    if (lkdbg_context.sample_handler_installed)
+    {
+        sigaction(SIGPROF, &lkdbg_context.sample_previous_action, 0);
+        lkdbg_context.sample_handler_installed = 0;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Live streaming
+
+// The collector wakes up every LKDBG_STREAM_INTERVAL milliseconds and sends whatever each thread pushed to
+// its ring since the last round, copying it out the same way lkdbg_copy_ring() does. Sends don't block:
+// when the receiver's socket buffer is full, the rest of that thread's events for the round are dropped.
+// SOCK_SEQPACKET delivers each message whole or not at all, so a dropped message never leaves the
+// receiver with half an event.
+
+#ifndef LKDBG_STREAM_INTERVAL
+#define LKDBG_STREAM_INTERVAL 10 // milliseconds
+#endif
+
+#ifndef LKDBG_STREAM_BUFFER_SIZE
+#define LKDBG_STREAM_BUFFER_SIZE (4 << 20) // asked for, the kernel caps it at net.core.wmem_max
+#endif
+
+#define LKDBG_STREAM_MAX_EVENTS ((LKDBG_STREAM_MESSAGE_SIZE - sizeof(LKDBG_Stream_Message)) / sizeof(LKDBG_Event))
+
+typedef struct
+{
+    LK_U64 cursor;  // ring position of the next event to send
+    LK_U64 dropped; // since the last message that got through
+    int announced;  // a message got through, so the receiver knows the thread even if it never pushes anything
+} LKDBG_Stream_Thread;
+
+typedef struct LKDBG_Stream
+{
+    LKDBG_Event events[LKDBG_STREAM_MAX_EVENTS];
+
+    // strings in the cache were sent in a message that got through, or are in the one being built
+    const void* string_cache[LKDBG_STRING_CACHE_SIZE];
+    LKDBG_File_String* strings;
+    LK_U64 string_count;
+    LK_U64 string_capacity;
+
+    LKDBG_Stream_Thread* threads;
+    LK_U64 thread_count;
+    LK_U64 thread_capacity;
+} LKDBG_Stream;
+
+// Same as in lk_debug_analyze.cpp, these only make sense right after the event they belong to.
+static int lkdbg_continues_previous_event(const LKDBG_Event* event)
+{
+    switch (event->kind)
+    {
+    case LKDBG_PERF_COUNTER:    return 1;
+    case LKDBG_COUNTER_VALUE:   return 1;
+    case LKDBG_FLOW_NAME:       return 1;
+    case LKDBG_ALLOCATION_SIZE: return 1;
+    case LKDBG_ALLOCATION_SITE: return 1;
+    case LKDBG_SAMPLE:          return event->sample.depth != 0;
+    default:                    return 0;
+    }
+}
+
+// Strings of a message that didn't get through have to be sent again with later events.
+static void lkdbg_stream_forget_strings(LKDBG_Stream* stream, LK_U64 from)
+{
+    for (LK_U64 i = from; i < stream->string_count; i++)
+    {
+        const void* ptr = stream->strings[i].ptr;
+        LK_U64 slot = (((LK_U64)(uintptr_t) ptr) >> 3) & (LKDBG_STRING_CACHE_SIZE - 1);
+        if (stream->string_cache[slot] == ptr)
+            stream->string_cache[slot] = 0;
+    }
+    stream->string_count = from;
+}
 
-            fwrite(strings, sizeof(LKDBG_File_String), string_count, out);
+// Returns 1 if the message was sent, 0 if it was dropped, and -1 if the receiver is gone.
+static int lkdbg_stream_send(LKDBG_Stream_Message* message, const void* a, LK_U64 a_size, const void* b, LK_U64 b_size, int wait)
+{
+    struct iovec parts[3];
+    parts[0].iov_base = message;
+    parts[0].iov_len = sizeof(LKDBG_Stream_Message);
+    parts[1].iov_base = (void*) a;
+    parts[1].iov_len = a_size;
+    parts[2].iov_base = (void*) b;
+    parts[2].iov_len = b_size;
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = parts;
+    header.msg_iovlen = 3;
+
+    if (sendmsg(lkdbg_context.stream_fd, &header, MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT)) >= 0) return 1;
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return 0;
+    return -1;
+}
 
-            for (LK_U64 i = 0; i < lkdbg_context.thread_count; i++)
-            {
-                LKDBG_Thread* thread = lkdbg_context.threads[i];
+static int lkdbg_stream_send_header(int kind)
+{
+    LKDBG_File_Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = LKDBG_FILE_MAGIC;
+    header.version = LKDBG_FILE_VERSION;
+    header.time_frequency = lkdbg_time_frequency();
+    header.index_stride = LKDBG_INDEX_STRIDE;
+    header.event_overhead = lkdbg_context.event_overhead;
+
+    LKDBG_Stream_Message message;
+    memset(&message, 0, sizeof(message));
+    message.magic = LKDBG_STREAM_MAGIC;
+    message.kind = kind;
+    return lkdbg_stream_send(&message, &header, sizeof(header), 0, 0, 1);
+}
+
+// Sends what the thread pushed up to the head as it is now. Returns 0 if the receiver is gone.
+static int lkdbg_stream_thread(LKDBG_Stream* stream, LKDBG_Thread* thread, LK_U64 index, int wait)
+{
+    LKDBG_Stream_Thread* state = &stream->threads[index];
+    LK_U64 capacity = thread->event_capacity;
+    LK_U64 end = thread->ring_head;
+    lkdbg_os_fence_acquire();
+
+    // an empty message is enough to announce the thread or report drops
+    while (state->cursor < end || state->dropped || !state->announced)
+    {
+        // the ring went around before we got to these
+        if (end - state->cursor > capacity)
+        {
+            state->dropped += end - capacity - state->cursor;
+            state->cursor = end - capacity;
+        }
+
+        LK_U64 first = state->cursor;
+        LK_U64 count = end - first;
+        if (count > LKDBG_STREAM_MAX_EVENTS) count = LKDBG_STREAM_MAX_EVENTS;
+        for (LK_U64 i = 0; i < count; i++)
+            stream->events[i] = thread->events[(first + i) & (capacity - 1)];
+
+        // the event at the new head may be half written over the one 'capacity' before it
+        lkdbg_os_fence_acquire();
+        LK_U64 new_head = thread->ring_head;
+        LK_U64 valid = new_head + 1 > capacity ? new_head + 1 - capacity : 0;
+        if (valid > first && count)
+        {
+            LK_U64 lost = valid - first;
+            if (lost > end - first) lost = end - first;
+            state->dropped += lost;
+            state->cursor += lost;
+            continue;
+        }
+
+        stream->string_count = 0;
+        lkdbg_add_file_string(thread->name, stream->string_cache, &stream->strings, &stream->string_count, &stream->string_capacity);
+
+        // stop before the first event that doesn't fit, backing up to the start of its group
+        LK_U64 taken = count;
+        LK_U64 group = 0;
+        for (LK_U64 i = 0; i < count; i++)
+        {
+            if (!lkdbg_continues_previous_event(&stream->events[i])) group = i;
+
+            LK_U64 string_count = stream->string_count;
+            lkdbg_add_event_string(&stream->events[i], stream->string_cache, &stream->strings, &stream->string_count, &stream->string_capacity);
 
-                LKDBG_File_Thread thread_data;
-                thread_data.thread_id = thread->thread_id;
-                thread_data.name = thread->name;
-                fwrite(&thread_data, sizeof(thread_data), 1, out);
+            LK_U64 size = sizeof(LKDBG_Stream_Message) + stream->string_count * sizeof(LKDBG_File_String) + (i + 1) * sizeof(LKDBG_Event);
+            if (size > LKDBG_STREAM_MESSAGE_SIZE)
+            {
+                lkdbg_stream_forget_strings(stream, string_count);
+                taken = group ? group : i;
+                break;
             }
+        }
 
-            fwrite(all_events, sizeof(LKDBG_Event), all_count, out);
+        LKDBG_Stream_Message message;
+        memset(&message, 0, sizeof(message));
+        message.magic = LKDBG_STREAM_MAGIC;
+        message.kind = LKDBG_STREAM_EVENTS;
+        message.thread_id = thread->thread_id;
+        message.thread_index = (LK_U32) index;
+        message.thread_name = thread->name;
+        message.string_count = stream->string_count;
+        message.event_count = taken;
+        message.dropped = state->dropped;
+
+        int result = lkdbg_stream_send(&message, stream->strings, stream->string_count * sizeof(LKDBG_File_String),
+                                       stream->events, taken * sizeof(LKDBG_Event), wait);
+        if (result < 0) return 0;
+        if (result == 0)
+        {
+            // the receiver is behind, so don't bother trying the rest of this round
+            lkdbg_stream_forget_strings(stream, 0);
+            state->dropped += end - first;
+            state->cursor = end;
+            break;
         }
-        fclose(out);
 
-        LKDBG_FREE(all_events);
-        LKDBG_FREE(strings);
+        state->dropped = 0;
+        state->announced = 1;
+        state->cursor = first + taken;
+    }
+    return 1;
+}
+
+static int lkdbg_stream_round(LKDBG_Stream* stream, int wait)
+{
+    int connected = 1;
+    LK_U64 thread_count;
+    LKDBG_Thread** threads = lkdbg_collect_threads(&thread_count);
+    for (LK_U64 i = 0; i < thread_count && connected; i++)
+    {
+        while (stream->thread_count <= threads[i]->index)
+        {
+            LKDBG_Stream_Thread state = { 0, 0, 0 };
+            lkdbg_array_push((void**) &stream->threads, &stream->thread_count, &stream->thread_capacity, &state, sizeof(LKDBG_Stream_Thread));
+        }
+        connected = lkdbg_stream_thread(stream, threads[i], threads[i]->index, wait);
     }
+    LKDBG_FREE(threads);
+    return connected;
+}
 
-    for (LK_U64 i = 0; i < lkdbg_context.thread_count; i++)
+static void* lkdbg_stream_collector_thread(void* userdata)
+{
+    LKDBG_Stream* stream = (LKDBG_Stream*) userdata;
+    while (!__atomic_load_n(&lkdbg_context.stream_stop, __ATOMIC_ACQUIRE))
     {
-        LKDBG_Thread* thread = lkdbg_context.threads[i];
-        if (thread->events)
+        usleep(LKDBG_STREAM_INTERVAL * 1000);
+        if (!lkdbg_stream_round(stream, 0))
         {
-            LKDBG_FREE(thread->events);
+            printf("The lk_debug stream receiver went away, stopped streaming\n");
+            __atomic_store_n(&lkdbg_context.stream_running, 0, __ATOMIC_RELEASE);
+            break;
         }
-        LKDBG_FREE(thread);
     }
+    return 0;
+}
+
+int lkdbg_stream(const char* socket_path)
+{
+    LKDBG_ASSERT(lkdbg_context.flags & LKDBG_FLIGHT_RECORDER, "streaming needs LKDBG_FLIGHT_RECORDER");
+    LKDBG_ASSERT(!lkdbg_context.stream, "already streaming");
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        printf("Socket path %s is too long\n", socket_path);
+        return 0;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
 
-    if (lkdbg_context.threads)
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0)
     {
-        LKDBG_FREE(lkdbg_context.threads);
+        printf("Failed to connect to %s for streaming: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
     }
 
-    lkdbg_context.threads = 0;
-    lkdbg_context.thread_count = 0;
-    lkdbg_context.thread_capacity = 0;
+    int buffer_size = LKDBG_STREAM_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    lkdbg_context.stream_fd = fd;
+    if (lkdbg_stream_send_header(LKDBG_STREAM_HEADER) <= 0)
+    {
+        printf("Failed to start streaming to %s\n", socket_path);
+        close(fd);
+        return 0;
+    }
 
-    DeleteCriticalSection(&lkdbg_context.lock);
+    LKDBG_Stream* stream = (LKDBG_Stream*) LKDBG_MALLOC(sizeof(LKDBG_Stream));
+    memset(stream, 0, sizeof(LKDBG_Stream));
+    lkdbg_context.stream = stream;
+    lkdbg_context.stream_stop = 0;
+    lkdbg_context.stream_running = 1;
+    pthread_create(&lkdbg_context.stream_thread, 0, lkdbg_stream_collector_thread, stream);
+    return 1;
 }
 
-static void lkdbg_etw_print_error(const char* what, LK_U32 error_code)
+// Called from lkdbg_end() once nothing else will be pushed, so the last round gets everything.
+static void lkdbg_stream_end()
 {
-    printf("%s %u", what, error_code);
-    switch (error_code)
+    LKDBG_Stream* stream = lkdbg_context.stream;
+    if (!stream) return;
+
+    __atomic_store_n(&lkdbg_context.stream_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(lkdbg_context.stream_thread, 0);
+
+    // the last round may wait for the receiver, but not forever
+    struct timeval timeout = { 1, 0 };
+    setsockopt(lkdbg_context.stream_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (lkdbg_context.stream_running && lkdbg_stream_round(stream, 1))
+        lkdbg_stream_send_header(LKDBG_STREAM_END);
+    close(lkdbg_context.stream_fd);
+
+    if (stream->strings) LKDBG_FREE(stream->strings);
+    if (stream->threads) LKDBG_FREE(stream->threads);
+    LKDBG_FREE(stream);
+    lkdbg_context.stream = 0;
+    lkdbg_context.stream_running = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Crash handler
+
+// SA_RESETHAND puts the default action back, so re-raising the signal crashes (and dumps core) as usual.
+static void lkdbg_crash_signal_handler(int signal_number)
+{
+    lkdbg_crash_snapshot();
+    raise(signal_number);
+}
+
+static void lkdbg_os_install_crash_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lkdbg_crash_signal_handler;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+
+    int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    for (int i = 0; i < (int)(sizeof(signals) / sizeof(signals[0])); i++)
+        sigaction(signals[i], &action, 0);
+}
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LKDBG_IMPLEMENTED
+#endif // LKDBG_IMPLEMENTATION
+
+////////////////////////////////////////////////////////////////////////////////
+// Reader implementation
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef LKDBG_READER_IMPLEMENTATION
+#ifndef LKDBG_READER_IMPLEMENTED
+#define LKDBG_READER_IMPLEMENTED
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+static int lkdbg_map_file(LKDBG_Profile* profile, const char* path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
     {
-    case ERROR_ACCESS_DENIED:          printf(" (ERROR_ACCESS_DENIED)");          break;
-    case ERROR_ALREADY_EXISTS:         printf(" (ERROR_ALREADY_EXISTS)");         break;
-    case ERROR_BAD_LENGTH:             printf(" (ERROR_BAD_LENGTH)");             break;
-    case ERROR_BAD_PATHNAME:           printf(" (ERROR_BAD_PATHNAME)");           break;
-    case ERROR_CANCELLED:              printf(" (ERROR_CANCELLED)");              break;
-    case ERROR_DISK_FULL:              printf(" (ERROR_DISK_FULL)");              break;
-    case ERROR_INVALID_HANDLE:         printf(" (ERROR_INVALID_HANDLE)");         break;
-    case ERROR_INVALID_PARAMETER:      printf(" (ERROR_INVALID_PARAMETER)");      break;
-    case ERROR_INVALID_TIME:           printf(" (ERROR_INVALID_TIME)");           break;
-    case ERROR_MORE_DATA:              printf(" (ERROR_MORE_DATA)");              break;
-    case ERROR_NO_SYSTEM_RESOURCES:    printf(" (ERROR_NO_SYSTEM_RESOURCES)");    break;
-    case ERROR_NOACCESS:               printf(" (ERROR_NOACCESS)");               break;
-    case ERROR_WMI_ALREADY_ENABLED:    printf(" (ERROR_WMI_ALREADY_ENABLED)");    break;
-    case ERROR_WMI_INSTANCE_NOT_FOUND: printf(" (ERROR_WMI_INSTANCE_NOT_FOUND)"); break;
+        CloseHandle(file);
+        return 0;
     }
-    printf("\n");
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return 0;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return 0;
+    }
+
+    profile->mapping = view;
+    profile->mapping_size = size.QuadPart;
+    profile->os_file = file;
+    profile->os_mapping = mapping;
+    return 1;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void* view = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) return 0;
+
+    profile->mapping = view;
+    profile->mapping_size = info.st_size;
+    profile->os_file = 0;
+    profile->os_mapping = 0;
+    return 1;
+#endif
 }
 
-static LKDBG_Event** lkdbg_etw_events;
-static LK_U64* lkdbg_etw_event_count;
-static LK_U64* lkdbg_etw_event_capacity;
+void lkdbg_close_profile(LKDBG_Profile* profile)
+{
+    if (profile->mapping)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(profile->mapping);
+        CloseHandle((HANDLE) profile->os_mapping);
+        CloseHandle((HANDLE) profile->os_file);
+#else
+        munmap(profile->mapping, profile->mapping_size);
+#endif
+    }
+
+    memset(profile, 0, sizeof(LKDBG_Profile));
+}
 
-static void WINAPI lkdbg_etw_callback(PEVENT_RECORD event)
+int lkdbg_open_profile(LKDBG_Profile* profile, const char* path)
 {
-    static GUID ThreadGuid = { 0x3d6fa8d1, 0xfe05, 0x11d0, { 0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c } };
+    memset(profile, 0, sizeof(LKDBG_Profile));
+    if (!lkdbg_map_file(profile, path)) return 0;
 
-    typedef struct
+    const LK_U8* base = (const LK_U8*) profile->mapping;
+    LK_U64 size = profile->mapping_size;
+
+    const LKDBG_File_Header* header = (const LKDBG_File_Header*) base;
+    if (size < sizeof(LKDBG_File_Header) ||
+        header->magic != LKDBG_FILE_MAGIC ||
+        header->version != LKDBG_FILE_VERSION ||
+        header->index_stride == 0)
     {
-        LK_U32 NewThreadId;
-        LK_U32 OldThreadId;
-        LK_S8  NewThreadPriority;
-        LK_S8  OldThreadPriority;
-        LK_U8  PreviousCState;
-        LK_S8  SpareByte;
-        LK_S8  OldThreadWaitReason;
-        LK_S8  OldThreadWaitMode;
-        LK_S8  OldThreadState;
-        LK_S8  OldThreadWaitIdealProcessor;
-        LK_U32 NewThreadWaitTime;
-        LK_U32 Reserved;
-    } CSwitch;
+        lkdbg_close_profile(profile);
+        return 0;
+    }
 
-    if (((LK_U64*) &event->EventHeader.ProviderId)[0] != ((LK_U64*) &ThreadGuid)[0]) return;
-    if (((LK_U64*) &event->EventHeader.ProviderId)[1] != ((LK_U64*) &ThreadGuid)[1]) return;
-    if (event->EventHeader.EventDescriptor.Opcode != 36) return;
-    if (event->UserDataLength != sizeof(CSwitch)) return;
+    // check each section separately, so a garbage count can't overflow the total
+    LK_U64 offset = sizeof(LKDBG_File_Header);
+    LK_U64 sections[4][2] =
+    {
+        { header->string_count, sizeof(LKDBG_File_String) },
+        { header->thread_count, sizeof(LKDBG_File_Thread) },
+        { header->event_count,  sizeof(LKDBG_Event)       },
+        { header->index_count,  sizeof(LK_U64)            },
+    };
+
+    LK_U64 section_offsets[4];
+    for (int i = 0; i < 4; i++)
+    {
+        if (sections[i][0] > (size - offset) / sections[i][1])
+        {
+            lkdbg_close_profile(profile);
+            return 0;
+        }
+        section_offsets[i] = offset;
+        offset += sections[i][0] * sections[i][1];
+    }
 
-    CSwitch* cswitch = (CSwitch*) event->UserData;
-    LK_U32 thread_id = cswitch->NewThreadId;
+    profile->header  = header;
+    profile->strings = (const LKDBG_File_String*)(base + section_offsets[0]);
+    profile->threads = (const LKDBG_File_Thread*)(base + section_offsets[1]);
+    profile->events  = (const LKDBG_Event*)      (base + section_offsets[2]);
+    profile->index   = (const LK_U64*)           (base + section_offsets[3]);
 
-    LKDBG_Event debug_event;
-    debug_event.kind = LKDBG_CONTEXT_SWITCH;
-    debug_event.context_switch.processor = event->BufferContext.ProcessorNumber;
-    debug_event.context_switch.thread_id = thread_id;
-    debug_event.context_switch.time = event->EventHeader.TimeStamp.QuadPart;
+    for (LK_U64 i = 0; i < header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        if (thread->first_event > header->event_count ||
+            thread->event_count > header->event_count - thread->first_event ||
+            thread->first_index > header->index_count ||
+            thread->index_count > header->index_count - thread->first_index ||
+            thread->index_count != (thread->event_count + header->index_stride - 1) / header->index_stride)
+        {
+            lkdbg_close_profile(profile);
+            return 0;
+        }
+    }
 
-    lkdbg_array_push((void**) lkdbg_etw_events, lkdbg_etw_event_count, lkdbg_etw_event_capacity, &debug_event, sizeof(LKDBG_Event));
+    return 1;
 }
 
-static DWORD WINAPI lkdbg_etw_processing_thread(LPVOID userdata)
+const char* lkdbg_profile_string(const LKDBG_Profile* profile, const void* ptr)
 {
-    lkdbg_register_thread("ETW processing thread");
+    LK_U64 low = 0;
+    LK_U64 high = profile->header->string_count;
+    while (low < high)
+    {
+        LK_U64 middle = low + (high - low) / 2;
+        const LKDBG_File_String* string = &profile->strings[middle];
+        if (string->ptr == ptr) return string->string;
+
+        if ((uintptr_t) string->ptr < (uintptr_t) ptr)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return "";
+}
+
+LK_U64 lkdbg_profile_seek(const LKDBG_Profile* profile, LK_U64 thread_index, LK_U64 time)
+{
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LK_U64* index = profile->index + thread->first_index;
+    const LKDBG_Event* events = profile->events + thread->first_event;
+    LK_U64 stride = profile->header->index_stride;
+
+    // find the last index entry before 'time'; the answer is in the stride after it
+    LK_U64 low = 0;
+    LK_U64 high = thread->index_count;
+    while (low < high)
+    {
+        LK_U64 middle = low + (high - low) / 2;
+        if (index[middle] < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
 
-    lkdbg_etw_events         = &lkdbg_thread->events;
-    lkdbg_etw_event_count    = &lkdbg_thread->event_count;
-    lkdbg_etw_event_capacity = &lkdbg_thread->event_capacity;
+    if (low == 0) return 0;
 
-    TRACEHANDLE consumer_handle = (TRACEHANDLE) userdata;
-    ULONG status = ProcessTrace(&consumer_handle, 1, 0, 0);
-    if (status != ERROR_SUCCESS)
+    LK_U64 first = (low - 1) * stride;
+    LK_U64 last = low * stride;
+    if (last > thread->event_count) last = thread->event_count;
+
+    while (first < last)
     {
-        lkdbg_etw_print_error("ProcessTrace failure", status);
+        LK_U64 middle = first + (last - first) / 2;
+        if (lkdbg_get_event_time(&events[middle]) < time)
+            first = middle + 1;
+        else
+            last = middle;
     }
 
-    return 0;
+    return first;
 }
 
-static void lkdbg_etw_start()
+LK_U32 lkdbg_profile_perf_counters(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* end_event, LK_U64 deltas[LKDBG_PERF_COUNTER_COUNT])
 {
-    ULONG status;
-    ULONG buffer_size = sizeof(EVENT_TRACE_PROPERTIES) + sizeof(KERNEL_LOGGER_NAME);
-    EVENT_TRACE_PROPERTIES* session_properties = (EVENT_TRACE_PROPERTIES*) LKDBG_MALLOC(buffer_size);
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LKDBG_Event* end = profile->events + thread->first_event + thread->event_count;
 
-    // ControlTrace
+    LK_U32 mask = 0;
+    for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+        deltas[i] = 0;
 
-    ZeroMemory(session_properties, sizeof(EVENT_TRACE_PROPERTIES));
-    session_properties->Wnode.BufferSize = buffer_size;
-    session_properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
-    session_properties->Wnode.ClientContext = 1; // magic constant, means that timestamps should be QueryPerformanceCounter
-    session_properties->Wnode.Guid = SystemTraceControlGuid;
-    session_properties->EnableFlags = EVENT_TRACE_FLAG_CSWITCH;
-    session_properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
-    session_properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
-    LKDBG_MEMCPY((LPSTR)(session_properties + 1), KERNEL_LOGGER_NAME, sizeof(KERNEL_LOGGER_NAME));
+    for (const LKDBG_Event* event = end_event + 1; event < end && event->kind == LKDBG_PERF_COUNTER; event++)
+    {
+        if (event->perf_counter.counter >= LKDBG_PERF_COUNTER_COUNT) continue;
+        deltas[event->perf_counter.counter] = event->perf_counter.delta;
+        mask |= 1u << event->perf_counter.counter;
+    }
 
-    status = ControlTrace(0, KERNEL_LOGGER_NAME, session_properties, EVENT_TRACE_CONTROL_STOP);
-    if (status != ERROR_SUCCESS && status != ERROR_WMI_INSTANCE_NOT_FOUND)
+    return mask;
+}
+
+int lkdbg_profile_counter_value(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* counter, LK_F64* value)
+{
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LKDBG_Event* end = profile->events + thread->first_event + thread->event_count;
+
+    const LKDBG_Event* next = counter + 1;
+    if (next >= end || next->kind != LKDBG_COUNTER_VALUE || next->counter_value.time != counter->counter.time)
     {
-        lkdbg_etw_print_error("ControlTrace failure", status);
-        return;
+        *value = 0;
+        return 0;
     }
 
-    // StartTrace
+    *value = next->counter_value.value;
+    return 1;
+}
 
-    // set this struct again, because ControlTrace seems to do something to it that StartTrace doesn't like
-    ZeroMemory(session_properties, sizeof(EVENT_TRACE_PROPERTIES));
-    session_properties->Wnode.BufferSize = buffer_size;
-    session_properties->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
-    session_properties->Wnode.ClientContext = 1; // magic constant, means that timestamps should be QueryPerformanceCounter
-    session_properties->Wnode.Guid = SystemTraceControlGuid;
-    session_properties->EnableFlags = EVENT_TRACE_FLAG_CSWITCH;
-    session_properties->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
-    session_properties->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
-    LKDBG_MEMCPY((LPSTR)(session_properties + 1), KERNEL_LOGGER_NAME, sizeof(KERNEL_LOGGER_NAME));
+const void* lkdbg_profile_flow_name(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* flow)
+{
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LKDBG_Event* end = profile->events + thread->first_event + thread->event_count;
 
-    TRACEHANDLE session_handle;
-    status = StartTrace(&session_handle, KERNEL_LOGGER_NAME, session_properties);
-    if (status != ERROR_SUCCESS)
+    const LKDBG_Event* next = flow + 1;
+    if (next >= end || next->kind != LKDBG_FLOW_NAME || next->flow_name.time != flow->flow.time)
+        return 0;
+    return next->flow_name.name;
+}
+
+int lkdbg_profile_allocation(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* allocation, LK_U64* size, const void** site)
+{
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LKDBG_Event* end = profile->events + thread->first_event + thread->event_count;
+    LK_U64 time = allocation->allocation.time;
+
+    *size = 0;
+    *site = 0;
+
+    const LKDBG_Event* next = allocation + 1;
+    if (next >= end || next->kind != LKDBG_ALLOCATION_SIZE || next->allocation_size.time != time)
+        return 0;
+    *size = next->allocation_size.size;
+
+    next++;
+    if (next < end && next->kind == LKDBG_ALLOCATION_SITE && next->allocation_site.time == time)
+        *site = next->allocation_site.name;
+    return 1;
+}
+
+LK_U64 lkdbg_profile_sample_stack(const LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* sample, LK_U64* addresses, LK_U64 max_depth)
+{
+    const LKDBG_File_Thread* thread = &profile->threads[thread_index];
+    const LKDBG_Event* end = profile->events + thread->first_event + thread->event_count;
+
+    LK_U64 depth = 0;
+    for (const LKDBG_Event* event = sample; event < end && depth < max_depth; event++)
     {
-        printf("StartTrace failure %d", status);
-        lkdbg_etw_print_error("StartTrace failure", status);
-        return;
+        if (event->kind != LKDBG_SAMPLE || event->sample.depth != depth) break;
+        addresses[depth++] = event->sample.address;
     }
 
-    // OpenTrace
+    return depth;
+}
 
-    EVENT_TRACE_LOGFILE log_file = {0};
-    log_file.LoggerName = KERNEL_LOGGER_NAME;
-    log_file.ProcessTraceMode = (PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD | PROCESS_TRACE_MODE_RAW_TIMESTAMP);
-    log_file.EventRecordCallback = lkdbg_etw_callback;
+const char* lkdbg_perf_counter_name(int counter)
+{
+    switch (counter)
+    {
+    case LKDBG_PERF_CYCLES:           return "cycles";
+    case LKDBG_PERF_INSTRUCTIONS:     return "instructions";
+    case LKDBG_PERF_CACHE_MISSES:     return "cache_misses";
+    case LKDBG_PERF_BRANCH_MISSES:    return "branch_misses";
+    case LKDBG_PERF_PAGE_FAULTS:      return "page_faults";
+    case LKDBG_PERF_CONTEXT_SWITCHES: return "context_switches";
+    case LKDBG_PERF_TASK_CLOCK:       return "task_clock_ns";
+    default:                          return "unknown";
+    }
+}
 
-    TRACEHANDLE consumer_handle = OpenTrace(&log_file);
-    if (consumer_handle == INVALID_PROCESSTRACE_HANDLE)
+void lkdbg_profile_begin(LKDBG_Profile_Iterator* it, const LKDBG_Profile* profile, LK_U64 thread_index, LK_U64 from_time, LK_U64 to_time)
+{
+    LK_U64 first_thread = 0;
+    LK_U64 thread_count = profile->header->thread_count;
+    if (thread_index != LKDBG_ALL_THREADS)
     {
-        lkdbg_etw_print_error("OpenTrace failure", GetLastError());
-        return;
+        first_thread = thread_index;
+        thread_count = 1;
     }
 
-    // processing thread
+    it->profile = profile;
+    it->to_time = to_time;
+    it->cursor_count = thread_count;
+    it->cursors = (const LKDBG_Event**) malloc(sizeof(LKDBG_Event*) * (thread_count + 1));
+    it->ends = (const LKDBG_Event**) malloc(sizeof(LKDBG_Event*) * (thread_count + 1));
+    it->cursor_threads = (LK_U64*) malloc(sizeof(LK_U64) * (thread_count + 1));
+    it->thread = 0;
 
-    lkdbg_context.etw_thread = CreateThread(0, 0, lkdbg_etw_processing_thread, (LPVOID) consumer_handle, 0, 0);
-    lkdbg_context.etw_consumer_handle = consumer_handle;
+    for (LK_U64 i = 0; i < thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[first_thread + i];
+        const LKDBG_Event* events = profile->events + thread->first_event;
+        it->cursors[i] = events + lkdbg_profile_seek(profile, first_thread + i, from_time);
+        it->ends[i] = events + thread->event_count;
+        it->cursor_threads[i] = first_thread + i;
+    }
 }
 
-static void lkdbg_etw_end()
+const LKDBG_Event* lkdbg_profile_next(LKDBG_Profile_Iterator* it)
 {
-    if (lkdbg_context.etw_consumer_handle)
+    // linear scan over the thread heads; there are rarely enough threads for a heap to pay off
+    LK_U64 best = it->cursor_count;
+    LK_U64 best_time = 0;
+    for (LK_U64 i = 0; i < it->cursor_count; i++)
     {
-        CloseTrace(lkdbg_context.etw_consumer_handle);
+        if (it->cursors[i] == it->ends[i]) continue;
 
-        printf("Waiting for ETW processing thread...\n");
-        WaitForSingleObject(lkdbg_context.etw_thread, INFINITE);
+        LK_U64 time = lkdbg_get_event_time(it->cursors[i]);
+        if (time >= it->to_time)
+        {
+            it->cursors[i] = it->ends[i];
+            continue;
+        }
+
+        if (best == it->cursor_count || time < best_time)
+        {
+            best = i;
+            best_time = time;
+        }
     }
+
+    if (best == it->cursor_count) return 0;
+
+    it->thread = it->cursor_threads[best];
+    return it->cursors[best]++;
 }
 
-#endif
+void lkdbg_profile_end(LKDBG_Profile_Iterator* it)
+{
+    free((void*) it->cursors);
+    free((void*) it->ends);
+    free(it->cursor_threads);
+    it->cursors = 0;
+    it->ends = 0;
+    it->cursor_threads = 0;
+    it->cursor_count = 0;
+}
 
 #ifdef __cplusplus
 }
 #endif
 
+#endif // LKDBG_READER_IMPLEMENTED
+#endif // LKDBG_READER_IMPLEMENTATION
+
 
 /*********************************************************************************************
 
@@ -654,4 +4306,4 @@ THE UNLICENCE (http://unlicense.org)
     ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
     WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
- *********************************************************************************************/
\ No newline at end of file
+ *********************************************************************************************/
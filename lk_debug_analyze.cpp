@@ -0,0 +1,1151 @@
+//  lk_debug_analyze.cpp - public domain command line analysis of lk_debug profiles
+//  no warranty is offered or implied
+
+/*********************************************************************************************
+
+Usage:
+    lk_debug_analyze [options] profile.lkdbg [report]
+
+Reports:
+    top         (default) blocks sorted by inclusive and by exclusive time, then the same for each thread
+    folded      block stacks in folded format ("a;b;c 1234"), weighted by exclusive nanoseconds,
+                for flamegraph.pl, speedscope or inferno
+    samples     sampled call stacks in folded format, weighted by sample count
+    flows       queue wait and service time of flow events, for each flow name
+    memory      allocations by memory class and by site, and live memory over time
+    locks       the most contended locks, with how long they were waited for and held
+
+Options:
+    -n N        number of rows in each top table (default 20)
+    -j N        number of worker threads (default: all cores)
+    -o          subtract the instrumentation overhead measured when the profile was recorded from block times
+
+Times are printed in milliseconds. "off-CPU" is the part of a block's inclusive time its thread spent
+descheduled, worked out from context switch events, so it's only shown for profiles recorded with
+LKDBG_CAPTURE_CONTEXT_SWITCHES. Likewise, allocation columns are only shown for profiles with allocation
+events; they count everything allocated while the block was open, nested blocks included.
+
+Allocation counts (per block and per site) are what the code asked for: heap and region allocations.
+Live memory is what was taken from the system: heap allocations and pages. That way region allocations
+and the pages they're carved out of aren't counted twice.
+
+A lock acquisition is contended if it had to wait. Wait and hold times of read locks are included
+with the rest; hold times of locks taken before the profile began, or never released, aren't counted.
+
+Each thread's events are cut into chunks which are analyzed in parallel. Blocks that are still open at the
+end of a chunk, or end in a chunk without having begun in it, are left for the stitching pass, which goes
+through the chunks of each thread in order and finishes them.
+
+ *********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LKDBG_READER_IMPLEMENTATION
+#include "lk_debug.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (1 << 20) // events
+#endif
+
+enum Report
+{
+    REPORT_TOP,
+    REPORT_FOLDED,
+    REPORT_SAMPLES,
+    REPORT_FLOWS,
+    REPORT_MEMORY,
+    REPORT_LOCKS,
+};
+
+// All times are in ticks until they're printed.
+struct Block_Stats
+{
+    LK_U64 count = 0;
+    LK_U64 inclusive = 0;
+    LK_U64 exclusive = 0;
+    LK_U64 off_cpu = 0;
+    LK_U64 alloc_count = 0;
+    LK_U64 alloc_bytes = 0;
+};
+
+struct Open_Block
+{
+    const void* name;
+    LK_U64 begin;
+    LK_U64 begin_index; // of the begin among the thread's pushed events (within the chunk, until stitched)
+    LK_U64 child;       // time spent in blocks nested in this one
+    LK_U32 folded_node;
+    LK_U64 alloc_count; // so far, nested blocks included
+    LK_U64 alloc_bytes;
+};
+
+// What a chunk does to the blocks that were open before it started: first 'child' and the allocations
+// are added to the innermost one, and then, if 'ends', it ends at 'end_time'.
+struct Carried_Op
+{
+    LK_U64 child;
+    LK_U64 end_time;
+    LK_U64 end_index;
+    bool   ends;
+    LK_U64 alloc_count;
+    LK_U64 alloc_bytes;
+};
+
+// Block stacks are kept as a trie within a chunk. Roots stand for whatever was open before the chunk,
+// after 'orphan_ends' of those blocks have ended.
+struct Folded_Node
+{
+    LK_U32 parent;
+    const void* name;
+    LK_U64 orphan_ends;
+    LK_U64 weight;
+};
+
+#define NO_NODE ((LK_U32) -1)
+
+struct Flow_Point
+{
+    LK_U64 id;
+    LK_U64 time;
+    const void* name;
+    int phase;
+};
+
+struct Memory_Point
+{
+    LK_U64 time;
+    LK_U64 address;
+    LK_U64 size;        // 0 for deallocations
+    const void* site;
+    LK_U8 memory_class;
+    bool allocation;
+};
+
+struct Lock_Point
+{
+    LK_U64 thread;
+    LK_U64 time;
+    const void* name;
+    int phase;
+};
+
+struct Chunk
+{
+    LK_U64 thread;
+    const LKDBG_Event* begin;
+    const LKDBG_Event* end;
+    LK_U64 pushed_events = 0;
+
+    std::unordered_map<const void*, Block_Stats> blocks;
+    std::vector<Open_Block> open;
+    std::vector<Carried_Op> carried;
+
+    std::vector<Folded_Node> folded;
+    std::map<std::pair<LK_U32, const void*>, LK_U32> folded_children;
+    std::map<LK_U64, LK_U32> folded_roots;
+
+    std::map<std::vector<LK_U64>, LK_U64> samples;
+    std::vector<Flow_Point> flows;
+    std::vector<Memory_Point> memory;
+    std::vector<Lock_Point> locks;
+};
+
+// Running intervals of one thread, from context switches, with a prefix sum of their lengths
+// so the on-CPU time within any range is two binary searches away.
+struct Cpu_Time
+{
+    std::vector<LK_U64> starts;
+    std::vector<LK_U64> ends;
+    std::vector<LK_U64> before; // total running time of the intervals before this one
+};
+
+struct Analysis
+{
+    LKDBG_Profile* profile;
+    Report report;
+    int top_count = 20;
+    int worker_count = 0;
+    bool subtract_overhead = false;
+
+    std::vector<Chunk> chunks;
+    std::unordered_map<LK_U32, Cpu_Time> cpu_time;
+    bool has_context_switches = false;
+
+    std::vector<std::unordered_map<const void*, Block_Stats>> thread_blocks;
+    std::map<std::string, LK_U64> folded;
+    std::map<std::vector<LK_U64>, LK_U64> samples;
+    std::vector<Flow_Point> flows;
+    std::vector<Memory_Point> memory;
+    std::vector<Lock_Point> locks;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////
+
+double to_milliseconds(LK_U64 ticks, LK_U64 frequency)
+{
+    return (double) ticks * 1000.0 / (double) frequency;
+}
+
+LK_U64 on_cpu_before(const Cpu_Time* cpu, LK_U64 time)
+{
+    // last interval starting at or before 'time'
+    auto it = std::upper_bound(cpu->starts.begin(), cpu->starts.end(), time);
+    if (it == cpu->starts.begin()) return 0;
+    LK_U64 i = (it - cpu->starts.begin()) - 1;
+
+    LK_U64 end = cpu->ends[i] < time ? cpu->ends[i] : time;
+    return cpu->before[i] + (end - cpu->starts[i]);
+}
+
+LK_U64 off_cpu_time(Analysis* analysis, LK_U64 thread_index, LK_U64 begin, LK_U64 end)
+{
+    auto found = analysis->cpu_time.find(analysis->profile->threads[thread_index].thread_id);
+    if (found == analysis->cpu_time.end()) return 0;
+
+    LK_U64 on_cpu = on_cpu_before(&found->second, end) - on_cpu_before(&found->second, begin);
+    LK_U64 duration = end - begin;
+    return on_cpu < duration ? duration - on_cpu : 0;
+}
+
+LK_U64 block_duration(Analysis* analysis, LK_U64 begin, LK_U64 begin_index, LK_U64 end, LK_U64 end_index)
+{
+    if (!analysis->subtract_overhead) return end - begin;
+    return lkdbg_subtract_overhead(end - begin, end_index - begin_index, analysis->profile->header->event_overhead);
+}
+
+LK_U64 exclusive_duration(LK_U64 duration, LK_U64 child)
+{
+    return duration > child ? duration - child : 0;
+}
+
+// Runs 'function(i)' for i in [0, count) on all worker threads.
+template <typename Function>
+void parallel_for(int worker_count, LK_U64 count, Function function)
+{
+    std::atomic<LK_U64> next(0);
+    auto worker = [&]()
+    {
+        while (true)
+        {
+            LK_U64 i = next++;
+            if (i >= count) break;
+            function(i);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < worker_count; i++)
+        workers.emplace_back(worker);
+    worker();
+    for (auto& thread : workers)
+        thread.join();
+}
+
+// Events that belong to the one before them (perf counter deltas, counter values, flow names,
+// deeper frames of a sample) must end up in the same chunk.
+bool continues_previous_event(const LKDBG_Event* event)
+{
+    switch (event->kind)
+    {
+    case LKDBG_PERF_COUNTER:  return true;
+    case LKDBG_COUNTER_VALUE: return true;
+    case LKDBG_FLOW_NAME:     return true;
+    case LKDBG_ALLOCATION_SIZE: return true;
+    case LKDBG_ALLOCATION_SITE: return true;
+    case LKDBG_SAMPLE:        return event->sample.depth != 0;
+    default:                  return false;
+    }
+}
+
+void make_chunks(Analysis* analysis)
+{
+    LKDBG_Profile* profile = analysis->profile;
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        const LKDBG_Event* events = profile->events + thread->first_event;
+        const LKDBG_Event* end = events + thread->event_count;
+
+        const LKDBG_Event* begin = events;
+        while (begin < end)
+        {
+            const LKDBG_Event* split = (LK_U64)(end - begin) > CHUNK_SIZE ? begin + CHUNK_SIZE : end;
+            while (split < end && continues_previous_event(split))
+                split++;
+
+            Chunk chunk;
+            chunk.thread = i;
+            chunk.begin = begin;
+            chunk.end = split;
+            analysis->chunks.push_back(std::move(chunk));
+
+            begin = split;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Context switches
+////////////////////////////////////////////////////////////////////////////////
+
+void find_cpu_time(Analysis* analysis)
+{
+    std::vector<std::vector<LKDBG_Context_Switch>> found(analysis->chunks.size());
+    parallel_for(analysis->worker_count, analysis->chunks.size(), [&](LK_U64 i)
+    {
+        Chunk* chunk = &analysis->chunks[i];
+        for (const LKDBG_Event* event = chunk->begin; event < chunk->end; event++)
+            if (event->kind == LKDBG_CONTEXT_SWITCH)
+                found[i].push_back(event->context_switch);
+    });
+
+    std::vector<LKDBG_Context_Switch> switches;
+    for (auto& list : found)
+        switches.insert(switches.end(), list.begin(), list.end());
+    if (switches.empty()) return;
+
+    analysis->has_context_switches = true;
+    std::stable_sort(switches.begin(), switches.end(), [](const LKDBG_Context_Switch& a, const LKDBG_Context_Switch& b)
+    {
+        return a.time < b.time;
+    });
+
+    // a switch starts its thread running on that processor, until the next switch on the same processor
+    struct Running { LK_U32 thread_id = 0; LK_U64 since = 0; bool active = false; };
+    std::vector<Running> processors(256);
+
+    auto close = [&](Running* running, LK_U64 time)
+    {
+        if (!running->active || !running->thread_id) return;
+        Cpu_Time* cpu = &analysis->cpu_time[running->thread_id];
+        cpu->starts.push_back(running->since);
+        cpu->ends.push_back(time);
+    };
+
+    for (auto& context_switch : switches)
+    {
+        Running* running = &processors[context_switch.processor];
+        close(running, context_switch.time);
+        running->thread_id = context_switch.thread_id;
+        running->since = context_switch.time;
+        running->active = true;
+    }
+
+    LK_U64 last_time = switches.back().time;
+    for (auto& running : processors)
+        close(&running, last_time);
+
+    for (auto& entry : analysis->cpu_time)
+    {
+        Cpu_Time* cpu = &entry.second;
+
+        std::vector<LK_U64> order(cpu->starts.size());
+        for (LK_U64 i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](LK_U64 a, LK_U64 b) { return cpu->starts[a] < cpu->starts[b]; });
+
+        std::vector<LK_U64> starts, ends;
+        for (LK_U64 i : order)
+        {
+            starts.push_back(cpu->starts[i]);
+            ends.push_back(cpu->ends[i]);
+        }
+        cpu->starts.swap(starts);
+        cpu->ends.swap(ends);
+
+        cpu->before.resize(cpu->starts.size());
+        LK_U64 total = 0;
+        for (LK_U64 i = 0; i < cpu->starts.size(); i++)
+        {
+            cpu->before[i] = total;
+            total += cpu->ends[i] - cpu->starts[i];
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Chunk pass
+////////////////////////////////////////////////////////////////////////////////
+
+LK_U32 folded_child(Chunk* chunk, LK_U32 parent, const void* name, LK_U64 orphan_ends)
+{
+    if (parent == NO_NODE)
+    {
+        auto found = chunk->folded_roots.find(orphan_ends);
+        if (found != chunk->folded_roots.end()) return found->second;
+
+        LK_U32 id = (LK_U32) chunk->folded.size();
+        chunk->folded.push_back({ NO_NODE, 0, orphan_ends, 0 });
+        chunk->folded_roots[orphan_ends] = id;
+        return id;
+    }
+
+    auto key = std::make_pair(parent, name);
+    auto found = chunk->folded_children.find(key);
+    if (found != chunk->folded_children.end()) return found->second;
+
+    LK_U32 id = (LK_U32) chunk->folded.size();
+    chunk->folded.push_back({ parent, name, 0, 0 });
+    chunk->folded_children[key] = id;
+    return id;
+}
+
+void analyze_chunk(Analysis* analysis, Chunk* chunk)
+{
+    LKDBG_Profile* profile = analysis->profile;
+    bool folded = analysis->report == REPORT_FOLDED;
+
+    LK_U64 orphan_ends = 0;
+    Carried_Op op = {};
+
+    for (const LKDBG_Event* event = chunk->begin; event < chunk->end; event++)
+    {
+        LK_U64 index = chunk->pushed_events;
+        if (lkdbg_is_pushed_event(event))
+            chunk->pushed_events++;
+
+        switch (event->kind)
+        {
+        case LKDBG_BLOCK:
+        {
+            const LKDBG_Block* block = &event->block;
+            if (block->begin)
+            {
+                Open_Block open;
+                open.name = block->name;
+                open.begin = block->time;
+                open.begin_index = index;
+                open.child = 0;
+                open.folded_node = NO_NODE;
+                open.alloc_count = 0;
+                open.alloc_bytes = 0;
+                if (folded)
+                {
+                    LK_U32 parent = chunk->open.empty() ? folded_child(chunk, NO_NODE, 0, orphan_ends) : chunk->open.back().folded_node;
+                    open.folded_node = folded_child(chunk, parent, block->name, 0);
+                }
+                chunk->open.push_back(open);
+                break;
+            }
+
+            if (chunk->open.empty())
+            {
+                // began before this chunk, the stitching pass knows when
+                op.end_time = block->time;
+                op.end_index = index;
+                op.ends = true;
+                chunk->carried.push_back(op);
+                op = {};
+                orphan_ends++;
+                break;
+            }
+
+            Open_Block open = chunk->open.back();
+            chunk->open.pop_back();
+
+            LK_U64 duration = block_duration(analysis, open.begin, open.begin_index, block->time, index);
+            Block_Stats* stats = &chunk->blocks[open.name];
+            stats->count++;
+            stats->inclusive += duration;
+            stats->exclusive += exclusive_duration(duration, open.child);
+            stats->alloc_count += open.alloc_count;
+            stats->alloc_bytes += open.alloc_bytes;
+            if (analysis->has_context_switches)
+                stats->off_cpu += off_cpu_time(analysis, chunk->thread, open.begin, block->time);
+            if (folded)
+                chunk->folded[open.folded_node].weight += exclusive_duration(duration, open.child);
+
+            if (chunk->open.empty())
+            {
+                op.child += duration;
+                op.alloc_count += open.alloc_count;
+                op.alloc_bytes += open.alloc_bytes;
+            }
+            else
+            {
+                chunk->open.back().child += duration;
+                chunk->open.back().alloc_count += open.alloc_count;
+                chunk->open.back().alloc_bytes += open.alloc_bytes;
+            }
+        } break;
+
+        case LKDBG_ALLOCATION:
+        case LKDBG_DEALLOCATION:
+        {
+            Memory_Point point;
+            point.time = event->allocation.time;
+            point.address = event->allocation.address;
+            point.size = 0;
+            point.site = 0;
+            point.memory_class = event->allocation.memory_class;
+            point.allocation = event->kind == LKDBG_ALLOCATION;
+            if (!point.allocation)
+            {
+                if (analysis->report == REPORT_MEMORY)
+                    chunk->memory.push_back(point);
+                break;
+            }
+
+            lkdbg_profile_allocation(profile, chunk->thread, event, &point.size, &point.site);
+            if (analysis->report == REPORT_MEMORY)
+                chunk->memory.push_back(point);
+            if (point.memory_class == LKDBG_MEMORY_PAGES)
+                break;
+
+            if (chunk->open.empty())
+            {
+                op.alloc_count++;
+                op.alloc_bytes += point.size;
+            }
+            else
+            {
+                chunk->open.back().alloc_count++;
+                chunk->open.back().alloc_bytes += point.size;
+            }
+        } break;
+
+        case LKDBG_SAMPLE:
+        {
+            if (analysis->report != REPORT_SAMPLES || event->sample.depth != 0) break;
+
+            LK_U64 addresses[LKDBG_MAX_SAMPLE_DEPTH];
+            LK_U64 depth = lkdbg_profile_sample_stack(profile, chunk->thread, event, addresses, LKDBG_MAX_SAMPLE_DEPTH);
+            chunk->samples[std::vector<LK_U64>(addresses, addresses + depth)]++;
+        } break;
+
+        case LKDBG_FLOW:
+        {
+            if (analysis->report != REPORT_FLOWS) break;
+
+            Flow_Point point;
+            point.id = event->flow.id;
+            point.time = event->flow.time;
+            point.phase = event->flow.phase;
+            point.name = point.phase == LKDBG_FLOW_PHASE_BEGIN ? lkdbg_profile_flow_name(profile, chunk->thread, event) : 0;
+            chunk->flows.push_back(point);
+        } break;
+
+        case LKDBG_LOCK:
+        {
+            if (analysis->report != REPORT_LOCKS) break;
+
+            Lock_Point point;
+            point.thread = chunk->thread;
+            point.time = event->lock.time;
+            point.name = event->lock.name;
+            point.phase = event->lock.phase;
+            chunk->locks.push_back(point);
+        } break;
+        }
+    }
+
+    if (op.child || op.alloc_count)
+        chunk->carried.push_back(op);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Stitching
+////////////////////////////////////////////////////////////////////////////////
+
+std::string folded_path(LKDBG_Profile* profile, const std::vector<Open_Block>& stack, LK_U64 depth)
+{
+    std::string path;
+    for (LK_U64 i = 0; i < depth && i < stack.size(); i++)
+    {
+        if (i) path += ';';
+        path += lkdbg_profile_string(profile, stack[i].name);
+    }
+    return path;
+}
+
+// Goes through each thread's chunks in order, keeping the stack of blocks that are open across chunks.
+void stitch_chunks(Analysis* analysis)
+{
+    LKDBG_Profile* profile = analysis->profile;
+    analysis->thread_blocks.resize(profile->header->thread_count);
+
+    std::vector<Open_Block> stack;
+    LK_U64 current_thread = (LK_U64) -1;
+    LK_U64 pushed_before = 0; // pushed events in the thread's earlier chunks
+
+    for (auto& chunk : analysis->chunks)
+    {
+        if (chunk.thread != current_thread)
+        {
+            stack.clear();
+            current_thread = chunk.thread;
+            pushed_before = 0;
+        }
+
+        auto* blocks = &analysis->thread_blocks[chunk.thread];
+        for (auto& entry : chunk.blocks)
+        {
+            Block_Stats* stats = &(*blocks)[entry.first];
+            stats->count     += entry.second.count;
+            stats->inclusive += entry.second.inclusive;
+            stats->exclusive += entry.second.exclusive;
+            stats->off_cpu   += entry.second.off_cpu;
+            stats->alloc_count += entry.second.alloc_count;
+            stats->alloc_bytes += entry.second.alloc_bytes;
+        }
+
+        if (analysis->report == REPORT_FOLDED)
+        {
+            for (auto& node : chunk.folded)
+            {
+                if (!node.weight) continue;
+
+                std::vector<const void*> names;
+                const Folded_Node* walk = &node;
+                while (walk->parent != NO_NODE)
+                {
+                    names.push_back(walk->name);
+                    walk = &chunk.folded[walk->parent];
+                }
+
+                LK_U64 carried_depth = walk->orphan_ends < stack.size() ? stack.size() - walk->orphan_ends : 0;
+                std::string path = folded_path(profile, stack, carried_depth);
+                for (LK_U64 i = names.size(); i-- > 0;)
+                {
+                    if (!path.empty()) path += ';';
+                    path += lkdbg_profile_string(profile, names[i]);
+                }
+                analysis->folded[path] += node.weight;
+            }
+        }
+
+        for (auto& op : chunk.carried)
+        {
+            if (stack.empty()) continue; // unbalanced, or began before the profile (flight recorder)
+
+            stack.back().child += op.child;
+            stack.back().alloc_count += op.alloc_count;
+            stack.back().alloc_bytes += op.alloc_bytes;
+            if (!op.ends) continue;
+
+            Open_Block open = stack.back();
+            LK_U64 duration = block_duration(analysis, open.begin, open.begin_index, op.end_time, pushed_before + op.end_index);
+
+            Block_Stats* stats = &(*blocks)[open.name];
+            stats->count++;
+            stats->inclusive += duration;
+            stats->exclusive += exclusive_duration(duration, open.child);
+            stats->alloc_count += open.alloc_count;
+            stats->alloc_bytes += open.alloc_bytes;
+            if (analysis->has_context_switches)
+                stats->off_cpu += off_cpu_time(analysis, chunk.thread, open.begin, op.end_time);
+            if (analysis->report == REPORT_FOLDED)
+                analysis->folded[folded_path(profile, stack, stack.size())] += exclusive_duration(duration, open.child);
+
+            stack.pop_back();
+            if (!stack.empty())
+            {
+                stack.back().child += duration;
+                stack.back().alloc_count += open.alloc_count;
+                stack.back().alloc_bytes += open.alloc_bytes;
+            }
+        }
+
+        for (auto& open : chunk.open)
+        {
+            stack.push_back(open);
+            stack.back().begin_index += pushed_before;
+        }
+        pushed_before += chunk.pushed_events;
+
+        for (auto& entry : chunk.samples)
+            analysis->samples[entry.first] += entry.second;
+        analysis->flows.insert(analysis->flows.end(), chunk.flows.begin(), chunk.flows.end());
+        analysis->memory.insert(analysis->memory.end(), chunk.memory.begin(), chunk.memory.end());
+        analysis->locks.insert(analysis->locks.end(), chunk.locks.begin(), chunk.locks.end());
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reports
+////////////////////////////////////////////////////////////////////////////////
+
+void print_block_table(Analysis* analysis, const std::unordered_map<const void*, Block_Stats>& blocks, bool by_exclusive)
+{
+    LK_U64 frequency = analysis->profile->header->time_frequency;
+
+    std::vector<std::pair<const void*, Block_Stats>> rows(blocks.begin(), blocks.end());
+    std::sort(rows.begin(), rows.end(), [&](const std::pair<const void*, Block_Stats>& a, const std::pair<const void*, Block_Stats>& b)
+    {
+        if (by_exclusive) return a.second.exclusive > b.second.exclusive;
+        return a.second.inclusive > b.second.inclusive;
+    });
+
+    bool has_allocations = false;
+    for (auto& row : rows)
+        if (row.second.alloc_count) has_allocations = true;
+
+    printf("    %12s %12s %10s %10s ", "inclusive ms", "exclusive ms", "count", "avg us");
+    if (analysis->has_context_switches)
+        printf("%12s ", "off-CPU ms");
+    if (has_allocations)
+        printf("%10s %12s ", "allocs", "alloc KB");
+    printf(" %s\n", "name");
+
+    for (LK_U64 i = 0; i < rows.size() && i < (LK_U64) analysis->top_count; i++)
+    {
+        const Block_Stats* stats = &rows[i].second;
+        const char* name = lkdbg_profile_string(analysis->profile, rows[i].first);
+        double average = stats->count ? to_milliseconds(stats->inclusive, frequency) * 1000.0 / (double) stats->count : 0;
+
+        printf("    %12.3f %12.3f %10llu %10.3f ", to_milliseconds(stats->inclusive, frequency), to_milliseconds(stats->exclusive, frequency),
+               (unsigned long long) stats->count, average);
+        if (analysis->has_context_switches)
+            printf("%12.3f ", to_milliseconds(stats->off_cpu, frequency));
+        if (has_allocations)
+            printf("%10llu %12.1f ", (unsigned long long) stats->alloc_count, (double) stats->alloc_bytes / 1024.0);
+        printf(" %s\n", name);
+    }
+}
+
+void report_top(Analysis* analysis)
+{
+    LKDBG_Profile* profile = analysis->profile;
+
+    std::unordered_map<const void*, Block_Stats> total;
+    for (auto& blocks : analysis->thread_blocks)
+    {
+        for (auto& entry : blocks)
+        {
+            Block_Stats* stats = &total[entry.first];
+            stats->count     += entry.second.count;
+            stats->inclusive += entry.second.inclusive;
+            stats->exclusive += entry.second.exclusive;
+            stats->off_cpu   += entry.second.off_cpu;
+            stats->alloc_count += entry.second.alloc_count;
+            stats->alloc_bytes += entry.second.alloc_bytes;
+        }
+    }
+
+    printf("%llu events on %llu threads\n", (unsigned long long) profile->header->event_count, (unsigned long long) profile->header->thread_count);
+    if (analysis->subtract_overhead)
+        printf("Subtracted %.1f ns of instrumentation overhead per event\n",
+               profile->header->event_overhead * 1e9 / (double) profile->header->time_frequency);
+    printf("\n");
+
+    printf("Top blocks by inclusive time, all threads:\n");
+    print_block_table(analysis, total, false);
+    printf("\nTop blocks by exclusive time, all threads:\n");
+    print_block_table(analysis, total, true);
+
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+    {
+        if (analysis->thread_blocks[i].empty()) continue;
+
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        printf("\nThread %s (%u), by inclusive time:\n", lkdbg_profile_string(profile, thread->name), (unsigned) thread->thread_id);
+        print_block_table(analysis, analysis->thread_blocks[i], false);
+    }
+}
+
+void report_folded(Analysis* analysis)
+{
+    LK_U64 frequency = analysis->profile->header->time_frequency;
+    for (auto& entry : analysis->folded)
+    {
+        LK_U64 ticks = entry.second;
+        LK_U64 nanoseconds = (ticks / frequency) * 1000000000ull + ((ticks % frequency) * 1000000000ull) / frequency;
+        if (nanoseconds)
+            printf("%s %llu\n", entry.first.c_str(), (unsigned long long) nanoseconds);
+    }
+}
+
+void report_samples(Analysis* analysis)
+{
+    // the same function can show up under different addresses, so merge by the folded string
+    std::map<std::string, LK_U64> stacks;
+    for (auto& entry : analysis->samples)
+    {
+        std::string stack;
+        for (LK_U64 i = entry.first.size(); i-- > 0;)
+        {
+            stack += lkdbg_profile_string(analysis->profile, (const void*)(uintptr_t) entry.first[i]);
+            if (i) stack += ';';
+        }
+        stacks[stack] += entry.second;
+    }
+
+    for (auto& entry : stacks)
+        printf("%s %llu\n", entry.first.c_str(), (unsigned long long) entry.second);
+}
+
+double percentile(std::vector<LK_U64>* values, double p)
+{
+    if (values->empty()) return 0;
+    LK_U64 i = (LK_U64)(p * (double)(values->size() - 1) + 0.5);
+    std::nth_element(values->begin(), values->begin() + i, values->end());
+    return (double)(*values)[i];
+}
+
+void report_flows(Analysis* analysis)
+{
+    LK_U64 frequency = analysis->profile->header->time_frequency;
+
+    std::stable_sort(analysis->flows.begin(), analysis->flows.end(), [](const Flow_Point& a, const Flow_Point& b)
+    {
+        return a.time < b.time;
+    });
+
+    struct In_Flight { const void* name; LK_U64 begin; LK_U64 first_step; bool stepped; };
+    struct Flow_Stats { std::vector<LK_U64> waits; std::vector<LK_U64> services; LK_U64 unfinished = 0; };
+
+    std::unordered_map<LK_U64, In_Flight> in_flight;
+    std::map<const void*, Flow_Stats> stats;
+
+    for (auto& point : analysis->flows)
+    {
+        if (point.phase == LKDBG_FLOW_PHASE_BEGIN)
+        {
+            in_flight[point.id] = { point.name, point.time, 0, false };
+            continue;
+        }
+
+        auto found = in_flight.find(point.id);
+        if (found == in_flight.end()) continue; // began before the profile did
+        In_Flight* flow = &found->second;
+
+        if (point.phase == LKDBG_FLOW_PHASE_STEP)
+        {
+            if (!flow->stepped)
+            {
+                flow->first_step = point.time;
+                flow->stepped = true;
+            }
+            continue;
+        }
+
+        // an item that was never picked up spent all its time waiting
+        LK_U64 picked_up = flow->stepped ? flow->first_step : point.time;
+        Flow_Stats* flow_stats = &stats[flow->name];
+        flow_stats->waits.push_back(picked_up - flow->begin);
+        flow_stats->services.push_back(point.time - picked_up);
+        in_flight.erase(found);
+    }
+
+    for (auto& entry : in_flight)
+        stats[entry.second.name].unfinished++;
+
+    printf("%-32s %10s %10s %10s %10s %10s %10s %10s %10s\n", "flow", "count", "wait avg", "wait p50", "wait p99",
+           "serv avg", "serv p50", "serv p99", "unfinished");
+    for (auto& entry : stats)
+    {
+        Flow_Stats* flow_stats = &entry.second;
+        LK_U64 count = flow_stats->waits.size();
+
+        double wait_total = 0, service_total = 0;
+        for (LK_U64 i = 0; i < count; i++)
+        {
+            wait_total += (double) flow_stats->waits[i];
+            service_total += (double) flow_stats->services[i];
+        }
+
+        double scale = 1000.0 / (double) frequency;
+        printf("%-32s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10llu\n",
+               entry.first ? lkdbg_profile_string(analysis->profile, entry.first) : "?", (unsigned long long) count,
+               count ? wait_total / (double) count * scale : 0,
+               percentile(&flow_stats->waits, 0.5) * scale,
+               percentile(&flow_stats->waits, 0.99) * scale,
+               count ? service_total / (double) count * scale : 0,
+               percentile(&flow_stats->services, 0.5) * scale,
+               percentile(&flow_stats->services, 0.99) * scale,
+               (unsigned long long) flow_stats->unfinished);
+    }
+    printf("(times in ms)\n");
+}
+
+const char* memory_class_name(int memory_class)
+{
+    switch (memory_class)
+    {
+    case LKDBG_MEMORY_HEAP:   return "heap";
+    case LKDBG_MEMORY_PAGES:  return "pages";
+    case LKDBG_MEMORY_REGION: return "region";
+    default:                  return "?";
+    }
+}
+
+// Region allocations live inside pages that were reported on their own, and are never freed
+// individually, so live memory doesn't count them, and allocation sites don't count the pages.
+void report_memory(Analysis* analysis)
+{
+    LK_U64 frequency = analysis->profile->header->time_frequency;
+    std::vector<Memory_Point>* points = &analysis->memory;
+    if (points->empty())
+    {
+        printf("No allocation events in this profile.\n");
+        return;
+    }
+
+    std::stable_sort(points->begin(), points->end(), [](const Memory_Point& a, const Memory_Point& b)
+    {
+        return a.time < b.time;
+    });
+
+    struct Totals { LK_U64 count = 0; LK_U64 bytes = 0; };
+    std::map<int, Totals> by_class;
+    std::map<const void*, Totals> by_site;
+    std::unordered_map<LK_U64, LK_U64> live_sizes;
+
+    LK_U64 rows = analysis->top_count > 0 ? (LK_U64) analysis->top_count : 1;
+    LK_U64 first_time = points->front().time;
+    LK_U64 span = points->back().time - first_time + 1;
+
+    struct Row { LK_U64 live = 0; LK_U64 peak = 0; };
+    std::vector<Row> curve(rows);
+
+    LK_U64 live = 0, peak = 0, peak_time = first_time, leaked_count = 0;
+    for (auto& point : *points)
+    {
+        if (point.allocation)
+        {
+            by_class[point.memory_class].count++;
+            by_class[point.memory_class].bytes += point.size;
+            if (point.memory_class != LKDBG_MEMORY_PAGES)
+            {
+                by_site[point.site].count++;
+                by_site[point.site].bytes += point.size;
+            }
+
+            if (point.memory_class != LKDBG_MEMORY_REGION)
+            {
+                live_sizes[point.address] = point.size;
+                live += point.size;
+            }
+        }
+        else
+        {
+            auto found = live_sizes.find(point.address);
+            if (found == live_sizes.end()) continue; // allocated before the profile began
+            live -= found->second;
+            live_sizes.erase(found);
+        }
+
+        if (live > peak)
+        {
+            peak = live;
+            peak_time = point.time;
+        }
+
+        Row* row = &curve[(point.time - first_time) * rows / span];
+        row->live = live;
+        if (live > row->peak) row->peak = live;
+    }
+    leaked_count = live_sizes.size();
+
+    printf("%10s %12s  %s\n", "allocs", "total KB", "class");
+    for (auto& entry : by_class)
+        printf("%10llu %12.1f  %s\n", (unsigned long long) entry.second.count, (double) entry.second.bytes / 1024.0, memory_class_name(entry.first));
+
+    printf("\nPeak live memory %.1f KB at %.3f ms, %.1f KB in %llu allocations still live at the end\n",
+           (double) peak / 1024.0, to_milliseconds(peak_time - first_time, frequency),
+           (double) live / 1024.0, (unsigned long long) leaked_count);
+
+    printf("\n%10s %12s %12s\n", "until ms", "live KB", "peak KB");
+    LK_U64 last_live = 0;
+    for (LK_U64 i = 0; i < rows; i++)
+    {
+        // a stretch without events keeps the memory it had
+        if (!curve[i].peak)
+            curve[i].live = curve[i].peak = last_live;
+        last_live = curve[i].live;
+
+        printf("%12.3f %12.1f %12.1f\n", to_milliseconds(span * (i + 1) / rows, frequency),
+               (double) curve[i].live / 1024.0, (double) curve[i].peak / 1024.0);
+    }
+
+    std::vector<std::pair<const void*, Totals>> sites(by_site.begin(), by_site.end());
+    std::sort(sites.begin(), sites.end(), [](const std::pair<const void*, Totals>& a, const std::pair<const void*, Totals>& b)
+    {
+        return a.second.bytes > b.second.bytes;
+    });
+
+    printf("\nTop allocation sites by bytes:\n");
+    printf("%10s %12s  %s\n", "allocs", "total KB", "site");
+    for (LK_U64 i = 0; i < sites.size() && i < (LK_U64) analysis->top_count; i++)
+    {
+        const char* name = sites[i].first ? lkdbg_profile_string(analysis->profile, sites[i].first) : "(unnamed)";
+        printf("%10llu %12.1f  %s\n", (unsigned long long) sites[i].second.count, (double) sites[i].second.bytes / 1024.0, name);
+    }
+}
+
+// Lock points are already in order within each thread, which is all the pairing needs.
+// Read locks can be held more than once by the same thread, so acquisitions are kept on a stack.
+void report_locks(Analysis* analysis)
+{
+    LK_U64 frequency = analysis->profile->header->time_frequency;
+    if (analysis->locks.empty())
+    {
+        printf("No lock events in this profile.\n");
+        return;
+    }
+
+    struct Held { LK_U64 wait_begin = 0; bool waiting = false; std::vector<LK_U64> acquired; };
+    struct Lock_Stats
+    {
+        LK_U64 acquisitions = 0;
+        LK_U64 contended = 0;
+        LK_U64 total_wait = 0;
+        LK_U64 max_wait = 0;
+        LK_U64 total_hold = 0;
+        LK_U64 max_hold = 0;
+    };
+
+    std::map<std::pair<LK_U64, const void*>, Held> held;
+    std::unordered_map<const void*, Lock_Stats> stats;
+
+    for (auto& point : analysis->locks)
+    {
+        Held* state = &held[std::make_pair(point.thread, point.name)];
+        Lock_Stats* lock_stats = &stats[point.name];
+        switch (point.phase)
+        {
+        case LKDBG_LOCK_PHASE_WAIT:
+        {
+            state->wait_begin = point.time;
+            state->waiting = true;
+        } break;
+
+        case LKDBG_LOCK_PHASE_ACQUIRED:
+        {
+            lock_stats->acquisitions++;
+            if (state->waiting)
+            {
+                LK_U64 wait = point.time - state->wait_begin;
+                lock_stats->contended++;
+                lock_stats->total_wait += wait;
+                if (wait > lock_stats->max_wait) lock_stats->max_wait = wait;
+                state->waiting = false;
+            }
+            state->acquired.push_back(point.time);
+        } break;
+
+        case LKDBG_LOCK_PHASE_RELEASED:
+        {
+            if (state->acquired.empty()) break; // acquired before the profile began
+            LK_U64 hold = point.time - state->acquired.back();
+            state->acquired.pop_back();
+            lock_stats->total_hold += hold;
+            if (hold > lock_stats->max_hold) lock_stats->max_hold = hold;
+        } break;
+        }
+    }
+
+    std::vector<std::pair<const void*, Lock_Stats>> rows(stats.begin(), stats.end());
+    std::sort(rows.begin(), rows.end(), [](const std::pair<const void*, Lock_Stats>& a, const std::pair<const void*, Lock_Stats>& b)
+    {
+        if (a.second.total_wait != b.second.total_wait) return a.second.total_wait > b.second.total_wait;
+        return a.second.total_hold > b.second.total_hold;
+    });
+
+    printf("%-32s %10s %10s %8s %12s %10s %12s %10s\n", "lock", "acquired", "contended", "%", "wait total",
+           "wait max", "hold total", "hold max");
+    for (LK_U64 i = 0; i < rows.size() && i < (LK_U64) analysis->top_count; i++)
+    {
+        Lock_Stats* lock_stats = &rows[i].second;
+        printf("%-32s %10llu %10llu %7.1f%% %12.3f %10.3f %12.3f %10.3f\n",
+               rows[i].first ? lkdbg_profile_string(analysis->profile, rows[i].first) : "?",
+               (unsigned long long) lock_stats->acquisitions, (unsigned long long) lock_stats->contended,
+               lock_stats->acquisitions ? 100.0 * (double) lock_stats->contended / (double) lock_stats->acquisitions : 0,
+               to_milliseconds(lock_stats->total_wait, frequency), to_milliseconds(lock_stats->max_wait, frequency),
+               to_milliseconds(lock_stats->total_hold, frequency), to_milliseconds(lock_stats->max_hold, frequency));
+    }
+    printf("(times in ms)\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    Analysis analysis;
+    analysis.report = REPORT_TOP;
+    analysis.worker_count = (int) std::thread::hardware_concurrency();
+
+    const char* profile_path = 0;
+    const char* report = "top";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            analysis.top_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            analysis.worker_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o"))
+            analysis.subtract_overhead = true;
+        else if (!profile_path)
+            profile_path = argv[i];
+        else
+            report = argv[i];
+    }
+
+    if (!profile_path)
+    {
+        printf("Usage: lk_debug_analyze [-n rows] [-j threads] [-o] profile.lkdbg [top|folded|samples|flows|memory|locks]\n");
+        exit(1);
+    }
+
+    if      (!strcmp(report, "top"))     analysis.report = REPORT_TOP;
+    else if (!strcmp(report, "folded"))  analysis.report = REPORT_FOLDED;
+    else if (!strcmp(report, "samples")) analysis.report = REPORT_SAMPLES;
+    else if (!strcmp(report, "flows"))   analysis.report = REPORT_FLOWS;
+    else if (!strcmp(report, "memory"))  analysis.report = REPORT_MEMORY;
+    else if (!strcmp(report, "locks"))   analysis.report = REPORT_LOCKS;
+    else
+    {
+        printf("Unknown report '%s', expected top, folded, samples, flows, memory or locks.\n", report);
+        exit(1);
+    }
+
+    if (analysis.worker_count < 1)
+        analysis.worker_count = 1;
+
+    LKDBG_Profile profile;
+    if (!lkdbg_open_profile(&profile, profile_path))
+    {
+        printf("Failed to open profile %s, or it isn't a valid lk_debug profile.\n", profile_path);
+        exit(1);
+    }
+    analysis.profile = &profile;
+
+    make_chunks(&analysis);
+    if (analysis.report == REPORT_TOP)
+        find_cpu_time(&analysis);
+
+    parallel_for(analysis.worker_count, analysis.chunks.size(), [&](LK_U64 i)
+    {
+        analyze_chunk(&analysis, &analysis.chunks[i]);
+    });
+    stitch_chunks(&analysis);
+
+    switch (analysis.report)
+    {
+    case REPORT_TOP:     report_top(&analysis);     break;
+    case REPORT_FOLDED:  report_folded(&analysis);  break;
+    case REPORT_SAMPLES: report_samples(&analysis); break;
+    case REPORT_FLOWS:   report_flows(&analysis);   break;
+    case REPORT_MEMORY:  report_memory(&analysis);  break;
+    case REPORT_LOCKS:   report_locks(&analysis);   break;
+    }
+
+    lkdbg_close_profile(&profile);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,459 @@
+//  lk_debug_diff.cpp - public domain A/B comparison of lk_debug profiles
+//  no warranty is offered or implied
+
+/*********************************************************************************************
+
+Usage:
+    lk_debug_diff [options] before.lkdbg after.lkdbg
+    lk_debug_diff [options] before1.lkdbg before2.lkdbg ... -- after1.lkdbg after2.lkdbg ...
+
+Options:
+    -t PERCENT  smallest slowdown that counts as a regression (default 2)
+    -a ALPHA    significance level (default 0.05, for 95% confidence intervals)
+    -n N        number of rows to print (default 30)
+    -o          subtract the instrumentation overhead measured when each profile was recorded from block times,
+                which makes profiles from different machines comparable
+    --names     match blocks by name only, instead of by their whole call path
+
+Blocks are matched between the two sides by call path ("main;update;physics"), so the same function called
+from two places is compared separately. All runs given for a side are pooled together.
+
+For every block, the mean inclusive time of one call is compared with Welch's t-test. The delta and its
+confidence interval are given as a percentage of the mean before. A block is a regression when the
+whole confidence interval is above zero and the delta is at least the threshold.
+
+Give at least two runs per side when you can. Calls within one run share that run's noise (clock speed,
+other processes, cache state), so with multiple runs each run's mean is one sample, and the test sees
+how much runs vary. With a single run per side, each call is a sample, which is more sensitive but
+will also flag differences that are just one run being luckier than the other.
+
+Exit code is 0 if there are no regressions, 1 if there are, and 2 if something went wrong, so it can be
+used to fail a build. Running time and memory don't depend on the number of calls, only on the number
+of distinct call paths.
+
+ *********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define LKDBG_READER_IMPLEMENTATION
+#include "lk_debug.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+// Running mean and variance (Welford), in nanoseconds.
+struct Stats
+{
+    double count = 0;
+    double mean = 0;
+    double m2 = 0;
+};
+
+void stats_add(Stats* stats, double value)
+{
+    stats->count += 1;
+    double delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+}
+
+void stats_merge(Stats* into, const Stats* from)
+{
+    if (!from->count) return;
+    double count = into->count + from->count;
+    double delta = from->mean - into->mean;
+    into->mean += delta * from->count / count;
+    into->m2 += from->m2 + delta * delta * into->count * from->count / count;
+    into->count = count;
+}
+
+double stats_variance(const Stats* stats)
+{
+    return stats->count > 1 ? stats->m2 / (stats->count - 1) : 0;
+}
+
+struct Options
+{
+    double threshold = 2;
+    double alpha = 0.05;
+    int rows = 30;
+    bool names_only = false;
+    bool subtract_overhead = false;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Student's t distribution
+////////////////////////////////////////////////////////////////////////////////
+
+// Continued fraction for the regularized incomplete beta function (Numerical Recipes, betacf).
+double incomplete_beta_fraction(double a, double b, double x)
+{
+    const double tiny = 1e-300;
+    double qab = a + b, qap = a + 1, qam = a - 1;
+    double c = 1, d = 1 - qab * x / qap;
+    if (fabs(d) < tiny) d = tiny;
+    d = 1 / d;
+    double h = d;
+
+    for (int m = 1; m <= 300; m++)
+    {
+        int m2 = 2 * m;
+        double aa = m * (b - m) * x / ((qam + m2) * (a + m2));
+        d = 1 + aa * d; if (fabs(d) < tiny) d = tiny;
+        c = 1 + aa / c; if (fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        h *= d * c;
+
+        aa = -(a + m) * (qab + m) * x / ((a + m2) * (qap + m2));
+        d = 1 + aa * d; if (fabs(d) < tiny) d = tiny;
+        c = 1 + aa / c; if (fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        double delta = d * c;
+        h *= delta;
+        if (fabs(delta - 1) < 1e-12) break;
+    }
+    return h;
+}
+
+double incomplete_beta(double a, double b, double x)
+{
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+    if (x < (a + 1) / (a + b + 2))
+        return front * incomplete_beta_fraction(a, b, x) / a;
+    return 1 - front * incomplete_beta_fraction(b, a, 1 - x) / b;
+}
+
+// Probability that |T| >= t for T with 'df' degrees of freedom.
+double t_two_sided_p(double t, double df)
+{
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+double t_critical(double alpha, double df)
+{
+    double low = 0, high = 1000;
+    for (int i = 0; i < 100; i++)
+    {
+        double middle = (low + high) / 2;
+        if (t_two_sided_p(middle, df) > alpha) low = middle;
+        else high = middle;
+    }
+    return high;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reading profiles
+////////////////////////////////////////////////////////////////////////////////
+
+struct Path_Node
+{
+    LK_U32 parent;
+    const void* name;
+    Stats stats;
+};
+
+#define NO_NODE ((LK_U32) -1)
+
+// Per block, all calls pooled together, and one sample per run with that run's mean.
+struct Side_Block
+{
+    Stats calls;
+    Stats runs;
+};
+
+// Adds every block in the profile to 'side', keyed by call path (or just the name).
+bool read_profile(const char* path, const Options* options, std::map<std::string, Side_Block>* side)
+{
+    LKDBG_Profile profile;
+    if (!lkdbg_open_profile(&profile, path))
+    {
+        printf("Failed to open profile %s, or it isn't a valid lk_debug profile.\n", path);
+        return false;
+    }
+
+    LK_U64 frequency = profile.header->time_frequency;
+
+    // names are pointers that only mean something within this profile, so paths are a trie of pointers
+    // until the end, where they're turned into strings that can be matched between profiles
+    std::vector<Path_Node> nodes;
+    std::map<std::pair<LK_U32, const void*>, LK_U32> children;
+
+    struct Open { LK_U32 node; LK_U64 begin; LK_U64 begin_index; };
+    std::vector<Open> stack;
+
+    for (LK_U64 i = 0; i < profile.header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile.threads[i];
+        const LKDBG_Event* events = profile.events + thread->first_event;
+        stack.clear();
+        LK_U64 pushed_events = 0;
+
+        for (LK_U64 j = 0; j < thread->event_count; j++)
+        {
+            LK_U64 index = pushed_events;
+            if (lkdbg_is_pushed_event(&events[j])) pushed_events++;
+            if (events[j].kind != LKDBG_BLOCK) continue;
+            const LKDBG_Block* block = &events[j].block;
+
+            if (block->begin)
+            {
+                LK_U32 parent = (stack.empty() || options->names_only) ? NO_NODE : stack.back().node;
+                auto key = std::make_pair(parent, (const void*) block->name);
+                auto found = children.find(key);
+
+                LK_U32 node;
+                if (found != children.end())
+                {
+                    node = found->second;
+                }
+                else
+                {
+                    node = (LK_U32) nodes.size();
+                    nodes.push_back({ parent, block->name, Stats() });
+                    children[key] = node;
+                }
+
+                stack.push_back({ node, block->time, index });
+                continue;
+            }
+
+            if (stack.empty()) continue;
+            Open open = stack.back();
+            stack.pop_back();
+
+            LK_U64 ticks = block->time - open.begin;
+            if (options->subtract_overhead)
+                ticks = lkdbg_subtract_overhead(ticks, index - open.begin_index, profile.header->event_overhead);
+            double nanoseconds = (double) ticks * 1e9 / (double) frequency;
+            stats_add(&nodes[open.node].stats, nanoseconds);
+        }
+    }
+
+    std::map<std::string, Stats> run;
+    for (auto& node : nodes)
+    {
+        std::vector<const void*> names;
+        for (const Path_Node* walk = &node; ; walk = &nodes[walk->parent])
+        {
+            names.push_back(walk->name);
+            if (walk->parent == NO_NODE) break;
+        }
+
+        std::string key;
+        for (LK_U64 i = names.size(); i-- > 0;)
+        {
+            key += lkdbg_profile_string(&profile, names[i]);
+            if (i) key += ';';
+        }
+        stats_merge(&run[key], &node.stats);
+    }
+
+    for (auto& entry : run)
+    {
+        Side_Block* block = &(*side)[entry.first];
+        stats_merge(&block->calls, &entry.second);
+        stats_add(&block->runs, entry.second.mean);
+    }
+
+    lkdbg_close_profile(&profile);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Comparison
+////////////////////////////////////////////////////////////////////////////////
+
+struct Row
+{
+    std::string path;
+    Side_Block before;
+    Side_Block after;
+    double delta;      // percent of the mean before
+    double low, high;  // confidence interval of 'delta'
+    double p;
+    bool comparable;   // enough calls on both sides for a test
+    bool regression;
+    double before_mean, after_mean;  // of whatever was tested
+    double impact;     // change in total time per run, for sorting
+};
+
+double total_per_run(const Side_Block* block)
+{
+    return block->runs.count ? block->calls.mean * block->calls.count / block->runs.count : 0;
+}
+
+void compare(Row* row, const Options* options)
+{
+    // test on runs if both sides have enough of them, otherwise on calls
+    bool by_runs = row->before.runs.count >= 2 && row->after.runs.count >= 2;
+    const Stats* a = by_runs ? &row->before.runs : &row->before.calls;
+    const Stats* b = by_runs ? &row->after.runs : &row->after.calls;
+
+    row->before_mean = a->mean;
+    row->after_mean = b->mean;
+    row->comparable = a->count >= 2 && b->count >= 2 && a->mean > 0;
+    row->delta = a->mean > 0 ? (b->mean - a->mean) / a->mean * 100 : 0;
+    row->low = row->high = row->delta;
+    row->p = 1;
+    row->regression = false;
+    row->impact = total_per_run(&row->after) - total_per_run(&row->before);
+    if (!row->comparable) return;
+
+    double va = stats_variance(a) / a->count;
+    double vb = stats_variance(b) / b->count;
+    double se = sqrt(va + vb);
+    double difference = b->mean - a->mean;
+
+    if (se <= 0)
+    {
+        row->p = difference == 0 ? 1 : 0;
+    }
+    else
+    {
+        double df = (va + vb) * (va + vb) / (va * va / (a->count - 1) + vb * vb / (b->count - 1));
+        double t = difference / se;
+        row->p = t_two_sided_p(t, df);
+
+        double margin = t_critical(options->alpha, df) * se;
+        row->low = (difference - margin) / a->mean * 100;
+        row->high = (difference + margin) / a->mean * 100;
+    }
+
+    row->regression = row->low > 0 && row->delta >= options->threshold;
+}
+
+void print_row(const Row* row)
+{
+    if (!row->before.calls.count)
+    {
+        printf("  %12s %12.3f %10s %8s %23s  %s (new)\n", "", row->after.calls.mean / 1000, "", "", "", row->path.c_str());
+        return;
+    }
+    if (!row->after.calls.count)
+    {
+        printf("  %12.3f %12s %10s %8s %23s  %s (gone)\n", row->before.calls.mean / 1000, "", "", "", "", row->path.c_str());
+        return;
+    }
+
+    char interval[64] = "";
+    if (row->comparable)
+        snprintf(interval, sizeof(interval), "[%+.1f%%, %+.1f%%]", row->low, row->high);
+
+    printf("%s %12.3f %12.3f %+9.1f%% %8.4f %23s  %s\n", row->regression ? "!" : " ", row->before_mean / 1000, row->after_mean / 1000,
+           row->delta, row->p, interval, row->path.c_str());
+}
+
+
+int main(int argc, char** argv)
+{
+    Options options;
+    std::vector<const char*> before_paths;
+    std::vector<const char*> after_paths;
+    std::vector<const char*> paths;
+    bool separated = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            options.threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc)
+            options.alpha = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            options.rows = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o"))
+            options.subtract_overhead = true;
+        else if (!strcmp(argv[i], "--names"))
+            options.names_only = true;
+        else if (!strcmp(argv[i], "--"))
+        {
+            before_paths = paths;
+            paths.clear();
+            separated = true;
+        }
+        else
+            paths.push_back(argv[i]);
+    }
+
+    if (separated)
+    {
+        after_paths = paths;
+    }
+    else if (paths.size() == 2)
+    {
+        before_paths.push_back(paths[0]);
+        after_paths.push_back(paths[1]);
+    }
+
+    if (before_paths.empty() || after_paths.empty() || options.alpha <= 0 || options.alpha >= 1)
+    {
+        printf("Usage: lk_debug_diff [-t percent] [-a alpha] [-n rows] [-o] [--names] before.lkdbg after.lkdbg\n");
+        printf("       lk_debug_diff [options] before1.lkdbg before2.lkdbg ... -- after1.lkdbg after2.lkdbg ...\n");
+        exit(2);
+    }
+
+    std::map<std::string, Side_Block> before;
+    std::map<std::string, Side_Block> after;
+    for (const char* path : before_paths)
+        if (!read_profile(path, &options, &before)) exit(2);
+    for (const char* path : after_paths)
+        if (!read_profile(path, &options, &after)) exit(2);
+
+    std::vector<Row> rows;
+    for (auto& entry : before)
+    {
+        Row row;
+        row.path = entry.first;
+        row.before = entry.second;
+        auto found = after.find(entry.first);
+        if (found != after.end())
+            row.after = found->second;
+        rows.push_back(row);
+    }
+    for (auto& entry : after)
+    {
+        if (before.count(entry.first)) continue;
+        Row row;
+        row.path = entry.first;
+        row.after = entry.second;
+        rows.push_back(row);
+    }
+
+    int regressions = 0;
+    for (auto& row : rows)
+    {
+        compare(&row, &options);
+        if (row.regression) regressions++;
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b)
+    {
+        if (a.regression != b.regression) return a.regression;
+        return fabs(a.impact) > fabs(b.impact);
+    });
+
+    printf("%d before, %d after, %.0f%% confidence, regressions are slower by %.1f%% or more\n\n",
+           (int) before_paths.size(), (int) after_paths.size(), (1 - options.alpha) * 100, options.threshold);
+    printf("  %12s %12s %10s %8s %23s  %s\n", "before us", "after us", "delta", "p", "confidence interval", "block");
+    for (LK_U64 i = 0; i < rows.size() && i < (LK_U64) options.rows; i++)
+        print_row(&rows[i]);
+
+    if (regressions)
+    {
+        printf("\n%d regression%s (marked with !)\n", regressions, regressions == 1 ? "" : "s");
+        return 1;
+    }
+
+    printf("\nNo regressions\n");
+    return 0;
+}
@@ -0,0 +1,693 @@
+//  lk_debug_export.cpp - public domain converter from lk_debug profiles to Chrome Trace and Perfetto formats
+//  no warranty is offered or implied
+
+/*********************************************************************************************
+
+Usage:
+    lk_debug_export profile.lkdbg trace.json          writes Chrome Trace Event JSON
+    lk_debug_export profile.lkdbg trace.perfetto      writes a Perfetto protobuf trace
+
+Any output name ending in .json gets JSON, anything else gets protobuf.
+Both open in ui.perfetto.dev, and the JSON also opens in chrome://tracing.
+
+Block begin/end events become slices on a track per thread, named after the thread.
+Performance counter deltas recorded for a block become arguments of its slice.
+Context switch events become CPU scheduling tracks (one track per processor).
+Counters become counter tracks, one per counter name, and marks become instant events on their thread.
+Flow events become arrows between the blocks they're in (JSON) or between instants at each step (Perfetto).
+Stack samples become instant events on the thread's track, named after the sampled function,
+with the whole call stack (outermost function first, separated by ';') as an argument.
+
+The converter streams: events are read from the memory mapped profile in time order and written
+out immediately, so memory use stays bounded no matter how large the profile is.
+
+ *********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LKDBG_READER_IMPLEMENTATION
+#include "lk_debug.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <math.h>
+
+bool ends_with(const char* string, const char* suffix)
+{
+    int length = strlen(string);
+    int suffix_length = strlen(suffix);
+    if (suffix_length > length)
+        return false;
+
+    return !memcmp(string + length - suffix_length, suffix, suffix_length);
+}
+
+LK_U64 to_nanoseconds(LK_U64 time, LK_U64 base_time, LK_U64 frequency)
+{
+    LK_U64 ticks = time - base_time;
+    return (ticks / frequency) * 1000000000ull + ((ticks % frequency) * 1000000000ull) / frequency;
+}
+
+LK_U64 find_base_time(LKDBG_Profile* profile)
+{
+    LK_U64 base_time = (LK_U64) -1;
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        if (!thread->event_count) continue;
+
+        LK_U64 time = lkdbg_get_event_time(&profile->events[thread->first_event]);
+        if (time < base_time)
+            base_time = time;
+    }
+
+    if (base_time == (LK_U64) -1)
+        base_time = 0;
+    return base_time;
+}
+
+const char* find_thread_name(LKDBG_Profile* profile, LK_U32 thread_id)
+{
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+        if (profile->threads[i].thread_id == thread_id)
+            return lkdbg_profile_string(profile, profile->threads[i].name);
+    return 0;
+}
+
+// Folded stack of a sample, outermost function first: "main;update;leaf".
+std::string sample_stack(LKDBG_Profile* profile, LK_U64 thread_index, const LKDBG_Event* sample)
+{
+    LK_U64 addresses[LKDBG_MAX_SAMPLE_DEPTH];
+    LK_U64 depth = lkdbg_profile_sample_stack(profile, thread_index, sample, addresses, LKDBG_MAX_SAMPLE_DEPTH);
+
+    std::string stack;
+    for (LK_U64 i = depth; i-- > 0;)
+    {
+        stack += lkdbg_profile_string(profile, (const void*)(uintptr_t) addresses[i]);
+        if (i) stack += ';';
+    }
+    return stack;
+}
+
+// Context switches only say which thread was switched in, so keep the last one for each processor.
+struct Processor_State
+{
+    bool   active = false;
+    LK_U32 thread_id = 0;
+    LK_U64 since = 0;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Chrome Trace Event JSON
+////////////////////////////////////////////////////////////////////////////////
+
+#define CHROME_CPU_PID 0
+#define CHROME_PROCESS_PID 1
+
+void write_json_string(FILE* out, const char* string)
+{
+    fputc('"', out);
+    for (const char* c = string; *c; c++)
+    {
+        unsigned char ch = (unsigned char) *c;
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(out, "\\u%04x", ch);
+        else
+            fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+void write_json_time(FILE* out, LK_U64 nanoseconds)
+{
+    fprintf(out, "%llu.%03llu", (unsigned long long)(nanoseconds / 1000), (unsigned long long)(nanoseconds % 1000));
+}
+
+void write_json_thread_name(FILE* out, int pid, LK_U64 tid, const char* name)
+{
+    fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%llu,\"args\":{\"name\":", pid, (unsigned long long) tid);
+    write_json_string(out, name);
+    fprintf(out, "}}");
+}
+
+void write_json_cpu_slice(FILE* out, LKDBG_Profile* profile, int processor, Processor_State* state, LK_U64 end, LK_U64 base_time)
+{
+    LK_U64 frequency = profile->header->time_frequency;
+    LK_U64 from = to_nanoseconds(state->since, base_time, frequency);
+    LK_U64 to = to_nanoseconds(end, base_time, frequency);
+
+    char fallback[32];
+    const char* name = find_thread_name(profile, state->thread_id);
+    if (!name || !*name)
+    {
+        sprintf(fallback, "thread %u", (unsigned) state->thread_id);
+        name = fallback;
+    }
+
+    fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"sched\",\"pid\":%d,\"tid\":%d,\"ts\":", CHROME_CPU_PID, processor);
+    write_json_time(out, from);
+    fprintf(out, ",\"dur\":");
+    write_json_time(out, to - from);
+    fprintf(out, ",\"name\":");
+    write_json_string(out, name);
+    fprintf(out, ",\"args\":{\"thread_id\":%u}}", (unsigned) state->thread_id);
+}
+
+void export_json(LKDBG_Profile* profile, FILE* out)
+{
+    LK_U64 frequency = profile->header->time_frequency;
+    LK_U64 base_time = find_base_time(profile);
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"CPUs\"}}", CHROME_CPU_PID);
+    fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"Process\"}}", CHROME_PROCESS_PID);
+
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        write_json_thread_name(out, CHROME_PROCESS_PID, thread->thread_id, lkdbg_profile_string(profile, thread->name));
+    }
+
+    // processors are only named when they first show up, naming all 256 would clutter the trace
+    std::vector<Processor_State> processors(256);
+
+    std::map<LK_U64, const void*> flow_names;
+
+    LK_U64 last_time = base_time;
+
+    LKDBG_Profile_Iterator it;
+    lkdbg_profile_begin(&it, profile, LKDBG_ALL_THREADS, 0, (LK_U64) -1);
+    while (const LKDBG_Event* event = lkdbg_profile_next(&it))
+    {
+        last_time = lkdbg_get_event_time(event);
+
+        if (event->kind == LKDBG_BLOCK)
+        {
+            const LKDBG_Block* block = &event->block;
+            fprintf(out, ",\n{\"ph\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":", block->begin ? "B" : "E", CHROME_PROCESS_PID, (unsigned) profile->threads[it.thread].thread_id);
+            write_json_time(out, to_nanoseconds(block->time, base_time, frequency));
+            fprintf(out, ",\"name\":");
+            write_json_string(out, lkdbg_profile_string(profile, block->name));
+
+            LK_U64 deltas[LKDBG_PERF_COUNTER_COUNT];
+            LK_U32 mask = block->begin ? 0 : lkdbg_profile_perf_counters(profile, it.thread, event, deltas);
+            if (mask)
+            {
+                // args on the end event get merged into the slice's args
+                const char* separator = "";
+                fprintf(out, ",\"args\":{");
+                for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+                {
+                    if (!(mask & (1u << i))) continue;
+                    fprintf(out, "%s\"%s\":%llu", separator, lkdbg_perf_counter_name(i), (unsigned long long) deltas[i]);
+                    separator = ",";
+                }
+                fprintf(out, "}");
+            }
+
+            fprintf(out, "}");
+        }
+        else if (event->kind == LKDBG_COUNTER)
+        {
+            LK_F64 value;
+            if (!lkdbg_profile_counter_value(profile, it.thread, event, &value)) continue;
+            if (!isfinite(value)) value = 0; // JSON has no NaN or infinity
+
+            fprintf(out, ",\n{\"ph\":\"C\",\"pid\":%d,\"tid\":%u,\"ts\":", CHROME_PROCESS_PID, (unsigned) profile->threads[it.thread].thread_id);
+            write_json_time(out, to_nanoseconds(event->counter.time, base_time, frequency));
+            fprintf(out, ",\"name\":");
+            write_json_string(out, lkdbg_profile_string(profile, event->counter.name));
+            fprintf(out, ",\"args\":{\"value\":%.17g}}", value);
+        }
+        else if (event->kind == LKDBG_FLOW)
+        {
+            // every step of a flow needs the name and category it began with
+            const LKDBG_Flow* flow = &event->flow;
+            const char* name = "flow";
+            if (flow->phase == LKDBG_FLOW_PHASE_BEGIN)
+            {
+                if (const void* name_ptr = lkdbg_profile_flow_name(profile, it.thread, event))
+                    flow_names[flow->id] = name_ptr;
+            }
+            auto found = flow_names.find(flow->id);
+            if (found != flow_names.end())
+                name = lkdbg_profile_string(profile, found->second);
+
+            const char* phase = flow->phase == LKDBG_FLOW_PHASE_BEGIN ? "s" : flow->phase == LKDBG_FLOW_PHASE_STEP ? "t" : "f";
+            fprintf(out, ",\n{\"ph\":\"%s\",\"cat\":\"flow\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":%u,\"ts\":", phase, (unsigned long long) flow->id, CHROME_PROCESS_PID, (unsigned) profile->threads[it.thread].thread_id);
+            write_json_time(out, to_nanoseconds(flow->time, base_time, frequency));
+            fprintf(out, ",\"name\":");
+            write_json_string(out, name);
+            fprintf(out, flow->phase == LKDBG_FLOW_PHASE_END ? ",\"bp\":\"e\"}" : "}");
+
+            if (flow->phase == LKDBG_FLOW_PHASE_END)
+                flow_names.erase(flow->id);
+        }
+        else if (event->kind == LKDBG_MARK)
+        {
+            fprintf(out, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"ts\":", CHROME_PROCESS_PID, (unsigned) profile->threads[it.thread].thread_id);
+            write_json_time(out, to_nanoseconds(event->mark.time, base_time, frequency));
+            fprintf(out, ",\"name\":");
+            write_json_string(out, lkdbg_profile_string(profile, event->mark.name));
+            fprintf(out, "}");
+        }
+        else if (event->kind == LKDBG_SAMPLE)
+        {
+            const LKDBG_Sample* sample = &event->sample;
+            if (sample->depth != 0) continue; // deeper frames are read along with the leaf
+
+            fprintf(out, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"ts\":", CHROME_PROCESS_PID, (unsigned) profile->threads[it.thread].thread_id);
+            write_json_time(out, to_nanoseconds(sample->time, base_time, frequency));
+            fprintf(out, ",\"name\":");
+            write_json_string(out, lkdbg_profile_string(profile, (const void*)(uintptr_t) sample->address));
+            fprintf(out, ",\"args\":{\"stack\":");
+            write_json_string(out, sample_stack(profile, it.thread, event).c_str());
+            fprintf(out, "}}");
+        }
+        else if (event->kind == LKDBG_CONTEXT_SWITCH)
+        {
+            const LKDBG_Context_Switch* context_switch = &event->context_switch;
+            Processor_State* state = &processors[context_switch->processor];
+            if (state->active)
+            {
+                write_json_cpu_slice(out, profile, context_switch->processor, state, context_switch->time, base_time);
+            }
+            else
+            {
+                char name[32];
+                sprintf(name, "CPU %d", context_switch->processor);
+                write_json_thread_name(out, CHROME_CPU_PID, context_switch->processor, name);
+            }
+
+            state->active = true;
+            state->thread_id = context_switch->thread_id;
+            state->since = context_switch->time;
+        }
+    }
+    lkdbg_profile_end(&it);
+
+    for (int i = 0; i < 256; i++)
+        if (processors[i].active)
+            write_json_cpu_slice(out, profile, i, &processors[i], last_time, base_time);
+
+    fprintf(out, "\n]}\n");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Perfetto protobuf
+////////////////////////////////////////////////////////////////////////////////
+
+// Just enough of a protobuf encoder to write the messages we need.
+// Field numbers are from perfetto/protos/perfetto/trace/*.proto.
+
+#define PB_VARINT  0
+#define PB_FIXED64 1
+#define PB_BYTES   2
+
+#define TRACE_PACKET                        1
+
+#define PACKET_FTRACE_EVENTS                1
+#define PACKET_TIMESTAMP                    8
+#define PACKET_TRUSTED_PACKET_SEQUENCE_ID  10
+#define PACKET_TRACK_EVENT                 11
+#define PACKET_SEQUENCE_FLAGS              13
+#define PACKET_TRACK_DESCRIPTOR            60
+
+#define SEQ_INCREMENTAL_STATE_CLEARED       1
+
+#define TRACK_DESCRIPTOR_UUID               1
+#define TRACK_DESCRIPTOR_NAME               2
+#define TRACK_DESCRIPTOR_PROCESS            3
+#define TRACK_DESCRIPTOR_THREAD             4
+#define TRACK_DESCRIPTOR_PARENT_UUID        5
+#define TRACK_DESCRIPTOR_COUNTER            8
+
+#define PROCESS_DESCRIPTOR_PID              1
+#define PROCESS_DESCRIPTOR_NAME             6
+
+#define THREAD_DESCRIPTOR_PID               1
+#define THREAD_DESCRIPTOR_TID               2
+#define THREAD_DESCRIPTOR_NAME              5
+
+#define TRACK_EVENT_DEBUG_ANNOTATIONS       4
+#define TRACK_EVENT_TYPE                    9
+#define TRACK_EVENT_TRACK_UUID             11
+#define TRACK_EVENT_NAME                   23
+#define TRACK_EVENT_DOUBLE_COUNTER_VALUE   44
+#define TRACK_EVENT_FLOW_IDS               47 // fixed64
+#define TRACK_EVENT_TERMINATING_FLOW_IDS   48 // fixed64
+
+#define TRACK_EVENT_SLICE_BEGIN             1
+#define TRACK_EVENT_SLICE_END               2
+#define TRACK_EVENT_INSTANT                 3
+#define TRACK_EVENT_COUNTER                 4
+
+#define DEBUG_ANNOTATION_UINT_VALUE         3
+#define DEBUG_ANNOTATION_STRING_VALUE       6
+#define DEBUG_ANNOTATION_NAME              10
+
+#define FTRACE_BUNDLE_CPU                   1
+#define FTRACE_BUNDLE_EVENT                 2
+
+#define FTRACE_EVENT_TIMESTAMP              1
+#define FTRACE_EVENT_PID                    2
+#define FTRACE_EVENT_SCHED_SWITCH           4
+
+#define SCHED_SWITCH_PREV_COMM              1
+#define SCHED_SWITCH_PREV_PID               2
+#define SCHED_SWITCH_PREV_STATE             4
+#define SCHED_SWITCH_NEXT_COMM              5
+#define SCHED_SWITCH_NEXT_PID               6
+
+#define PERFETTO_PID 1
+#define PERFETTO_SEQUENCE_ID 1
+#define PERFETTO_PROCESS_UUID 1
+#define PERFETTO_FIRST_COUNTER_UUID (1ull << 32) // thread tracks are below this
+
+struct Proto
+{
+    std::vector<LK_U8> bytes;
+};
+
+void proto_varint(Proto* proto, LK_U64 value)
+{
+    while (value >= 0x80)
+    {
+        proto->bytes.push_back((LK_U8)(value | 0x80));
+        value >>= 7;
+    }
+    proto->bytes.push_back((LK_U8) value);
+}
+
+void proto_tag(Proto* proto, int field, int wire_type)
+{
+    proto_varint(proto, ((LK_U64) field << 3) | wire_type);
+}
+
+void proto_uint(Proto* proto, int field, LK_U64 value)
+{
+    proto_tag(proto, field, PB_VARINT);
+    proto_varint(proto, value);
+}
+
+void proto_fixed64(Proto* proto, int field, LK_U64 value)
+{
+    proto_tag(proto, field, PB_FIXED64);
+    for (int i = 0; i < 8; i++)
+        proto->bytes.push_back((LK_U8)(value >> (i * 8)));
+}
+
+void proto_double(Proto* proto, int field, double value)
+{
+    LK_U64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    proto_fixed64(proto, field, bits);
+}
+
+void proto_bytes(Proto* proto, int field, const void* data, LK_U64 size)
+{
+    proto_tag(proto, field, PB_BYTES);
+    proto_varint(proto, size);
+    proto->bytes.insert(proto->bytes.end(), (const LK_U8*) data, (const LK_U8*) data + size);
+}
+
+void proto_string(Proto* proto, int field, const char* string)
+{
+    proto_bytes(proto, field, string, strlen(string));
+}
+
+void proto_message(Proto* proto, int field, Proto* message)
+{
+    proto_bytes(proto, field, message->bytes.data(), message->bytes.size());
+}
+
+// Each packet is a separate "packet" field of the top-level Trace message,
+// so they can be written out one by one without ever holding the whole trace.
+void write_packet(FILE* out, Proto* packet)
+{
+    Proto framing;
+    proto_tag(&framing, TRACE_PACKET, PB_BYTES);
+    proto_varint(&framing, packet->bytes.size());
+    fwrite(framing.bytes.data(), 1, framing.bytes.size(), out);
+    fwrite(packet->bytes.data(), 1, packet->bytes.size(), out);
+    packet->bytes.clear();
+}
+
+void write_perfetto_sched_switch(FILE* out, LKDBG_Profile* profile, int processor, Processor_State* state, const LKDBG_Context_Switch* context_switch, LK_U64 nanoseconds)
+{
+    const char* prev_name = state->active ? find_thread_name(profile, state->thread_id) : 0;
+    const char* next_name = find_thread_name(profile, context_switch->thread_id);
+
+    Proto sched_switch;
+    proto_string(&sched_switch, SCHED_SWITCH_PREV_COMM, prev_name ? prev_name : "");
+    proto_uint  (&sched_switch, SCHED_SWITCH_PREV_PID,  state->active ? state->thread_id : 0);
+    proto_uint  (&sched_switch, SCHED_SWITCH_PREV_STATE, 0);
+    proto_string(&sched_switch, SCHED_SWITCH_NEXT_COMM, next_name ? next_name : "");
+    proto_uint  (&sched_switch, SCHED_SWITCH_NEXT_PID,  context_switch->thread_id);
+
+    Proto ftrace_event;
+    proto_uint   (&ftrace_event, FTRACE_EVENT_TIMESTAMP, nanoseconds);
+    proto_uint   (&ftrace_event, FTRACE_EVENT_PID, state->active ? state->thread_id : 0);
+    proto_message(&ftrace_event, FTRACE_EVENT_SCHED_SWITCH, &sched_switch);
+
+    Proto bundle;
+    proto_uint   (&bundle, FTRACE_BUNDLE_CPU, processor);
+    proto_message(&bundle, FTRACE_BUNDLE_EVENT, &ftrace_event);
+
+    Proto packet;
+    proto_message(&packet, PACKET_FTRACE_EVENTS, &bundle);
+    write_packet(out, &packet);
+}
+
+void export_perfetto(LKDBG_Profile* profile, FILE* out)
+{
+    LK_U64 frequency = profile->header->time_frequency;
+    LK_U64 base_time = find_base_time(profile);
+
+    Proto packet;
+
+    {
+        Proto process;
+        proto_uint  (&process, PROCESS_DESCRIPTOR_PID, PERFETTO_PID);
+        proto_string(&process, PROCESS_DESCRIPTOR_NAME, "Process");
+
+        Proto track;
+        proto_uint   (&track, TRACK_DESCRIPTOR_UUID, PERFETTO_PROCESS_UUID);
+        proto_message(&track, TRACK_DESCRIPTOR_PROCESS, &process);
+
+        proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+        proto_uint   (&packet, PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+        proto_message(&packet, PACKET_TRACK_DESCRIPTOR, &track);
+        write_packet(out, &packet);
+    }
+
+    // thread tracks get uuid = thread index + 2, to stay clear of the process track
+    for (LK_U64 i = 0; i < profile->header->thread_count; i++)
+    {
+        const LKDBG_File_Thread* thread = &profile->threads[i];
+        const char* name = lkdbg_profile_string(profile, thread->name);
+
+        Proto thread_descriptor;
+        proto_uint  (&thread_descriptor, THREAD_DESCRIPTOR_PID, PERFETTO_PID);
+        proto_uint  (&thread_descriptor, THREAD_DESCRIPTOR_TID, thread->thread_id);
+        proto_string(&thread_descriptor, THREAD_DESCRIPTOR_NAME, name);
+
+        Proto track;
+        proto_uint   (&track, TRACK_DESCRIPTOR_UUID, i + 2);
+        proto_string (&track, TRACK_DESCRIPTOR_NAME, name);
+        proto_message(&track, TRACK_DESCRIPTOR_THREAD, &thread_descriptor);
+
+        proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+        proto_message(&packet, PACKET_TRACK_DESCRIPTOR, &track);
+        write_packet(out, &packet);
+    }
+
+    std::vector<Processor_State> processors(256);
+
+    // counter tracks are described the first time their counter shows up
+    std::map<const void*, LK_U64> counter_tracks;
+    std::map<LK_U64, const void*> flow_names;
+
+    LKDBG_Profile_Iterator it;
+    lkdbg_profile_begin(&it, profile, LKDBG_ALL_THREADS, 0, (LK_U64) -1);
+    while (const LKDBG_Event* event = lkdbg_profile_next(&it))
+    {
+        LK_U64 nanoseconds = to_nanoseconds(lkdbg_get_event_time(event), base_time, frequency);
+
+        if (event->kind == LKDBG_BLOCK)
+        {
+            const LKDBG_Block* block = &event->block;
+
+            Proto track_event;
+            proto_uint(&track_event, TRACK_EVENT_TYPE, block->begin ? TRACK_EVENT_SLICE_BEGIN : TRACK_EVENT_SLICE_END);
+            proto_uint(&track_event, TRACK_EVENT_TRACK_UUID, it.thread + 2);
+            if (block->begin)
+                proto_string(&track_event, TRACK_EVENT_NAME, lkdbg_profile_string(profile, block->name));
+
+            LK_U64 deltas[LKDBG_PERF_COUNTER_COUNT];
+            LK_U32 mask = block->begin ? 0 : lkdbg_profile_perf_counters(profile, it.thread, event, deltas);
+            for (int i = 0; i < LKDBG_PERF_COUNTER_COUNT; i++)
+            {
+                if (!(mask & (1u << i))) continue;
+
+                Proto annotation;
+                proto_string(&annotation, DEBUG_ANNOTATION_NAME, lkdbg_perf_counter_name(i));
+                proto_uint  (&annotation, DEBUG_ANNOTATION_UINT_VALUE, deltas[i]);
+                proto_message(&track_event, TRACK_EVENT_DEBUG_ANNOTATIONS, &annotation);
+            }
+
+            proto_uint   (&packet, PACKET_TIMESTAMP, nanoseconds);
+            proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+            proto_message(&packet, PACKET_TRACK_EVENT, &track_event);
+            write_packet(out, &packet);
+        }
+        else if (event->kind == LKDBG_COUNTER)
+        {
+            LK_F64 value;
+            if (!lkdbg_profile_counter_value(profile, it.thread, event, &value)) continue;
+
+            auto track = counter_tracks.find(event->counter.name);
+            if (track == counter_tracks.end())
+            {
+                LK_U64 uuid = PERFETTO_FIRST_COUNTER_UUID + counter_tracks.size();
+                track = counter_tracks.insert({ event->counter.name, uuid }).first;
+
+                Proto counter_descriptor;
+                Proto descriptor;
+                proto_uint   (&descriptor, TRACK_DESCRIPTOR_UUID, uuid);
+                proto_uint   (&descriptor, TRACK_DESCRIPTOR_PARENT_UUID, PERFETTO_PROCESS_UUID);
+                proto_string (&descriptor, TRACK_DESCRIPTOR_NAME, lkdbg_profile_string(profile, event->counter.name));
+                proto_message(&descriptor, TRACK_DESCRIPTOR_COUNTER, &counter_descriptor);
+
+                proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+                proto_message(&packet, PACKET_TRACK_DESCRIPTOR, &descriptor);
+                write_packet(out, &packet);
+            }
+
+            Proto track_event;
+            proto_uint   (&track_event, TRACK_EVENT_TYPE, TRACK_EVENT_COUNTER);
+            proto_uint   (&track_event, TRACK_EVENT_TRACK_UUID, track->second);
+            proto_double (&track_event, TRACK_EVENT_DOUBLE_COUNTER_VALUE, value);
+
+            proto_uint   (&packet, PACKET_TIMESTAMP, nanoseconds);
+            proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+            proto_message(&packet, PACKET_TRACK_EVENT, &track_event);
+            write_packet(out, &packet);
+        }
+        else if (event->kind == LKDBG_FLOW)
+        {
+            const LKDBG_Flow* flow = &event->flow;
+            if (flow->phase == LKDBG_FLOW_PHASE_BEGIN)
+            {
+                if (const void* name_ptr = lkdbg_profile_flow_name(profile, it.thread, event))
+                    flow_names[flow->id] = name_ptr;
+            }
+            auto found = flow_names.find(flow->id);
+            const char* name = found != flow_names.end() ? lkdbg_profile_string(profile, found->second) : "flow";
+
+            Proto track_event;
+            proto_uint   (&track_event, TRACK_EVENT_TYPE, TRACK_EVENT_INSTANT);
+            proto_uint   (&track_event, TRACK_EVENT_TRACK_UUID, it.thread + 2);
+            proto_string (&track_event, TRACK_EVENT_NAME, name);
+            proto_fixed64(&track_event, flow->phase == LKDBG_FLOW_PHASE_END ? TRACK_EVENT_TERMINATING_FLOW_IDS : TRACK_EVENT_FLOW_IDS, flow->id);
+
+            proto_uint   (&packet, PACKET_TIMESTAMP, nanoseconds);
+            proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+            proto_message(&packet, PACKET_TRACK_EVENT, &track_event);
+            write_packet(out, &packet);
+
+            if (flow->phase == LKDBG_FLOW_PHASE_END)
+                flow_names.erase(flow->id);
+        }
+        else if (event->kind == LKDBG_MARK)
+        {
+            Proto track_event;
+            proto_uint   (&track_event, TRACK_EVENT_TYPE, TRACK_EVENT_INSTANT);
+            proto_uint   (&track_event, TRACK_EVENT_TRACK_UUID, it.thread + 2);
+            proto_string (&track_event, TRACK_EVENT_NAME, lkdbg_profile_string(profile, event->mark.name));
+
+            proto_uint   (&packet, PACKET_TIMESTAMP, nanoseconds);
+            proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+            proto_message(&packet, PACKET_TRACK_EVENT, &track_event);
+            write_packet(out, &packet);
+        }
+        else if (event->kind == LKDBG_SAMPLE)
+        {
+            const LKDBG_Sample* sample = &event->sample;
+            if (sample->depth != 0) continue;
+
+            Proto annotation;
+            proto_string(&annotation, DEBUG_ANNOTATION_NAME, "stack");
+            proto_string(&annotation, DEBUG_ANNOTATION_STRING_VALUE, sample_stack(profile, it.thread, event).c_str());
+
+            Proto track_event;
+            proto_uint   (&track_event, TRACK_EVENT_TYPE, TRACK_EVENT_INSTANT);
+            proto_uint   (&track_event, TRACK_EVENT_TRACK_UUID, it.thread + 2);
+            proto_string (&track_event, TRACK_EVENT_NAME, lkdbg_profile_string(profile, (const void*)(uintptr_t) sample->address));
+            proto_message(&track_event, TRACK_EVENT_DEBUG_ANNOTATIONS, &annotation);
+
+            proto_uint   (&packet, PACKET_TIMESTAMP, nanoseconds);
+            proto_uint   (&packet, PACKET_TRUSTED_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+            proto_message(&packet, PACKET_TRACK_EVENT, &track_event);
+            write_packet(out, &packet);
+        }
+        else if (event->kind == LKDBG_CONTEXT_SWITCH)
+        {
+            const LKDBG_Context_Switch* context_switch = &event->context_switch;
+            Processor_State* state = &processors[context_switch->processor];
+            write_perfetto_sched_switch(out, profile, context_switch->processor, state, context_switch, nanoseconds);
+
+            state->active = true;
+            state->thread_id = context_switch->thread_id;
+            state->since = context_switch->time;
+        }
+    }
+    lkdbg_profile_end(&it);
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: lk_debug_export profile.lkdbg output.json|output.perfetto\n");
+        exit(1);
+    }
+
+    char* profile_path = argv[1];
+    char* output_path = argv[2];
+
+    LKDBG_Profile profile;
+    if (!lkdbg_open_profile(&profile, profile_path))
+    {
+        printf("Failed to open profile %s, or it isn't a valid lk_debug profile.\n", profile_path);
+        exit(1);
+    }
+
+    FILE* out = fopen(output_path, "wb");
+    if (!out)
+    {
+        printf("Failed to open %s for writing!\n", output_path);
+        exit(1);
+    }
+
+    static char out_buffer[1024 * 1024];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    if (ends_with(output_path, ".json"))
+        export_json(&profile, out);
+    else
+        export_perfetto(&profile, out);
+
+    fclose(out);
+    lkdbg_close_profile(&profile);
+
+    return EXIT_SUCCESS;
+}
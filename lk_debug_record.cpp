@@ -0,0 +1,366 @@
+//  lk_debug_record.cpp - public domain receiver for live lk_debug streams
+//  no warranty is offered or implied
+
+/*********************************************************************************************
+
+Usage:
+    lk_debug_record [options] socket_path profile.lkdbg
+
+Options:
+    -q          don't print a status line every second
+
+Listens on a Unix domain socket for a program that calls lkdbg_stream(socket_path), and writes what it
+receives to a normal profile, which all the other tools can read. Start this first. The profile is written
+when the program calls lkdbg_end(), when it exits without calling it, or when this is stopped with Ctrl+C.
+
+Events the program had to drop because we didn't keep up, or because its flight recorder went around
+before they were sent, are missing from the profile, so blocks around a gap can end without beginning or
+begin without ending. The tools handle that the same way they handle the edges of a snapshot. The
+status line and the summary at the end say how many were dropped.
+
+Events are kept in memory until the end. Only available on Linux, like lkdbg_stream().
+
+ *********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LKDBG_READER_IMPLEMENTATION
+#include "lk_debug.h"
+
+#include <vector>
+#include <map>
+#include <algorithm>
+
+struct Thread
+{
+    LK_U32 thread_id = 0;
+    const char* name = 0;
+    std::vector<LKDBG_Event> events;
+    LK_U64 dropped = 0;
+};
+
+struct Recording
+{
+    bool has_header = false;
+    bool ended = false;
+    LKDBG_File_Header header;
+    std::map<LK_U32, Thread> threads;
+    std::map<const void*, LKDBG_File_String> strings;
+    LK_U64 event_count = 0;
+    LK_U64 dropped = 0;
+};
+
+volatile sig_atomic_t interrupted = 0;
+
+void handle_interrupt(int signal_number)
+{
+    (void) signal_number;
+    interrupted = 1;
+}
+
+double seconds_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Same as in lk_debug_analyze.cpp.
+bool continues_previous_event(const LKDBG_Event* event)
+{
+    switch (event->kind)
+    {
+    case LKDBG_PERF_COUNTER:    return true;
+    case LKDBG_COUNTER_VALUE:   return true;
+    case LKDBG_FLOW_NAME:       return true;
+    case LKDBG_ALLOCATION_SIZE: return true;
+    case LKDBG_ALLOCATION_SITE: return true;
+    case LKDBG_SAMPLE:          return event->sample.depth != 0;
+    default:                    return false;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Receiving
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns false if the message is malformed.
+bool receive_message(Recording* recording, const LK_U8* data, LK_U64 size)
+{
+    if (size < sizeof(LKDBG_Stream_Message)) return false;
+
+    LKDBG_Stream_Message message;
+    memcpy(&message, data, sizeof(message));
+    if (message.magic != LKDBG_STREAM_MAGIC) return false;
+    data += sizeof(message);
+    size -= sizeof(message);
+
+    if (message.kind == LKDBG_STREAM_HEADER || message.kind == LKDBG_STREAM_END)
+    {
+        if (size != sizeof(LKDBG_File_Header)) return false;
+        memcpy(&recording->header, data, sizeof(LKDBG_File_Header));
+        if (recording->header.magic != LKDBG_FILE_MAGIC || recording->header.version != LKDBG_FILE_VERSION) return false;
+
+        recording->has_header = true;
+        if (message.kind == LKDBG_STREAM_END) recording->ended = true;
+        return true;
+    }
+
+    if (message.kind != LKDBG_STREAM_EVENTS) return false;
+    if (message.string_count > size / sizeof(LKDBG_File_String)) return false;
+    if (size != message.string_count * sizeof(LKDBG_File_String) + message.event_count * sizeof(LKDBG_Event)) return false;
+
+    for (LK_U64 i = 0; i < message.string_count; i++)
+    {
+        LKDBG_File_String string;
+        memcpy(&string, data + i * sizeof(LKDBG_File_String), sizeof(string));
+        string.string[sizeof(string.string) - 1] = 0;
+        recording->strings[string.ptr] = string;
+    }
+    data += message.string_count * sizeof(LKDBG_File_String);
+
+    Thread* thread = &recording->threads[message.thread_index];
+    thread->thread_id = message.thread_id;
+    thread->name = message.thread_name;
+
+    // events that belonged to something that was dropped can't be read without it
+    LK_U64 skip = 0;
+    if (message.dropped)
+    {
+        LKDBG_Event event;
+        while (skip < message.event_count)
+        {
+            memcpy(&event, data + skip * sizeof(LKDBG_Event), sizeof(event));
+            if (!continues_previous_event(&event)) break;
+            skip++;
+        }
+    }
+
+    LK_U64 old_count = thread->events.size();
+    thread->events.resize(old_count + message.event_count - skip);
+    memcpy(thread->events.data() + old_count, data + skip * sizeof(LKDBG_Event), (message.event_count - skip) * sizeof(LKDBG_Event));
+
+    thread->dropped += message.dropped + skip;
+    recording->dropped += message.dropped + skip;
+    recording->event_count += message.event_count - skip;
+    return true;
+}
+
+int accept_connection(const char* socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        printf("Socket path %s is too long\n", socket_path);
+        exit(1);
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+    {
+        printf("Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+
+    printf("Waiting for a connection on %s\n", socket_path);
+    int connection = -1;
+    while (connection < 0 && !interrupted)
+    {
+        connection = accept(listener, 0, 0);
+        if (connection < 0 && errno != EINTR)
+        {
+            printf("Failed to accept a connection on %s: %s\n", socket_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return connection;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////////////////////////
+
+// The same layout lkdbg_end() writes, see LKDBG_File_Header.
+bool write_profile(Recording* recording, const char* path)
+{
+    LK_U64 index_count = 0;
+    for (auto& entry : recording->threads)
+    {
+        // mostly in order already, but context switches and samples arrive in batches
+        std::vector<LKDBG_Event>* events = &entry.second.events;
+        std::stable_sort(events->begin(), events->end(), [](const LKDBG_Event& a, const LKDBG_Event& b)
+        {
+            return lkdbg_get_event_time(&a) < lkdbg_get_event_time(&b);
+        });
+        index_count += (events->size() + LKDBG_INDEX_STRIDE - 1) / LKDBG_INDEX_STRIDE;
+    }
+
+    FILE* out = fopen(path, "wb");
+    if (!out)
+    {
+        printf("Failed to open profile file %s for writing\n", path);
+        return false;
+    }
+
+    LKDBG_File_Header header = recording->header;
+    header.string_count = recording->strings.size();
+    header.thread_count = recording->threads.size();
+    header.event_count = recording->event_count;
+    header.index_stride = LKDBG_INDEX_STRIDE;
+    header.index_count = index_count;
+    fwrite(&header, sizeof(header), 1, out);
+
+    // the reader looks strings up with a binary search by pointer, which is the map's order
+    for (auto& entry : recording->strings)
+        fwrite(&entry.second, sizeof(LKDBG_File_String), 1, out);
+
+    LK_U64 first_event = 0;
+    LK_U64 first_index = 0;
+    for (auto& entry : recording->threads)
+    {
+        Thread* thread = &entry.second;
+
+        LKDBG_File_Thread thread_data = {};
+        thread_data.thread_id = thread->thread_id;
+        thread_data.name = thread->name;
+        thread_data.first_event = first_event;
+        thread_data.event_count = thread->events.size();
+        thread_data.first_index = first_index;
+        thread_data.index_count = (thread->events.size() + LKDBG_INDEX_STRIDE - 1) / LKDBG_INDEX_STRIDE;
+        fwrite(&thread_data, sizeof(thread_data), 1, out);
+
+        first_event += thread_data.event_count;
+        first_index += thread_data.index_count;
+    }
+
+    for (auto& entry : recording->threads)
+        fwrite(entry.second.events.data(), sizeof(LKDBG_Event), entry.second.events.size(), out);
+
+    for (auto& entry : recording->threads)
+    {
+        std::vector<LKDBG_Event>* events = &entry.second.events;
+        for (LK_U64 i = 0; i < events->size(); i += LKDBG_INDEX_STRIDE)
+        {
+            LK_U64 time = lkdbg_get_event_time(&(*events)[i]);
+            fwrite(&time, sizeof(time), 1, out);
+        }
+    }
+
+    fclose(out);
+    return true;
+}
+
+
+int main(int argc, char** argv)
+{
+    bool quiet = false;
+    const char* socket_path = 0;
+    const char* profile_path = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-q"))
+            quiet = true;
+        else if (!socket_path)
+            socket_path = argv[i];
+        else if (!profile_path)
+            profile_path = argv[i];
+        else
+            socket_path = 0;
+    }
+
+    if (!socket_path || !profile_path)
+    {
+        printf("Usage: lk_debug_record [-q] socket_path profile.lkdbg\n");
+        exit(1);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    int connection = accept_connection(socket_path);
+    if (connection < 0) exit(1);
+
+    Recording recording;
+    std::vector<LK_U8> buffer(LKDBG_STREAM_MESSAGE_SIZE);
+    double start = seconds_now();
+    double last_status = start;
+
+    while (!interrupted && !recording.ended)
+    {
+        struct pollfd fd = { connection, POLLIN, 0 };
+        int ready = poll(&fd, 1, 100);
+        if (ready > 0)
+        {
+            ssize_t size = recv(connection, buffer.data(), buffer.size(), MSG_TRUNC);
+            if (size == 0) break; // the program exited without lkdbg_end()
+            if (size < 0)
+            {
+                if (errno == EINTR) continue;
+                printf("Failed to receive: %s\n", strerror(errno));
+                break;
+            }
+            if ((LK_U64) size > buffer.size() || !receive_message(&recording, buffer.data(), (LK_U64) size))
+            {
+                printf("Received a malformed message, is the program using the same version of lk_debug.h?\n");
+                break;
+            }
+        }
+
+        double now = seconds_now();
+        if (!quiet && now - last_status >= 1.0)
+        {
+            printf("%8.1f s  %12llu events  %4llu threads  %10llu dropped\n", now - start,
+                   (unsigned long long) recording.event_count, (unsigned long long) recording.threads.size(),
+                   (unsigned long long) recording.dropped);
+            fflush(stdout);
+            last_status = now;
+        }
+    }
+    close(connection);
+
+    if (!recording.has_header)
+    {
+        printf("Nothing was received\n");
+        exit(1);
+    }
+
+    if (!write_profile(&recording, profile_path)) exit(1);
+
+    printf("Wrote %llu events from %llu threads to %s", (unsigned long long) recording.event_count,
+           (unsigned long long) recording.threads.size(), profile_path);
+    if (recording.dropped)
+        printf(", %llu events were dropped", (unsigned long long) recording.dropped);
+    printf("\n");
+    for (auto& entry : recording.threads)
+    {
+        Thread* thread = &entry.second;
+        if (!thread->dropped) continue;
+        auto name = recording.strings.find(thread->name);
+        printf("    %10llu dropped on %s\n", (unsigned long long) thread->dropped,
+               name != recording.strings.end() ? name->second.string : "?");
+    }
+    return 0;
+}
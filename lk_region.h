@@ -139,6 +139,23 @@ extern "C"
 void* lk_region_os_alloc(size_t size, const char* caller_name);
 void lk_region_os_free(void* memory, size_t size);
 
+/* Define these before the implementation to find out what regions do with memory, for example to
+   put it on an lk_debug timeline:
+       #define LK_REGION_TRACK_PAGE_ALLOC(memory, size, caller_name) LKDBG_ALLOCATE(memory, size, LKDBG_MEMORY_PAGES, caller_name)
+       #define LK_REGION_TRACK_PAGE_FREE(memory, size)               LKDBG_DEALLOCATE(memory, LKDBG_MEMORY_PAGES)
+       #define LK_REGION_TRACK_ALLOC(memory, size, caller_name)      LKDBG_ALLOCATE(memory, size, LKDBG_MEMORY_REGION, caller_name)
+   Pages are what regions get from lk_region_os_alloc(), and allocations are carved out of them;
+   those are never freed one by one. caller_name is 0 unless LK_REGION_COLLECT_CALLER_INFO is defined. */
+#ifndef LK_REGION_TRACK_PAGE_ALLOC
+#define LK_REGION_TRACK_PAGE_ALLOC(memory, size, caller_name)
+#endif
+#ifndef LK_REGION_TRACK_PAGE_FREE
+#define LK_REGION_TRACK_PAGE_FREE(memory, size)
+#endif
+#ifndef LK_REGION_TRACK_ALLOC
+#define LK_REGION_TRACK_ALLOC(memory, size, caller_name)
+#endif
+
 #ifdef _WIN32
 /*********************************************************************************************
   Windows-specific
@@ -177,6 +194,19 @@ typedef struct
     uintptr_t size;
 } LK_Page_Header;
 
+static void* lk__region_page_alloc(size_t size, const char* caller_name)
+{
+    void* memory = lk_region_os_alloc(size, caller_name);
+    LK_REGION_TRACK_PAGE_ALLOC(memory, size, caller_name);
+    return memory;
+}
+
+static void lk__region_page_free(void* memory, size_t size)
+{
+    LK_REGION_TRACK_PAGE_FREE(memory, size);
+    lk_region_os_free(memory, size);
+}
+
 #ifdef LK_REGION_COLLECT_CALLER_INFO
 void* lk_region_alloc_(LK_Region* region, size_t size, size_t alignment, const char* caller_name)
 {
@@ -206,7 +236,7 @@ void* lk_region_alloc(LK_Region* region, size_t size, size_t alignment)
             alignment = sizeof(LK_Page_Header);
 
         page_size = size + alignment;
-        byte* page = (byte*) lk_region_os_alloc(page_size, caller_name);
+        byte* page = (byte*) lk__region_page_alloc(page_size, caller_name);
 
         LK_Page_Header* header = (LK_Page_Header*) page;
         header->next = region->alloc_head;
@@ -215,6 +245,7 @@ void* lk_region_alloc(LK_Region* region, size_t size, size_t alignment)
         region->alloc_head = header;
         region->alloc_count++;
 
+        LK_REGION_TRACK_ALLOC(page + alignment, size, caller_name);
         return page + alignment;
     }
 
@@ -237,7 +268,7 @@ void* lk_region_alloc(LK_Region* region, size_t size, size_t alignment)
         }
         else
         {
-            page = (byte*) lk_region_os_alloc(page_size, caller_name);
+            page = (byte*) lk__region_page_alloc(page_size, caller_name);
         }
 
         LK_Page_Header* header = (LK_Page_Header*) page;
@@ -256,6 +287,7 @@ void* lk_region_alloc(LK_Region* region, size_t size, size_t alignment)
     /* success */
     void* result = (void*) cursor_address;
     region->cursor = (void*) end_address;
+    LK_REGION_TRACK_ALLOC(result, size, caller_name);
     return result;
 }
 
@@ -267,13 +299,13 @@ void lk_region_free(LK_Region* region)
         LK_Page_Header* header = (LK_Page_Header*) memory;
         void* next_memory = header->next;
 
-        lk_region_os_free(memory, header->size);
+        lk__region_page_free(memory, header->size);
         memory = next_memory;
     }
 
     if (region->next_page)
     {
-        lk_region_os_free(region->next_page, region->next_page_size);
+        lk__region_page_free(region->next_page, region->next_page_size);
         region->next_page      = 0;
         region->next_page_size = 0;
     }
@@ -308,7 +340,7 @@ void lk_region_rewind(LK_Region* region, LK_Region_Cursor* cursor)
             if (region->next_page)
             {
                 region->alloc_count--;
-                lk_region_os_free(region->next_page, region->next_page_size);
+                lk__region_page_free(region->next_page, region->next_page_size);
             }
             region->next_page      = memory;
             region->next_page_size = header->size;
@@ -316,7 +348,7 @@ void lk_region_rewind(LK_Region* region, LK_Region_Cursor* cursor)
         else
         {
             region->alloc_count--;
-            lk_region_os_free(memory, header->size);
+            lk__region_page_free(memory, header->size);
         }
 
         memory = next_memory;